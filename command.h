@@ -1,17 +1,21 @@
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <utility>
 
+#include "lz.h"
 #include "utility.h"
 
 using namespace std;
 
-enum class CommandType {
+enum class CommandType : uint8_t {
   // Insert a single character at position.
   // No memory
   InsertChar,
 
-  // Insert a string.
+  // Insert a string (might contain new lines).
   // Memory: snippet
   InsertSlice,
 
@@ -45,9 +49,11 @@ struct Command {
 
   int row{-1};
   int col{-1};
+  char memoryChr{'\0'};
 
   string memoryStr{};
-  char memoryChr{'\0'};
+  // A large `memoryStr` is kept compressed while the command is in the history, see `History::record`.
+  shared_ptr<const PackedString> packedMemory{};
 
   Command(CommandType type, int row) : type(type), row(row) {}
 
@@ -55,10 +61,10 @@ struct Command {
       : type(type), row(row), col(col) {}
 
   Command(CommandType type, int row, int col, string memoryStr)
-      : type(type), row(row), col(col), memoryStr(memoryStr) {}
+      : type(type), row(row), col(col), memoryStr(std::move(memoryStr)) {}
 
   Command(CommandType type, int row, string memoryStr)
-      : type(type), row(row), memoryStr(memoryStr) {}
+      : type(type), row(row), memoryStr(std::move(memoryStr)) {}
 
   Command(CommandType type, int row, int col, char memoryChr)
       : type(type), row(row), col(col), memoryChr(memoryChr) {}
@@ -76,11 +82,11 @@ struct Command {
   }
 
   static inline Command makeDeleteLine(int row, string memory) {
-    return Command(CommandType::DeleteLine, row, memory);
+    return Command(CommandType::DeleteLine, row, std::move(memory));
   }
 
   static inline Command makeDeleteSlice(int row, int col, string memory) {
-    return Command(CommandType::DeleteSlice, row, col, memory);
+    return Command(CommandType::DeleteSlice, row, col, std::move(memory));
   }
 
   static inline Command makeSplitLine(int row, int col) {
@@ -88,7 +94,7 @@ struct Command {
   }
 
   static inline Command makeInsertSlice(int row, int col, string memory) {
-    return Command(CommandType::InsertSlice, row, col, memory);
+    return Command(CommandType::InsertSlice, row, col, std::move(memory));
   }
 
   static inline Command makeSwapLine(int row) {
@@ -2,6 +2,9 @@
 
 #include <unordered_map>
 
+#include "edit_log.h"
+#include "file_writer.h"
+#include "history_journal.h"
 #include "terminal_util.h"
 #include "utility.h"
 
@@ -40,12 +43,19 @@ static unordered_map<EscapeChar, InputStroke> escapeCharToInputStrokeMap{
     {EscapeChar::AltEqual, InputStroke::AltEqual},
     {EscapeChar::AltS, InputStroke::AltS},
     {EscapeChar::AltK, InputStroke::AltK},
+    {EscapeChar::BracketedPaste, InputStroke::BracketedPaste},
 };
 
 struct Config {
   int tabSize{2};
   void setTabSize(int newTabSize) { tabSize = newTabSize; }
 
+  FsyncPolicy fsyncPolicy{FsyncPolicy::File};
+  // Where the undo history of the files is kept across sessions, empty: kept in memory only.
+  string undoJournalDir{defaultUndoJournalDir()};
+  // Where the unsaved edits are logged for crash recovery, empty: not logged.
+  string editLogDir{defaultEditLogDir()};
+
   // TODO: This is just a default set. This should be populated from a
   // keymapping file defined by the user.
   unordered_map<InputStroke, TextEditorAction> keyMapping{
@@ -98,6 +108,7 @@ struct Config {
       {InputStroke::Alt0, TextEditorAction::ChangeActiveView9},
       {InputStroke::AltS, TextEditorAction::NewSplitUnit},
       {InputStroke::AltK, TextEditorAction::CloseTextView},
+      {InputStroke::BracketedPaste, TextEditorAction::BracketedPaste},
   };
 
   TextEditorAction textEditorActionForKeystroke(TypedChar tc) {
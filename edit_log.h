@@ -0,0 +1,298 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "command.h"
+#include "debug.h"
+#include "file_reader.h"
+#include "history.h"
+#include "history_journal.h"
+
+// Edits made within this long are written and synced together.
+#define EDIT_LOG_COMMIT_INTERVAL_MS 200
+// Record: payload length (u32), payload checksum (u64), payload.
+#define EDIT_LOG_RECORD_OVERHEAD 12
+
+using namespace std;
+
+string defaultEditLogDir() {
+  return defaultCacheDir("wal");
+}
+
+/**
+ * A command as it was applied to the buffer: executed, or reversed by an undo.
+ */
+struct EditLogEntry {
+  Command cmd;
+  bool isReverse{false};
+};
+
+/**
+ * Write ahead log of the edits made on a file since it was last saved, for recovering them after a crash. The first
+ * record is the header: the file (its stamp and path) the edits apply to. Appends only go to memory, a committer thread
+ * writes and syncs them in one batch every `commitInterval` (group commit) - typing never waits for the disk.
+ */
+struct EditLog {
+  int fd{-1};
+  chrono::milliseconds commitInterval{EDIT_LOG_COMMIT_INTERVAL_MS};
+
+  EditLog() {
+  }
+  EditLog(EditLog &) = delete;
+  EditLog &operator=(EditLog &) = delete;
+
+  ~EditLog() {
+    if (committer.joinable()) {
+      {
+        lock_guard<mutex> lock(pendingMutex);
+        isStopping = true;
+      }
+      wakeUp.notify_one();
+      committer.join();
+    }
+
+    if (fd != -1) {
+      commit();
+      close(fd);
+    }
+  }
+
+  // Named by the hash of the canonical path of the file.
+  static string pathFor(const string &dir, const string &filePath) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016lx.wal", fnv1a(HistoryJournal::canonicalPath(filePath)));
+    return dir + "/" + name;
+  }
+
+  /**
+   * Opens (or creates) the log of `filePath` in `dir`. The edits it holds on the file as it's now (`stamp`) are read
+   * into `recovered` and stay in the log until the next `truncate`. Edits on another version of the file can't be
+   * applied, those are dropped. Fails when another view (or editor) has the file open with its log.
+   */
+  bool open(const string &dir, const string &filePath, const FileStamp &stamp, vector<EditLogEntry> &recovered) {
+    error_code ec{};
+    filesystem::create_directories(dir, ec);
+
+    fd = ::open(pathFor(dir, filePath).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) return false;
+    // One writer per log, released with the fd.
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+      close(fd);
+      fd = -1;
+      return false;
+    }
+
+    canonicalPath = HistoryJournal::canonicalPath(filePath);
+    header = encodeHeader(stamp);
+
+    fileSize = readEntries(recovered);
+    hasHeader = fileSize > 0;
+    // Cuts what's after the last whole record (a write cut short by the crash) or the log of another version.
+    if (ftruncate(fd, fileSize) == -1) return false;
+
+    committer = thread([this] { runCommitter(); });
+    return true;
+  }
+
+  void append(const Command &cmd, bool isReverse) {
+    lock_guard<mutex> lock(pendingMutex);
+    if (isFailed) return;
+
+    if (!hasHeader) {
+      putRecord(pending, header);
+      hasHeader = true;
+    }
+    putRecord(pending, encodeEntry(cmd, isReverse));
+
+    wakeUp.notify_one();
+  }
+
+  /**
+   * Writes and syncs the pending edits now - it's what the committer thread does when its interval is up.
+   */
+  bool commit() {
+    lock_guard<mutex> fileLock(fileMutex);
+
+    string batch{};
+    {
+      lock_guard<mutex> lock(pendingMutex);
+      if (isFailed) return false;
+      batch.swap(pending);
+    }
+    if (batch.empty()) return true;
+
+    if (!writeAt(batch, fileSize) || fdatasync(fd) == -1) {
+      DLOG("Cannot write edit log: %s", strerror(errno));
+
+      // The edits after a lost batch don't apply to the file - no log until the next save.
+      lock_guard<mutex> lock(pendingMutex);
+      isFailed = true;
+      pending.clear();
+      fileSize = 0;
+      if (ftruncate(fd, 0) == -1) DLOG("Cannot truncate edit log: %s", strerror(errno));
+      return false;
+    }
+
+    fileSize += batch.size();
+    return true;
+  }
+
+  /**
+   * Empties the log, the edits from now on apply to the file as it's at `stamp` (just saved).
+   */
+  void truncate(const FileStamp &stamp) {
+    lock_guard<mutex> fileLock(fileMutex);
+    lock_guard<mutex> lock(pendingMutex);
+
+    pending.clear();
+    header = encodeHeader(stamp);
+    hasHeader = false;
+    isFailed = false;
+    fileSize = 0;
+
+    if (ftruncate(fd, 0) == -1) {
+      DLOG("Cannot truncate edit log: %s", strerror(errno));
+      isFailed = true;
+    }
+  }
+
+ private:
+  string canonicalPath{};
+  string header{};
+
+  // Guards the file: the committer's write and the truncate of a save.
+  mutex fileMutex{};
+  size_t fileSize{0};
+
+  mutex pendingMutex{};
+  condition_variable wakeUp{};
+  string pending{};
+  bool hasHeader{false};
+  bool isFailed{false};
+  bool isStopping{false};
+
+  thread committer{};
+
+  void runCommitter() {
+    unique_lock<mutex> lock(pendingMutex);
+    while (!isStopping) {
+      wakeUp.wait(lock, [&] { return isStopping || !pending.empty(); });
+      // Lets the edits of the interval join the batch.
+      wakeUp.wait_for(lock, commitInterval, [&] { return isStopping; });
+
+      lock.unlock();
+      commit();
+      lock.lock();
+    }
+  }
+
+  string encodeHeader(const FileStamp &stamp) {
+    string out{};
+    History::put<uint64_t>(out, stamp.device);
+    History::put<uint64_t>(out, stamp.inode);
+    History::put<uint64_t>(out, stamp.size);
+    History::put<int64_t>(out, stamp.modifiedNs);
+    out.append(canonicalPath);
+    return out;
+  }
+
+  static string encodeEntry(const Command &cmd, bool isReverse) {
+    string out{};
+    History::put<uint8_t>(out, isReverse);
+    History::put<uint8_t>(out, (uint8_t)cmd.type);
+    History::put<int32_t>(out, cmd.row);
+    History::put<int32_t>(out, cmd.col);
+    History::put<char>(out, cmd.memoryChr);
+    out.append(cmd.memoryStr);
+    return out;
+  }
+
+  static bool decodeEntry(string_view in, vector<EditLogEntry> &out) {
+    uint8_t isReverse, type;
+    int32_t row, col;
+    char memoryChr;
+    if (!History::get(in, isReverse) || !History::get(in, type) || !History::get(in, row) || !History::get(in, col) ||
+        !History::get(in, memoryChr) || type > (uint8_t)CommandType::SwapLine) {
+      return false;
+    }
+
+    Command cmd{(CommandType)type, row, col, memoryChr};
+    cmd.memoryStr.assign(in);
+    out.push_back(EditLogEntry{move(cmd), isReverse != 0});
+    return true;
+  }
+
+  static void putRecord(string &out, string_view payload) {
+    History::put<uint32_t>(out, payload.size());
+    History::put<uint64_t>(out, fnv1a(payload));
+    out.append(payload);
+  }
+
+  /**
+   * Reads the entries of the log into `out`. Returns the end of the last whole record, 0 when the log is empty or it's
+   * not of the file as it's now.
+   */
+  size_t readEntries(vector<EditLogEntry> &out) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) return 0;
+
+    string data(st.st_size, '\0');
+    if (pread(fd, data.data(), data.size(), 0) != (ssize_t)data.size()) return 0;
+
+    size_t end{0};
+    string_view in{data};
+    while (true) {
+      uint32_t length;
+      uint64_t checksum;
+      if (!History::get(in, length) || !History::get(in, checksum) || in.size() < length) break;
+
+      string_view payload = in.substr(0, length);
+      in.remove_prefix(length);
+      if (fnv1a(payload) != checksum) break;
+
+      if (end == 0) {
+        if (payload != header) {
+          DLOG("Edit log is not of %s as it's now", canonicalPath.c_str());
+          return 0;
+        }
+      } else if (!decodeEntry(payload, out)) {
+        break;
+      }
+
+      end += length + EDIT_LOG_RECORD_OVERHEAD;
+    }
+
+    return end;
+  }
+
+  bool writeAt(string_view data, size_t offset) {
+    while (!data.empty()) {
+      ssize_t written = pwrite(fd, data.data(), data.size(), offset);
+      if (written == -1) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+
+      data.remove_prefix(written);
+      offset += written;
+    }
+
+    return true;
+  }
+};
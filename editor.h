@@ -20,8 +20,11 @@
 #include "command.h"
 #include "config.h"
 #include "debug.h"
+#include "event_loop.h"
 #include "file_watcher.h"
+#include "input_decoder.h"
 #include "prompt.h"
+#include "screen_renderer.h"
 #include "split_unit.h"
 #include "terminal_util.h"
 #include "text_manipulator.h"
@@ -59,6 +62,12 @@ struct Editor {
 
   optional<string> searchTerm{nullopt};
 
+  ScreenRenderer screenRenderer{};
+
+  EventLoop eventLoop{};
+
+  InputDecoder inputDecoder{};
+
   Editor(Config config) : config(config) {
   }
 
@@ -66,6 +75,10 @@ struct Editor {
     preserveTermiosOriginalState();
     enableRawMode();
 
+    eventLoop.init();
+
+    enableBracketedPaste();
+
     updateDimensions();
 
     newSplitUnit();
@@ -80,7 +93,7 @@ struct Editor {
 
   void saveFile() {
     if (activeTextView()->filePath.has_value()) {
-      activeTextView()->saveFile();
+      activeTextView()->saveFile(config.fsyncPolicy);
     } else {
       openPrompt("New file needs a name > ", PromptCommand::SaveFileAs);
     }
@@ -89,7 +102,13 @@ struct Editor {
   void loadFile(string filePath) {
     if (filePath.empty()) return;
 
+    activeTextView()->undoJournalDir = config.undoJournalDir;
+    activeTextView()->editLogDir = config.editLogDir;
     activeTextView()->loadFile(filePath);
+
+    if (!activeTextView()->recoverableEdits.empty()) {
+      openPrompt("Unsaved edits found, press (r) to recover > ", PromptCommand::RecoverEdits);
+    }
   }
 
   void changeActiveView(int idx) {
@@ -101,31 +120,101 @@ struct Editor {
   }
 
   void runLoop() {
-    TypedChar tc;
+    bool needsRedraw{true};
 
     while (!quitRequested) {
-      refreshScreen();
+      if (needsRedraw) refreshScreen();
+      needsRedraw = false;
+
+      eventLoop.syncFileWatchFds(fileWatchFds());
+
+      // Idle work (coloring the rest of the files) keeps the wait non blocking until it's done.
+      bool hasIdleWork = syntaxColoringCatchUp();
+
+      for (auto& event : eventLoop.wait(hasIdleWork ? 0 : -1)) {
+        switch (event.source) {
+          case EventSource::Input:
+            // Handle all buffered keys before the next redraw.
+            inputDecoder.readAvailable();
+            while (!quitRequested && inputDecoder.hasTypedChars()) executeInput(inputDecoder.nextTypedChar());
+            needsRedraw = true;
+            break;
+          case EventSource::TerminalResize:
+            needsRedraw = true;
+            break;
+          case EventSource::FileWatch:
+            if (markModifiedFileWatchers(event.fd)) needsRedraw = true;
+            break;
+        }
+      }
 
-      if (activeTextView()->fileWatcher.hasBeenModified()) {
+      if (mode == EditorMode::TextEdit && activeTextView()->fileWatcher.hasPendingModification) {
+        activeTextView()->fileWatcher.hasPendingModification = false;
         openPrompt("File change detected, press (r) for reload > ", PromptCommand::FileHasBeenModified);
-        continue;
+        needsRedraw = true;
+      }
+    }
+
+    clearScreen();
+    resetCursorLocation();
+  }
+
+  void executeInput(TypedChar tc) {
+    if (tc.is_failure()) return;
+
+    switch (mode) {
+      case EditorMode::TextEdit:
+        executeTextEditInput(tc);
+        break;
+      case EditorMode::Prompt:
+        executePrompt(tc);
+        break;
+    }
+  }
+
+  vector<int> fileWatchFds() {
+    vector<int> fds{};
+
+    for (auto& splitUnit : splitUnits) {
+      for (auto& textView : splitUnit.textViews) {
+        if (textView.fileWatcher.getFd() != -1) fds.push_back(textView.fileWatcher.getFd());
+      }
+    }
+
+    return fds;
+  }
+
+  /**
+   * Returns true when a followed file got new content or a truncated mapped file got reloaded.
+   */
+  bool markModifiedFileWatchers(int fd) {
+    bool hasFollowedChange{false};
+
+    for (auto& splitUnit : splitUnits) {
+      for (auto& textView : splitUnit.textViews) {
+        if (textView.fileWatcher.getFd() == fd && textView.fileWatcher.hasBeenModified()) {
+          if (textView.reloadIfMappingTruncated()) {
+            hasFollowedChange = true;
+          } else if (textView.isFollowing && textView.followFileAppend()) {
+            hasFollowedChange = true;
+          } else {
+            textView.fileWatcher.hasPendingModification = true;
+          }
+        }
       }
+    }
 
-      tc = readKey();
-      if (tc.is_failure()) continue;
+    return hasFollowedChange;
+  }
 
-      switch (mode) {
-        case EditorMode::TextEdit:
-          executeTextEditInput(tc);
-          break;
-        case EditorMode::Prompt:
-          executePrompt(tc);
-          break;
+  bool syntaxColoringCatchUp() {
+    for (auto& splitUnit : splitUnits) {
+      for (auto& textView : splitUnit.textViews) {
+        if (textView.syntaxColoringCatchUp()) return true;
       }
     }
 
-    clearScreen();
-    resetCursorLocation();
+    return false;
   }
 
   void executeTextEditInput(TypedChar tc) {
@@ -286,11 +375,17 @@ struct Editor {
       case TextEditorAction::CloseTextView:
         closeTextView();
         break;
+      case TextEditorAction::BracketedPaste:
+        activeTextView()->insertPaste(inputDecoder.nextPaste());
+        break;
     }
   }
 
   void executePrompt(TypedChar tc) {
-    if (tc.is_simple()) {
+    if (tc.is_escape() && tc.escape() == EscapeChar::BracketedPaste) {
+      string paste = inputDecoder.nextPaste();
+      prompt.rawMessage.append(paste.substr(0, paste.find('\n')));
+    } else if (tc.is_simple()) {
       if (iscntrl(tc.simple())) {
         if (tc.simple() == ESCAPE) {
           closePrompt();
@@ -328,8 +423,12 @@ struct Editor {
     return terminalDimension.second;
   }
 
-  void drawLines(string& out) {
+  void drawLines() {
+    screenRenderer.beginFrame(textViewRows() + bottomMargin);
+
     for (int lineIdx = 0; lineIdx < textViewRows(); lineIdx++) {
+      string& out = screenRenderer.row(lineIdx);
+
       for (int i = 0; i < (int)splitUnits.size(); i++) {
         splitUnits[i].drawLine(out, lineIdx, searchTerm);
 
@@ -337,9 +436,10 @@ struct Editor {
           out.append("\x1b[2m\x1b[90m|\x1b[0m");
         }
       }
-      out.append("\n\r");
     }
 
+    string& out = screenRenderer.row(textViewRows());
+
     switch (mode) {
       case EditorMode::Prompt:
         out.append("\x1b[0m\x1b[44m");
@@ -378,21 +478,21 @@ struct Editor {
   void refreshScreen() {
     string out{};
 
+    pair<int, int> oldTerminalDimension = terminalDimension;
     updateDimensions();
+    if (oldTerminalDimension != terminalDimension) screenRenderer.invalidate();
 
     // TODO: do something better here, don't check the text view - it might be
     // irrelevant. Make all drawing (split unit, text view, etc) self aware of
     // this - and skip if cannot draw.
     if (activeTextView()->cols <= 1) return;
 
-    hideCursor(out);
-    resetCursorLocation(out);
-    drawLines(out);
+    drawLines();
 
     contextAdjustEditorCursor();
-    setCursorLocation(out, cursor.y, cursor.x);
+    screenRenderer.flush(out, cursor);
 
-    showCursor(out);
+    if (out.empty()) return;
 
     ssize_t res = write(STDOUT_FILENO, out.c_str(), out.size());
     assert(res >= 0);
@@ -420,13 +520,18 @@ struct Editor {
   string generateStatusLine() {
     string out{};
 
-    int rowPosPercentage = 100 * activeTextView()->currentRow() / activeTextView()->lines.line_count;
+    TextView* textView = activeTextView();
+    size_t cursorOffset = textView->buffer->byteOffset(textView->currentRow(), textView->currentCol());
+    int rowPosPercentage = 100 * cursorOffset / max(textView->buffer->totalBytes(), (size_t)1);
+    // Huge files are still being indexed for a while - until then the line count is an estimate.
+    bool isLineCountExact = textView->buffer->isLineCountExact();
 
     char buf[2048];
-    sprintf(buf, " pEditor v0 | File: %s%s | Textarea: %dx%d | Cursor: %dx %dy | %d%%",
+    sprintf(buf, " pEditor v0 | File: %s%s | Textarea: %dx%d | Cursor: %dx %dy | %d%% of %s%lu lines",
             activeTextView()->filePath.value_or("<no file>").c_str(),
             (activeTextView()->isDirty ? " \x1b[94m(edited)\x1b[39m" : ""), splitAreaCols(), textViewRows(),
-            activeTextView()->cursor.x, activeTextView()->cursor.y, rowPosPercentage);
+            activeTextView()->cursor.x, activeTextView()->cursor.y, rowPosPercentage, (isLineCountExact ? "" : "~"),
+            textView->buffer->estimatedLineCount());
 
     out.append(buf);
 
@@ -464,6 +569,8 @@ struct Editor {
     switch (prompt.command) {
       case PromptCommand::SaveFileAs:
         activeTextView()->filePath = optional<string>(prompt.message());
+        activeTextView()->undoJournalDir = config.undoJournalDir;
+        activeTextView()->editLogDir = config.editLogDir;
         saveFile();
         activeTextView()->reloadContent();
         break;
@@ -476,6 +583,9 @@ struct Editor {
       case PromptCommand::FileHasBeenModified:
         executeFileHasBeenModifiedPrompt(prompt.message());
         break;
+      case PromptCommand::RecoverEdits:
+        executeRecoverEditsPrompt(prompt.message());
+        break;
       case PromptCommand::Nothing:
         break;
     }
@@ -505,7 +615,16 @@ struct Editor {
       int lineNo;
       iss >> lineNo;
 
+      // Huge files might not be indexed that far yet.
+      activeTextView()->buffer->ensureLines(max(lineNo, 0) + 1);
       activeTextView()->cursorTo(lineNo, activeTextView()->currentCol());
+    } else if (topCommand == "branch") {
+      activeTextView()->switchHistoryBranch();
+    } else if (topCommand == "ago") {
+      int minutes{0};
+      iss >> minutes;
+
+      activeTextView()->travelTo(chrono::system_clock::now() - chrono::minutes(minutes));
     } else if (topCommand == "search" || topCommand == "s") {
       string term;
       iss >> term;
@@ -516,6 +635,22 @@ struct Editor {
         searchTerm = term;
         jumpToNextSearchHit();
       }
+    } else if (topCommand == "fsync") {
+      string policy;
+      iss >> policy;
+
+      if (policy == "none") {
+        config.fsyncPolicy = FsyncPolicy::None;
+      } else if (policy == "file") {
+        config.fsyncPolicy = FsyncPolicy::File;
+      } else if (policy == "inplace") {
+        config.fsyncPolicy = FsyncPolicy::InPlace;
+      } else if (policy == "full") {
+        config.fsyncPolicy = FsyncPolicy::Full;
+      }
+    } else if (topCommand == "follow" || topCommand == "f") {
+      activeTextView()->isFollowing = !activeTextView()->isFollowing;
+      if (activeTextView()->isFollowing) activeTextView()->followFileAppend();
     } else if (topCommand == "close" || topCommand == "c") {
       activeTextView()->closeFile();
     } else if (topCommand == "new" || topCommand == "n") {
@@ -540,6 +675,14 @@ struct Editor {
     activeTextView()->reloadContent();
   }
 
+  void executeRecoverEditsPrompt(string cmd) {
+    if (cmd == "r") {
+      activeTextView()->recoverEdits();
+    } else {
+      activeTextView()->discardRecoverableEdits();
+    }
+  }
+
   void updateDimensions() {
     terminalDimension = getTerminalDimension();
     leftMargin = 0;
@@ -581,6 +724,8 @@ struct Editor {
       return;
     }
 
+    for (auto& textView : activeSplitUnit()->textViews) textView.fileWatcher.unwatch();
+
     auto splitIt = splitUnits.begin();
     advance(splitIt, activeSplitUnitIdx);
     splitUnits.erase(splitIt);
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "debug.h"
+#include "utility.h"
+
+#define EVENT_LOOP_MAX_EVENTS 32
+
+using namespace std;
+
+enum class EventSource {
+  Input,
+  TerminalResize,
+  FileWatch,
+};
+
+struct Event {
+  EventSource source;
+  int fd;
+};
+
+/**
+ * Single point of waiting for the editor: stdin, terminal resize (SIGWINCH via
+ * signalfd) and the file watchers' inotify descriptors.
+ */
+struct EventLoop {
+  int epollFd{-1};
+  int signalFd{-1};
+  vector<int> fileWatchFds{};
+
+  void init() {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1) reportAndExit("Cannot create epoll instance");
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) reportAndExit("Cannot block SIGWINCH");
+
+    signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signalFd == -1) reportAndExit("Cannot create signalfd");
+
+    add(STDIN_FILENO);
+    add(signalFd);
+  }
+
+  /**
+   * Makes the watched set of file watcher descriptors the same as `fds`.
+   */
+  void syncFileWatchFds(vector<int> fds) {
+    sort(fds.begin(), fds.end());
+    fds.erase(unique(fds.begin(), fds.end()), fds.end());
+
+    for (int fd : fileWatchFds) {
+      if (!binary_search(fds.begin(), fds.end(), fd)) remove(fd);
+    }
+    for (int fd : fds) {
+      if (!binary_search(fileWatchFds.begin(), fileWatchFds.end(), fd)) add(fd);
+    }
+
+    fileWatchFds = move(fds);
+  }
+
+  /**
+   * Blocks until at least one event arrives or `timeoutMs` passes (-1: no
+   * timeout).
+   */
+  vector<Event> wait(int timeoutMs) {
+    struct epoll_event epollEvents[EVENT_LOOP_MAX_EVENTS];
+    vector<Event> events{};
+
+    int eventCount = epoll_wait(epollFd, epollEvents, EVENT_LOOP_MAX_EVENTS, timeoutMs);
+    if (eventCount == -1) {
+      if (errno != EINTR) reportAndExit("Failed waiting for events");
+      return events;
+    }
+
+    for (int i = 0; i < eventCount; i++) {
+      int fd = epollEvents[i].data.fd;
+
+      if (fd == STDIN_FILENO) {
+        events.push_back(Event{EventSource::Input, fd});
+      } else if (fd == signalFd) {
+        consumeSignals();
+        events.push_back(Event{EventSource::TerminalResize, fd});
+      } else {
+        events.push_back(Event{EventSource::FileWatch, fd});
+      }
+    }
+
+    return events;
+  }
+
+ private:
+  void add(int fd) {
+    struct epoll_event ev {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) reportAndExit("Cannot add fd to epoll");
+  }
+
+  void remove(int fd) {
+    // The fd might have been closed already which removes it implicitly.
+    if (epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL) == -1) DLOG("Cannot remove fd %d from epoll", fd);
+  }
+
+  void consumeSignals() {
+    struct signalfd_siginfo info;
+    while (read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+    }
+  }
+};
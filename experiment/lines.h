@@ -5,6 +5,7 @@
 
 #include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <iterator>
 #include <memory>
@@ -12,6 +13,7 @@
 #include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -29,6 +31,7 @@ using namespace std;
 #define LINES_MASK_TO_AT_END 0b10
 #define LINES_IT_FWD 1
 #define LINES_IT_BWD -1
+#define LINES_POOL_SLAB_SIZE 256
 
 #ifdef DEBUG
 #define LOG_RETURN(val, msg)           \
@@ -53,12 +56,21 @@ enum class LinesRemoveResult {
 
 struct Lines;
 
+/**
+ * Returns tree nodes to the pool of their tree.
+ */
+struct LinesNodeDeleter {
+  void operator()(Lines *node) const;
+};
+
+using LinesNodePtr = unique_ptr<Lines, LinesNodeDeleter>;
+
 struct LinesIntermediateNode {
-  unique_ptr<Lines> lhs;
-  unique_ptr<Lines> rhs;
+  LinesNodePtr lhs;
+  LinesNodePtr rhs;
 
-  LinesIntermediateNode(unique_ptr<Lines> &&lhs, unique_ptr<Lines> &&rhs)
-      : lhs(std::forward<unique_ptr<Lines>>(lhs)), rhs(std::forward<unique_ptr<Lines>>(rhs)) {
+  LinesIntermediateNode(LinesNodePtr &&lhs, LinesNodePtr &&rhs)
+      : lhs(std::forward<LinesNodePtr>(lhs)), rhs(std::forward<LinesNodePtr>(rhs)) {
   }
 
   LinesIntermediateNode(LinesIntermediateNode &&) = default;
@@ -67,7 +79,7 @@ struct LinesIntermediateNode {
   LinesIntermediateNode(LinesIntermediateNode &) = delete;
   LinesIntermediateNode &operator=(LinesIntermediateNode &) = delete;
 
-  unique_ptr<Lines> &child(bool is_left) {
+  LinesNodePtr &child(bool is_left) {
     return is_left ? lhs : rhs;
   }
 
@@ -80,14 +92,165 @@ struct LinesIntermediateNode {
   }
 };
 
+namespace LinesUtil {
+bool has_new_line(string const &s) {
+  auto it = find(s.begin(), s.end(), '\n');
+  return it != s.end();
+}
+
+/**
+ * Number of UTF-8 codepoints (bytes that are not continuation bytes).
+ */
+size_t codepoint_count(string_view s) {
+  size_t out{0};
+  for (auto c : s) {
+    if ((c & 0xC0) != 0x80) out++;
+  }
+  return out;
+}
+
+template <typename F>
+void split_lines(const string &s, const F fn) {
+  string current;
+  for (const auto &c : s) {
+    if (c == '\n') {
+      fn(current);
+      current.clear();
+    } else {
+      current.push_back(c);
+    }
+  }
+  fn(current);
+}
+};  // namespace LinesUtil
+
+/**
+ * One line of a leaf: a view into an arena of the leaf until it gets mutated, then an owned string. Knows its UTF-8
+ * codepoint count.
+ */
+struct LinesLine {
+  LinesLine() {
+  }
+  explicit LinesLine(string_view in_arena)
+      : data(in_arena.data()), arena_size(in_arena.size()), codepoints(LinesUtil::codepoint_count(in_arena)) {
+    assert(in_arena.size() <= UINT32_MAX);
+  }
+  explicit LinesLine(string s) : owned(new string(std::move(s))), is_owned(true) {
+    recount();
+  }
+
+  LinesLine(LinesLine &&other) {
+    take(other);
+  }
+
+  LinesLine &operator=(LinesLine &&other) {
+    if (this != &other) {
+      if (is_owned) delete owned;
+
+      take(other);
+    }
+
+    return *this;
+  }
+
+  LinesLine(LinesLine &) = delete;
+  LinesLine &operator=(LinesLine &) = delete;
+
+  ~LinesLine() {
+    if (is_owned) delete owned;
+  }
+
+  string_view view() const {
+    return is_owned ? string_view(*owned) : string_view(data, arena_size);
+  }
+
+  size_t size() const {
+    return is_owned ? owned->size() : arena_size;
+  }
+
+  size_t char_count() const {
+    return codepoints;
+  }
+
+  void insert(size_t pos, string_view s) {
+    str().insert(pos, s);
+    codepoints += LinesUtil::codepoint_count(s);
+  }
+
+  void append(string_view s) {
+    insert(size(), s);
+  }
+
+  void erase(size_t pos, size_t len = string::npos) {
+    len = min(len, size() - pos);
+    codepoints -= LinesUtil::codepoint_count(view().substr(pos, len));
+    str().erase(pos, len);
+  }
+
+  /**
+   * Mutable access - copies the line out of the arena first. The codepoint count is only right again after `recount`.
+   */
+  string &str() {
+    if (!is_owned) {
+      owned = new string(data, arena_size);
+      is_owned = true;
+    }
+
+    return *owned;
+  }
+
+  void recount() {
+    codepoints = LinesUtil::codepoint_count(view());
+  }
+
+ private:
+  union {
+    const char *data{nullptr};
+    string *owned;
+  };
+  uint32_t arena_size{0};
+  bool is_owned{false};
+  size_t codepoints{0};
+
+  // Moves the active member of the union over, `other` is left an empty line.
+  void take(LinesLine &other) {
+    if (other.is_owned) {
+      owned = other.owned;
+    } else {
+      data = other.data;
+    }
+    arena_size = other.arena_size;
+    is_owned = other.is_owned;
+    codepoints = other.codepoints;
+
+    other.data = nullptr;
+    other.arena_size = 0;
+    other.is_owned = false;
+    other.codepoints = 0;
+  }
+};
+
+using LinesArena = shared_ptr<const string>;
+
 struct LinesLeaf {
-  vector<string> lines{};
+  vector<LinesLine> lines{};
+  // Buffers the not yet mutated lines point into. Shared with the leaves split off this one.
+  vector<LinesArena> arenas{};
   Lines *left{nullptr};
   Lines *right{nullptr};
+  // Set by any change of the lines. A clean leaf holds the same bytes as the file it was loaded from (or saved to) at
+  // `file_offset` - see `Lines::file_clean_prefix_bytes`.
+  bool dirty{true};
+  size_t file_offset{0};
 
   LinesLeaf() {
   }
-  LinesLeaf(vector<string> &&lines) : lines(std::forward<vector<string>>(lines)) {
+  LinesLeaf(vector<string> &&src) {
+    lines.reserve(src.size());
+    for (auto &line : src) lines.emplace_back(std::move(line));
+  }
+  LinesLeaf(vector<LinesLine> &&lines, vector<LinesArena> &&arenas)
+      : lines(std::forward<vector<LinesLine>>(lines)), arenas(std::forward<vector<LinesArena>>(arenas)) {
   }
 
   LinesLeaf(LinesLeaf &&) = default;
@@ -102,7 +265,7 @@ struct LinesLeaf {
 
   void debug_dump() const {
     printf("Leaf: size=%lu left=%p right=%p", lines.size(), (void *)left, (void *)right);
-    for (const auto &e : lines) printf(" %s", e.c_str());
+    for (const auto &e : lines) printf(" %.*s", (int)e.size(), e.view().data());
     printf("\n");
   }
 };
@@ -117,108 +280,196 @@ struct LinesConfig {
   }
 };
 
-namespace LinesUtil {
-bool has_new_line(string const &s) {
-  auto it = find(s.begin(), s.end(), '\n');
-  return it != s.end();
-}
+/**
+ * Fixed size object allocator: objects are carved out of slabs and freed ones are reused via an intrusive free list.
+ * Memory is only given back when the pool dies.
+ */
+template <typename T>
+struct SlabPool {
+  SlabPool() {
+  }
 
-template <typename F>
-void split_lines(const string &s, const F fn) {
-  string current;
-  for (const auto &c : s) {
-    if (c == '\n') {
-      fn(current);
-      current.clear();
-    } else {
-      current.push_back(c);
+  SlabPool(SlabPool &) = delete;
+  SlabPool &operator=(SlabPool &) = delete;
+
+  ~SlabPool() {
+    for (void *slab : slabs) ::operator delete(slab, align_val_t(alignof(T)));
+  }
+
+  template <typename... Args>
+  T *make(Args &&...args) {
+    return new (allocate()) T(std::forward<Args>(args)...);
+  }
+
+  // The object must be destructed already.
+  void release(T *object) {
+    *(void **)object = free_list;
+    free_list = object;
+  }
+
+ private:
+  vector<void *> slabs{};
+  void *free_list{nullptr};
+  size_t used_in_last_slab{LINES_POOL_SLAB_SIZE};
+
+  void *allocate() {
+    static_assert(sizeof(T) >= sizeof(void *));
+
+    if (free_list) {
+      void *slot = free_list;
+      free_list = *(void **)slot;
+      return slot;
+    }
+
+    if (used_in_last_slab == LINES_POOL_SLAB_SIZE) {
+      slabs.push_back(::operator new(sizeof(T) * LINES_POOL_SLAB_SIZE, align_val_t(alignof(T))));
+      used_in_last_slab = 0;
     }
+
+    return (char *)slabs.back() + sizeof(T) * used_in_last_slab++;
   }
-  fn(current);
-}
-};  // namespace LinesUtil
+};
+
+/**
+ * State shared by all nodes of one tree. Owned by the root object(s) - a moved-from root keeps a reference too.
+ */
+struct LinesContext {
+  LinesConfig config;
+  SlabPool<Lines> pool{};
+  size_t root_refs{1};
+  // The line last handed out for writing (`Lines::operator[]`) - its change is counted by the next tree operation, see
+  // `Lines::close_open_line`.
+  Lines *open_leaf{nullptr};
+  size_t open_line_idx{0};
+  size_t open_line_bytes{0};
+
+  LinesContext(LinesConfig config) : config(config) {
+  }
+};
 
 struct Lines {
   size_t line_start;
   size_t line_count;
   LinesNodeType type{LinesNodeType::Intermediate};
-  shared_ptr<LinesConfig> config;
+  // Only root objects own (a reference to) the context - nodes allocated from the pool don't.
+  bool owns_ctx{false};
+  LinesContext *ctx;
   Lines *parent;
+  // Height of the subtree (leaf: 0), kept up to date by every structural change.
+  int tree_height{0};
+  // Line bytes (without line breaks) and UTF-8 codepoints of the subtree. Each edit adds its difference on the way up
+  // to the root, see `adjust_aggregates_up`.
+  size_t byte_count{0};
+  size_t char_count{0};
 
   union {
     LinesIntermediateNode intermediateNode;
     LinesLeaf leafNode;
   };
 
-  Lines()
-      : line_start(0),
-        line_count(0),
-        type(LinesNodeType::Leaf),
-        config(std::make_shared<LinesConfig>((size_t)LINES_UNIT_BREAK_THRESHOLD)),
-        parent(nullptr) {
-    new (&leafNode) LinesLeaf{};
+  Lines() : Lines(make_shared<LinesConfig>((size_t)LINES_UNIT_BREAK_THRESHOLD), vector<string>{}) {
   }
 
-  Lines(shared_ptr<LinesConfig> config)
-      : line_start(0), line_count(0), type(LinesNodeType::Leaf), config(config), parent(nullptr) {
-    new (&leafNode) LinesLeaf{};
+  Lines(shared_ptr<LinesConfig> config) : Lines(config, vector<string>{}) {
   }
 
   Lines(vector<string> &&lines)
+      : Lines(make_shared<LinesConfig>((size_t)LINES_UNIT_BREAK_THRESHOLD), std::forward<vector<string>>(lines)) {
+  }
+
+  Lines(shared_ptr<LinesConfig> config, vector<string> &&lines)
       : line_start(0),
         line_count(lines.size()),
         type(LinesNodeType::Leaf),
-        config(std::make_shared<LinesConfig>((size_t)LINES_UNIT_BREAK_THRESHOLD)),
+        owns_ctx(true),
+        ctx(new LinesContext(*config)),
         parent(nullptr) {
     new (&leafNode) LinesLeaf{std::forward<vector<string>>(lines)};
+    update_aggregates();
   }
 
-  Lines(shared_ptr<LinesConfig> config, vector<string> &&lines)
-      : line_start(0), line_count(lines.size()), type(LinesNodeType::Leaf), config(config), parent(nullptr) {
-    new (&leafNode) LinesLeaf{std::forward<vector<string>>(lines)};
-  }
-
-  Lines(shared_ptr<LinesConfig> config, size_t start, Lines *parent, vector<string> &&lines)
-      : line_start(start), line_count(lines.size()), type(LinesNodeType::Leaf), config(config), parent(parent) {
-    new (&leafNode) LinesLeaf{std::forward<vector<string>>(lines)};
+  // Tree node - use `make_node`.
+  Lines(LinesContext *ctx, size_t start, Lines *parent, vector<LinesLine> &&lines, vector<LinesArena> &&arenas)
+      : line_start(start), line_count(lines.size()), type(LinesNodeType::Leaf), ctx(ctx), parent(parent) {
+    new (&leafNode) LinesLeaf{std::forward<vector<LinesLine>>(lines), std::forward<vector<LinesArena>>(arenas)};
+    update_aggregates();
   }
 
   Lines(Lines &) = delete;
   Lines &operator=(Lines &) = delete;
 
-  Lines(Lines &&other) {
-    if (other.type == LinesNodeType::Intermediate) {
-      new (&intermediateNode) LinesIntermediateNode(std::move(other.intermediateNode));
-    } else {
-      new (&leafNode) LinesLeaf(std::move(other.leafNode));
-    }
-
-    type = other.type;
-    line_start = other.line_start;
-    line_count = other.line_count;
-    parent = other.parent;
-    config = other.config;
+  Lines(Lines &&other)
+      : line_start(other.line_start),
+        line_count(other.line_count),
+        type(other.type),
+        owns_ctx(other.owns_ctx),
+        ctx(other.ctx),
+        parent(other.parent),
+        tree_height(other.tree_height) {
+    if (owns_ctx) ctx->root_refs++;
+
+    other.close_open_line();
+    byte_count = other.byte_count;
+    char_count = other.char_count;
+    take_payload(std::move(other));
   }
 
   Lines &operator=(Lines &&other) {
     if (this != &other) {
-      if (other.type == LinesNodeType::Intermediate) {
-        new (&intermediateNode) LinesIntermediateNode(std::move(other.intermediateNode));
-      } else {
-        new (&leafNode) LinesLeaf(std::move(other.leafNode));
-      }
+      close_open_line();
+      other.close_open_line();
+      destroy_payload();
+      release_ctx();
 
       type = other.type;
       line_start = other.line_start;
       line_count = other.line_count;
       parent = other.parent;
-      config = other.config;
+      owns_ctx = other.owns_ctx;
+      ctx = other.ctx;
+      tree_height = other.tree_height;
+      byte_count = other.byte_count;
+      char_count = other.char_count;
+      if (owns_ctx) ctx->root_refs++;
+
+      take_payload(std::move(other));
     }
 
     return *this;
   }
 
+  /**
+   * Builds a balanced tree from the lines in O(n) - see `assign`.
+   */
+  static Lines from_lines(shared_ptr<LinesConfig> config, vector<string> &&lines) {
+    Lines out{config};
+    out.assign(std::forward<vector<string>>(lines));
+    return out;
+  }
+
   ~Lines() {
+    // The open line might be in this tree - a moved-from root shares the context.
+    if (owns_ctx) close_open_line();
+    destroy_payload();
+    release_ctx();
+  }
+
+  void release_ctx() {
+    if (owns_ctx && --ctx->root_refs == 0) delete ctx;
+    owns_ctx = false;
+  }
+
+  LinesNodePtr make_node(size_t start, Lines *parent, vector<LinesLine> &&lines = {},
+                         vector<LinesArena> &&arenas = {}) {
+    return LinesNodePtr(ctx->pool.make(ctx, start, parent, std::forward<vector<LinesLine>>(lines),
+                                       std::forward<vector<LinesArena>>(arenas)));
+  }
+
+  const LinesConfig &config() const {
+    return ctx->config;
+  }
+
+  void destroy_payload() {
     if (type == LinesNodeType::Intermediate) {
       intermediateNode.LinesIntermediateNode::~LinesIntermediateNode();
     } else {
@@ -226,6 +477,30 @@ struct Lines {
     }
   }
 
+  /**
+   * Moves the node payload (type already set) from other and re-links the nodes pointing at it. Other is left as an
+   * empty leaf.
+   */
+  void take_payload(Lines &&other) {
+    if (type == LinesNodeType::Intermediate) {
+      new (&intermediateNode) LinesIntermediateNode(std::move(other.intermediateNode));
+      intermediateNode.lhs->parent = this;
+      intermediateNode.rhs->parent = this;
+    } else {
+      new (&leafNode) LinesLeaf(std::move(other.leafNode));
+      if (leafNode.left) leafNode.left->leafNode.right = this;
+      if (leafNode.right) leafNode.right->leafNode.left = this;
+    }
+
+    other.destroy_payload();
+    other.type = LinesNodeType::Leaf;
+    new (&other.leafNode) LinesLeaf();
+    other.line_count = 0;
+    other.tree_height = 0;
+    other.byte_count = 0;
+    other.char_count = 0;
+  }
+
   /**
    * OUTPUT
    */
@@ -236,7 +511,7 @@ struct Lines {
     } else {
       stringstream ss;
       for (auto &line : leafNode.lines) {
-        ss << line;
+        ss << line.view();
         ss << endl;
       }
       return ss.str();
@@ -253,7 +528,7 @@ struct Lines {
         ss << std::to_string(line_start) << "-";
       } else {
         ss << std::to_string(line_start) << ":" << std::to_string(line_end());
-        for (auto &line : leafNode.lines) ss << "[" << line << "]";
+        for (auto &line : leafNode.lines) ss << "[" << line.view() << "]";
       }
     }
 
@@ -269,21 +544,34 @@ struct Lines {
     } else {
       string out{};
       for (size_t i = 0; i < leafNode.lines.size(); i++) {
-        out += leafNode.lines[i];
+        out += leafNode.lines[i].view();
         if (i < leafNode.lines.size() - 1) out += "+";
       }
       cout << "\t" << id << "[label=\"" << out << "\"]" << endl;
     }
   }
 
+  /**
+   * Mutable access to a line - takes it out of its arena. Read paths should use `view`. The change is counted by the
+   * next tree operation.
+   */
   string &operator[](size_t line_idx) const {
     Lines *node = node_at(line_idx);
     assert(node);
 
-    return node->leafNode.lines[line_idx - node->line_start];
+    return node->open_line(line_idx - node->line_start);
+  }
+
+  string_view view(size_t line_idx) const {
+    Lines *node = node_at(line_idx);
+    assert(node);
+
+    return node->leafNode.lines[line_idx - node->line_start].view();
   }
 
   bool integrity_check() const {
+    close_open_line();
+
     if (type == LinesNodeType::Intermediate) {
       // Child's parent is this.
       if (intermediateNode.lhs->parent != this) LOG_RETURN(false, "ICERR: left node parent mismatch");
@@ -293,6 +581,12 @@ struct Lines {
       // Len is same as sum of children len.
       if (line_count != intermediateNode.lhs->line_count + intermediateNode.rhs->line_count)
         LOG_RETURN(false, "ICERR: children line count sum mismatch");
+      // Cached height is one above the taller child.
+      if (tree_height != max(intermediateNode.lhs->tree_height, intermediateNode.rhs->tree_height) + 1)
+        LOG_RETURN(false, "ICERR: height mismatch");
+      if (byte_count != intermediateNode.lhs->byte_count + intermediateNode.rhs->byte_count ||
+          char_count != intermediateNode.lhs->char_count + intermediateNode.rhs->char_count)
+        LOG_RETURN(false, "ICERR: aggregate sum mismatch");
 
       // Children is also valid.
       return intermediateNode.lhs->integrity_check() && intermediateNode.rhs->integrity_check();
@@ -315,6 +609,19 @@ struct Lines {
       // Either root or non empty.
       if (parent && line_count == 0) LOG_RETURN(false, "ICERR: non parent size mismatch");
 
+      if (tree_height != 0) LOG_RETURN(false, "ICERR: leaf height mismatch");
+
+      size_t bytes{0};
+      size_t chars{0};
+      for (auto &line : leafNode.lines) {
+        if (line.char_count() != LinesUtil::codepoint_count(line.view()))
+          LOG_RETURN(false, "ICERR: line codepoint count mismatch");
+
+        bytes += line.size();
+        chars += line.char_count();
+      }
+      if (byte_count != bytes || char_count != chars) LOG_RETURN(false, "ICERR: leaf aggregate mismatch");
+
       return true;
     }
 
@@ -326,6 +633,8 @@ struct Lines {
    */
 
   void clear() {
+    close_open_line();
+
     if (type == LinesNodeType::Intermediate) {
       intermediateNode.~LinesIntermediateNode();
       type = LinesNodeType::Leaf;
@@ -335,9 +644,98 @@ struct Lines {
 
     new (&leafNode) LinesLeaf();
     line_count = 0;
+    tree_height = 0;
+    byte_count = 0;
+    char_count = 0;
+  }
+
+  /**
+   * Replaces the content with a balanced tree built in one pass, without the per line split/rebalance cascades.
+   */
+  void assign(vector<string> &&new_lines) {
+    build(new_lines.size(), [&](Lines *leaf, size_t from, size_t to) {
+      leaf->leafNode.lines.reserve(to - from);
+      for (size_t i = from; i < to; i++) leaf->leafNode.lines.emplace_back(std::move(new_lines[i]));
+    });
+  }
+
+  /**
+   * Same as above, from a buffer and the (exclusive) end offset of each line. Each leaf copies its range of the buffer
+   * into its own arena and the lines only point into that.
+   */
+  void assign(const char *data, const vector<size_t> &line_ends) {
+    build(line_ends.size(), [&](Lines *leaf, size_t from, size_t to) {
+      size_t arena_start = from == 0 ? 0 : line_ends[from - 1] + 1;
+      LinesArena arena = make_shared<const string>(data + arena_start, line_ends[to - 1] - arena_start);
+
+      leaf->leafNode.lines.reserve(to - from);
+      for (size_t i = from; i < to; i++) {
+        size_t start = i == 0 ? 0 : line_ends[i - 1] + 1;
+        string_view line{arena->data() + start - arena_start, line_ends[i] - start};
+
+        if (line.size() <= UINT32_MAX) {
+          leaf->leafNode.lines.emplace_back(line);
+        } else {
+          leaf->leafNode.lines.emplace_back(string(line));
+        }
+      }
+
+      leaf->leafNode.arenas.push_back(std::move(arena));
+      leaf->leafNode.dirty = false;
+      leaf->leafNode.file_offset = arena_start;
+    });
+  }
+
+  template <typename F>
+  void build(size_t new_line_count, const F &fill_leaf) {
+    clear();
+    line_start = 0;
+    if (new_line_count == 0) return;
+
+    size_t leaf_count = (new_line_count + config().unit_break_threshold - 1) / config().unit_break_threshold;
+    Lines *prev_leaf = nullptr;
+    build_balanced(0, new_line_count, leaf_count, prev_leaf, fill_leaf);
+  }
+
+  /**
+   * Turns this (empty leaf) node into a subtree of `leaf_count` even leaves for lines [from, to).
+   */
+  template <typename F>
+  void build_balanced(size_t from, size_t to, size_t leaf_count, Lines *&prev_leaf, const F &fill_leaf) {
+    assert(type == LinesNodeType::Leaf);
+
+    line_start = from;
+    line_count = to - from;
+
+    if (leaf_count == 1) {
+      fill_leaf(this, from, to);
+      update_aggregates();
+
+      leafNode.left = prev_leaf;
+      if (prev_leaf) prev_leaf->leafNode.right = this;
+      prev_leaf = this;
+
+      return;
+    }
+
+    size_t lhs_leaf_count = leaf_count / 2;
+    size_t mid = from + (to - from) * lhs_leaf_count / leaf_count;
+
+    LinesNodePtr lhs = make_node(from, this);
+    LinesNodePtr rhs = make_node(mid, this);
+    lhs->build_balanced(from, mid, lhs_leaf_count, prev_leaf, fill_leaf);
+    rhs->build_balanced(mid, to, leaf_count - lhs_leaf_count, prev_leaf, fill_leaf);
+
+    leafNode.LinesLeaf::~LinesLeaf();
+    type = LinesNodeType::Intermediate;
+    new (&intermediateNode) LinesIntermediateNode(std::forward<LinesNodePtr>(lhs), std::forward<LinesNodePtr>(rhs));
+    update_height();
+    update_aggregates();
   }
 
   bool split(size_t line_idx) {
+    close_open_line();
+
     if (type == LinesNodeType::Intermediate) {
       if (intermediateNode.rhs->line_start <= line_idx) {
         return intermediateNode.rhs->split(line_idx);
@@ -349,12 +747,14 @@ struct Lines {
 
       if (line_idx == line_start || line_end() + 1 == line_idx) return false;
 
-      unique_ptr<Lines> lhs =
-          make_unique<Lines>(config, line_start, this,
-                             vector<string>{leafNode.lines.begin(), leafNode.lines.begin() + (line_idx - line_start)});
-      unique_ptr<Lines> rhs =
-          make_unique<Lines>(config, line_idx, this,
-                             vector<string>{leafNode.lines.begin() + (line_idx - line_start), leafNode.lines.end()});
+      auto mid_it = leafNode.lines.begin() + (line_idx - line_start);
+      LinesNodePtr lhs = make_node(
+          line_start, this,
+          vector<LinesLine>{make_move_iterator(leafNode.lines.begin()), make_move_iterator(mid_it)},
+          vector<LinesArena>{leafNode.arenas});
+      LinesNodePtr rhs = make_node(
+          line_idx, this, vector<LinesLine>{make_move_iterator(mid_it), make_move_iterator(leafNode.lines.end())},
+          std::move(leafNode.arenas));
 
       // Set sibling pointers.
       Lines *old_left_sib = leafNode.left;
@@ -368,25 +768,34 @@ struct Lines {
 
       leafNode.LinesLeaf::~LinesLeaf();
       type = LinesNodeType::Intermediate;
+      // The counts stay, the new leaves count their own lines.
       new (&intermediateNode)
-          LinesIntermediateNode(std::forward<unique_ptr<Lines>>(lhs), std::forward<unique_ptr<Lines>>(rhs));
+          LinesIntermediateNode(std::forward<LinesNodePtr>(lhs), std::forward<LinesNodePtr>(rhs));
 
-      if (config->autobalance) balance();
+      if (config().autobalance) {
+        balance();
+      } else {
+        update_height_up();
+      }
 
       return true;
     }
   }
 
   void emplace_back(string s) {
+    close_open_line();
+
     Lines *node = rightmost();
     assert(node);
 
-    node->leafNode.lines.emplace_back(s);
+    node->leafNode.lines.emplace_back(std::move(s));
+    node->adjust_aggregates_up(node->leafNode.lines.back().size(), node->leafNode.lines.back().char_count());
     node->adjust_line_count_and_line_start_up_and_right(1, false);
     node->split_if_too_large();
   }
 
   bool insert(size_t line_idx, size_t pos, string snippet) {
+    close_open_line();
     if (!in_range_lines(line_idx)) LOG_RETURN(false, "ERR: insert not in range");
 
     if (type == LinesNodeType::Intermediate) {
@@ -403,22 +812,23 @@ struct Lines {
 
       leafNode.lines[line_relative_idx].insert(pos, snippet);
 
+      // The line breaks of the snippet are not counted, they split the line.
+      ptrdiff_t line_breaks = count(snippet.begin(), snippet.end(), '\n');
+      adjust_aggregates_up(snippet.size() - line_breaks, LinesUtil::codepoint_count(snippet) - line_breaks);
+
       // Handle new inserted new lines.
-      if (LinesUtil::has_new_line(leafNode.lines[line_relative_idx])) {
-        size_t old_line_count = leafNode.lines.size();
+      if (line_breaks > 0) {
+        vector<LinesLine> new_lines{};
+        LinesUtil::split_lines(leafNode.lines[line_relative_idx].str(),
+                               [&](const string &new_line) { new_lines.emplace_back(new_line); });
 
-        string line_to_cut{leafNode.lines[line_relative_idx]};
+        // One range insert - inserting one by one would shift the tail for each new line.
+        leafNode.lines[line_relative_idx] = std::move(new_lines.front());
         auto it = leafNode.lines.begin();
-        advance(it, line_relative_idx);
-        it = leafNode.lines.erase(it);
+        advance(it, line_relative_idx + 1);
+        leafNode.lines.insert(it, make_move_iterator(new_lines.begin() + 1), make_move_iterator(new_lines.end()));
 
-        LinesUtil::split_lines(line_to_cut, [&](const string &new_line) {
-          it = leafNode.lines.insert(it, new_line);
-          it++;
-        });
-
-        size_t line_count_diff = leafNode.lines.size() - old_line_count;
-        adjust_line_count_and_line_start_up_and_right(line_count_diff, false);
+        adjust_line_count_and_line_start_up_and_right(new_lines.size() - 1, false);
       }
 
       split_if_too_large();
@@ -428,6 +838,7 @@ struct Lines {
   }
 
   bool insert_line(size_t at, string snippet) {
+    close_open_line();
     if (!in_range(at)) LOG_RETURN(false, "ERR: insert line bad range");
 
     if (type == LinesNodeType::Intermediate) {
@@ -439,7 +850,8 @@ struct Lines {
     size_t rel_pos = at - line_start;
     auto it = leafNode.lines.begin();
     advance(it, rel_pos);
-    leafNode.lines.insert(it, snippet);
+    it = leafNode.lines.insert(it, LinesLine(std::move(snippet)));
+    adjust_aggregates_up(it->size(), it->char_count());
 
     adjust_line_count_and_line_start_up_and_right(1, false);
 
@@ -450,15 +862,18 @@ struct Lines {
 
   bool split_if_too_large() {
     assert(type == LinesNodeType::Leaf);
-    if (leafNode.lines.size() <= config->unit_break_threshold) return false;
+    if (leafNode.lines.size() <= config().unit_break_threshold) return false;
 
-    size_t mid_line_idx = line_start + line_count / 2;
-    bool did_split = split(mid_line_idx);
+    // Rebalancing after a split rotates nodes in place - the new leaves are looked up from the root each time.
+    Lines *root = this;
+    while (root->parent) root = root->parent;
 
-    if (did_split) {
-      assert(type == LinesNodeType::Intermediate);
-      intermediateNode.lhs->split_if_too_large();
-      intermediateNode.rhs->split_if_too_large();
+    size_t leaf_count = (line_count + config().unit_break_threshold - 1) / config().unit_break_threshold;
+    size_t leaf_size = (line_count + leaf_count - 1) / leaf_count;
+    size_t end = line_start + line_count;
+
+    for (size_t split_at = line_start + leaf_size; split_at < end; split_at += leaf_size) {
+      root->split(split_at);
     }
 
     return true;
@@ -486,6 +901,7 @@ struct Lines {
   }
 
   bool backspace(size_t line_idx, size_t pos) {
+    close_open_line();
     if (!in_range_lines(line_idx)) LOG_RETURN(false, "ERR: backspace not in range");
 
     if (type == LinesNodeType::Intermediate) {
@@ -499,11 +915,16 @@ struct Lines {
     if (pos > leafNode.lines[relative_line_pos].size()) LOG_RETURN(false, "ERR: backspace pos out of range");
 
     if (pos > 0) {
-      leafNode.lines[relative_line_pos].erase(pos - 1, 1);
+      LinesLine &line = leafNode.lines[relative_line_pos];
+      size_t chars = line.char_count();
+      line.erase(pos - 1, 1);
+      adjust_aggregates_up(-1, (ptrdiff_t)line.char_count() - (ptrdiff_t)chars);
       return true;
     } else {
       if (relative_line_pos > 0) {
-        leafNode.lines[relative_line_pos - 1].append(leafNode.lines[relative_line_pos]);
+        // Joining lines in the leaf only drops a line break, which is not counted.
+        adjust_aggregates_up(0, 0);
+        leafNode.lines[relative_line_pos - 1].append(leafNode.lines[relative_line_pos].view());
         auto it = leafNode.lines.begin();
         advance(it, relative_line_pos);
         leafNode.lines.erase(it);
@@ -512,7 +933,11 @@ struct Lines {
       } else {
         if (!leafNode.left) return false;
 
-        leafNode.left->leafNode.lines.back().append(leafNode.lines.front());
+        // The line moves over to the left leaf.
+        LinesLine &line = leafNode.lines.front();
+        leafNode.left->adjust_aggregates_up(line.size(), line.char_count());
+        adjust_aggregates_up(-(ptrdiff_t)line.size(), -(ptrdiff_t)line.char_count());
+        leafNode.left->leafNode.lines.back().append(line.view());
         auto it = leafNode.lines.begin();
         leafNode.lines.erase(it);
         adjust_line_count_and_line_start_up_and_right(-1, false);
@@ -537,7 +962,7 @@ struct Lines {
       leafNode.lines[lhs_line_idx].erase(lhs_from_pos);
       leafNode.lines[rhs_line_idx].erase(0, rhs_to_pos + 1);
       // Merge right end into left end.
-      leafNode.lines[lhs_line_idx].append(leafNode.lines[rhs_line_idx]);
+      leafNode.lines[lhs_line_idx].append(leafNode.lines[rhs_line_idx].view());
       // Erase mid section.
       int line_deletions = rhs_line_idx - lhs_line_idx;
       auto it_start = leafNode.lines.begin();
@@ -547,9 +972,21 @@ struct Lines {
 
       if (line_deletions > 0) adjust_line_count_and_line_start_up_and_right(-line_deletions, false);
     }
+
+    // Already linear in the lines of the leaf - recounted from the lines.
+    size_t old_bytes = byte_count;
+    size_t old_chars = char_count;
+    update_aggregates();
+    leafNode.dirty = true;
+    if (parent) {
+      parent->adjust_aggregates_up((ptrdiff_t)byte_count - (ptrdiff_t)old_bytes,
+                                   (ptrdiff_t)char_count - (ptrdiff_t)old_chars);
+    }
   }
 
   void remove_line(size_t line_idx) {
+    close_open_line();
+
     if (type == LinesNodeType::Intermediate) {
       auto node = node_at(line_idx);
       assert(node);
@@ -559,6 +996,7 @@ struct Lines {
     assert(in_range_lines(line_idx));
     auto it = leafNode.lines.begin();
     advance(it, line_idx - line_start);
+    adjust_aggregates_up(-(ptrdiff_t)it->size(), -(ptrdiff_t)it->char_count());
     leafNode.lines.erase(it);
 
     adjust_line_count_and_line_start_up_and_right(-1, false);
@@ -586,7 +1024,8 @@ struct Lines {
     } else {
       assert(type == LinesNodeType::Intermediate);
 
-      vector<string> old_lines = intermediateNode.child(!empty_node)->leafNode.lines;
+      vector<LinesLine> old_lines = std::move(intermediateNode.child(!empty_node)->leafNode.lines);
+      vector<LinesArena> old_arenas = std::move(intermediateNode.child(!empty_node)->leafNode.arenas);
       Lines *old_left_sib = intermediateNode.lhs->leafNode.left;
       Lines *old_right_sib = intermediateNode.rhs->leafNode.right;
 
@@ -594,7 +1033,7 @@ struct Lines {
       intermediateNode.LinesIntermediateNode::~LinesIntermediateNode();
 
       type = LinesNodeType::Leaf;
-      new (&leafNode) LinesLeaf(std::forward<vector<string>>(old_lines));
+      new (&leafNode) LinesLeaf(std::move(old_lines), std::move(old_arenas));
 
       leafNode.left = old_left_sib;
       leafNode.right = old_right_sib;
@@ -602,7 +1041,12 @@ struct Lines {
       if (old_right_sib) old_right_sib->leafNode.left = this;
     }
 
-    if (config->autobalance) balance();
+    // The empty child counted nothing, the counts stay.
+    if (config().autobalance) {
+      balance();
+    } else {
+      update_height_up();
+    }
   }
 
   bool rot_left() {
@@ -631,6 +1075,10 @@ struct Lines {
     intermediateNode.lhs->intermediateNode.rhs->parent = intermediateNode.lhs.get();
     intermediateNode.rhs->parent = this;
 
+    intermediateNode.lhs->update_height();
+    update_height();
+    intermediateNode.lhs->update_aggregates();
+
     return true;
   }
 
@@ -660,42 +1108,251 @@ struct Lines {
     intermediateNode.rhs->intermediateNode.rhs->parent = intermediateNode.rhs.get();
     intermediateNode.lhs->parent = this;
 
+    intermediateNode.rhs->update_height();
+    update_height();
+    intermediateNode.rhs->update_aggregates();
+
     return true;
   }
 
+  /**
+   * Restores the height difference of the children on the way up to the root - O(log n) with the cached heights.
+   */
   void balance() {
-    // Just a leaf.
-    if (type == LinesNodeType::Leaf) {
-      if (parent) return parent->balance();
-      return;
+    update_height();
+
+    if (type == LinesNodeType::Intermediate) {
+      pair<int, int> h = height();
+
+      // Left heavy.
+      if (h.first - h.second > 1) {
+        assert(intermediateNode.lhs->type == LinesNodeType::Intermediate);
+        auto left_child_height = intermediateNode.lhs->height();
+        // Make left child left heavy too.
+        if (left_child_height.second > left_child_height.first) intermediateNode.lhs->rot_left();
+        assert(rot_right());
+      } else if (h.second - h.first > 1) {  // Right heavy.
+        assert(intermediateNode.rhs->type == LinesNodeType::Intermediate);
+        auto right_child_height = intermediateNode.rhs->height();
+        // Make right child right heavy too.
+        if (right_child_height.first > right_child_height.second) intermediateNode.rhs->rot_right();
+        assert(rot_left());
+      }
     }
 
-    pair<int, int> h = height();
+    // Rotations are in place (this node keeps its slot), the ancestors still need their heights refreshed.
+    if (parent) parent->balance();
+  }
 
-    // No imbalance.
-    if (abs(h.first - h.second) <= 1) {
-      if (parent) return parent->balance();
-      return;
+  void update_height() {
+    if (type == LinesNodeType::Intermediate) {
+      tree_height = max(intermediateNode.lhs->tree_height, intermediateNode.rhs->tree_height) + 1;
+    } else {
+      tree_height = 0;
     }
+  }
 
-    // Left heavy.
-    if (h.first > h.second) {
-      assert(intermediateNode.lhs->type == LinesNodeType::Intermediate);
-      auto left_child_height = intermediateNode.lhs->height();
-      // Make left child left heavy too.
-      if (left_child_height.second > left_child_height.first) intermediateNode.lhs->rot_left();
-      assert(rot_right());
-      return;
-    } else {  // Right heavy.
-      assert(intermediateNode.rhs->type == LinesNodeType::Intermediate);
-      auto right_child_height = intermediateNode.rhs->height();
-      // Make right child right heavy too.
-      if (right_child_height.first > right_child_height.second) intermediateNode.rhs->rot_right();
-      assert(rot_left());
-      return;
+  void update_height_up() {
+    int old_height = tree_height;
+    update_height();
+
+    if (parent && old_height != tree_height) parent->update_height_up();
+  }
+
+  /**
+   * Adds the difference an edit of this node made to the counts of it and its ancestors - O(log n).
+   */
+  void adjust_aggregates_up(ptrdiff_t byte_diff, ptrdiff_t char_diff) {
+    if (type == LinesNodeType::Leaf) leafNode.dirty = true;
+
+    for (Lines *node = this; node; node = node->parent) {
+      node->byte_count += byte_diff;
+      node->char_count += char_diff;
+    }
+  }
+
+  /**
+   * Counts from the children (or the counts of the lines of a leaf).
+   */
+  void update_aggregates() {
+    if (type == LinesNodeType::Intermediate) {
+      byte_count = intermediateNode.lhs->byte_count + intermediateNode.rhs->byte_count;
+      char_count = intermediateNode.lhs->char_count + intermediateNode.rhs->char_count;
+    } else {
+      byte_count = 0;
+      char_count = 0;
+      for (auto &line : leafNode.lines) {
+        byte_count += line.size();
+        char_count += line.char_count();
+      }
     }
   }
 
+  /**
+   * Hands out a line of this leaf for writing. What's written is unknown until the next tree operation, which counts it
+   * (`close_open_line`).
+   */
+  string &open_line(size_t relative_idx) {
+    close_open_line();
+
+    LinesLine &line = leafNode.lines[relative_idx];
+    ctx->open_leaf = this;
+    ctx->open_line_idx = relative_idx;
+    ctx->open_line_bytes = line.size();
+    leafNode.dirty = true;
+
+    return line.str();
+  }
+
+  /**
+   * Counts the change of the line handed out for writing, if any - every operation of the tree does it first.
+   */
+  void close_open_line() const {
+    Lines *leaf = ctx->open_leaf;
+    if (!leaf) return;
+    ctx->open_leaf = nullptr;
+
+    LinesLine &line = leaf->leafNode.lines[ctx->open_line_idx];
+    size_t chars = line.char_count();
+    line.recount();
+    leaf->adjust_aggregates_up((ptrdiff_t)line.size() - (ptrdiff_t)ctx->open_line_bytes,
+                               (ptrdiff_t)line.char_count() - (ptrdiff_t)chars);
+  }
+
+  /**
+   * OFFSETS
+   *
+   * Offsets count one line break after every line (as the file is saved). Columns are byte positions.
+   */
+
+  size_t total_bytes() {
+    close_open_line();
+    return byte_count + line_count;
+  }
+
+  size_t total_chars() {
+    close_open_line();
+    return char_count + line_count;
+  }
+
+  /**
+   * Bytes from the start that are the same as in the file the lines were loaded from (or saved to): the run of clean
+   * leaves, each still at its file offset.
+   */
+  size_t file_clean_prefix_bytes() {
+    close_open_line();
+
+    size_t offset{0};
+    for (Lines *leaf = leftmost(); leaf; leaf = leaf->leafNode.right) {
+      if (leaf->leafNode.dirty || leaf->leafNode.file_offset != offset) break;
+      offset += leaf->byte_count + leaf->line_count;
+    }
+
+    return offset;
+  }
+
+  /**
+   * Marks all leaves clean at their current offsets, after the lines have been saved.
+   */
+  void mark_file_clean() {
+    close_open_line();
+
+    size_t offset{0};
+    for (Lines *leaf = leftmost(); leaf; leaf = leaf->leafNode.right) {
+      leaf->leafNode.dirty = false;
+      leaf->leafNode.file_offset = offset;
+      offset += leaf->byte_count + leaf->line_count;
+    }
+  }
+
+  size_t byte_offset(size_t line_idx, size_t pos) {
+    return offset_before_line(line_idx, false) + pos;
+  }
+
+  size_t char_offset(size_t line_idx, size_t pos) {
+    size_t line_chars = line_idx < line_count ? LinesUtil::codepoint_count(view(line_idx).substr(0, pos)) : 0;
+    return offset_before_line(line_idx, true) + line_chars;
+  }
+
+  /**
+   * Row and (byte) column of an offset. Offsets past the end are clamped to the end of the last line.
+   */
+  pair<size_t, size_t> position_at_byte_offset(size_t offset) {
+    return position_at_offset(offset, false);
+  }
+
+  pair<size_t, size_t> position_at_char_offset(size_t offset) {
+    return position_at_offset(offset, true);
+  }
+
+  /**
+   * O(log n) down to the leaf of the line, then the counts of the lines before it in the leaf.
+   */
+  size_t offset_before_line(size_t line_idx, bool in_chars) {
+    close_open_line();
+
+    size_t out{0};
+    Lines *node = this;
+    while (node->type == LinesNodeType::Intermediate) {
+      Lines *lhs = node->intermediateNode.lhs.get();
+      if (node->intermediateNode.rhs->line_start <= line_idx) {
+        out += lhs->weight(in_chars);
+        node = node->intermediateNode.rhs.get();
+      } else {
+        node = lhs;
+      }
+    }
+
+    size_t leaf_line_end = min(line_idx, node->line_start + node->line_count);
+    for (size_t i = node->line_start; i < leaf_line_end; i++) {
+      const LinesLine &line = node->leafNode.lines[i - node->line_start];
+      out += (in_chars ? line.char_count() : line.size()) + 1;
+    }
+
+    return out;
+  }
+
+  pair<size_t, size_t> position_at_offset(size_t offset, bool in_chars) {
+    close_open_line();
+    if (empty()) return {0, 0};
+
+    Lines *node = this;
+    while (node->type == LinesNodeType::Intermediate) {
+      Lines *lhs = node->intermediateNode.lhs.get();
+      if (offset < lhs->weight(in_chars)) {
+        node = lhs;
+      } else {
+        offset -= lhs->weight(in_chars);
+        node = node->intermediateNode.rhs.get();
+      }
+    }
+
+    for (size_t i = 0; i < node->line_count; i++) {
+      const LinesLine &line = node->leafNode.lines[i];
+      size_t line_weight = in_chars ? line.char_count() : line.size();
+      if (offset <= line_weight) {
+        return {node->line_start + i, in_chars ? byte_pos_of_char(line.view(), offset) : offset};
+      }
+
+      offset -= line_weight + 1;
+    }
+
+    return {line_count - 1, node->leafNode.lines.back().size()};
+  }
+
+  // Offset span of the subtree: its lines plus one line break each.
+  size_t weight(bool in_chars) const {
+    return (in_chars ? char_count : byte_count) + line_count;
+  }
+
+  static size_t byte_pos_of_char(string_view line, size_t char_pos) {
+    size_t pos{0};
+    for (; pos < line.size(); pos++) {
+      if ((line[pos] & 0xC0) != 0x80 && char_pos-- == 0) break;
+    }
+    return pos;
+  }
+
   /**
    * BOUNDS
    */
@@ -720,9 +1377,7 @@ struct Lines {
 
   pair<int, int> height() const {
     if (type == LinesNodeType::Intermediate) {
-      auto lhs = intermediateNode.lhs->height();
-      auto rhs = intermediateNode.rhs->height();
-      return {max(lhs.first, lhs.second) + 1, max(rhs.first, rhs.second) + 1};
+      return {intermediateNode.lhs->tree_height + 1, intermediateNode.rhs->tree_height + 1};
     } else {
       return {0, 0};
     }
@@ -790,11 +1445,11 @@ struct Lines {
     }
 
     reference operator*() const {
-      return lines->leafNode.lines[line_ptr - lines->line_start];
+      return lines->open_line(line_ptr - lines->line_start);
     }
 
     pointer operator->() {
-      return lines->leafNode.lines.data() + (line_ptr - lines->line_start);
+      return &lines->open_line(line_ptr - lines->line_start);
     }
 
     LinesIter operator++() {
@@ -844,8 +1499,15 @@ struct Lines {
   }
 };
 
+void LinesNodeDeleter::operator()(Lines *node) const {
+  LinesContext *ctx = node->ctx;
+  node->~Lines();
+  ctx->pool.release(node);
+}
+
 namespace LinesUtil {
 bool remove_range(Lines &root, size_t from_line, size_t from_pos, size_t to_line, size_t to_pos) {
+  root.close_open_line();
   if (root.empty()) return false;
 
   assert(from_line <= to_line);
@@ -873,11 +1535,14 @@ bool remove_range(Lines &root, size_t from_line, size_t from_pos, size_t to_line
   lhs_node->remove_range_from_single_leaf(from_line, from_pos, to_line, to_pos);
 
   // Merge ends.
-  string right_line = rhs_node->leafNode.lines.front();
+  string right_line{rhs_node->leafNode.lines.front().view()};
+  ptrdiff_t right_line_chars = rhs_node->leafNode.lines.front().char_count();
+  rhs_node->adjust_aggregates_up(-(ptrdiff_t)right_line.size(), -right_line_chars);
   rhs_node->leafNode.lines.erase(rhs_node->leafNode.lines.begin());
   rhs_node->adjust_line_count_and_line_start_up_and_right(-1, false);
 
   lhs_node->leafNode.lines.back().append(right_line);
+  lhs_node->adjust_aggregates_up(right_line.size(), right_line_chars);
 
   // Erase mid section.
   // BUG: rhs_node is not stable after merge-up.
@@ -894,6 +1559,7 @@ bool remove_range(Lines &root, size_t from_line, size_t from_pos, size_t to_line
 
     del_line_count -= current_node->leafNode.lines.size();
 
+    current_node->adjust_aggregates_up(-(ptrdiff_t)current_node->byte_count, -(ptrdiff_t)current_node->char_count);
     current_node->adjust_line_count_and_line_start_up_and_right(-current_node->leafNode.lines.size(), false);
     current_node->parent->merge_up(current_node);
   }
@@ -4,6 +4,7 @@
 #include <sstream>
 
 #include "lines.h"
+#include "lines_btree.h"
 
 using namespace std;
 
@@ -42,6 +43,44 @@ void benchmark_vector_emplace_back() {
   });
 }
 
+void benchmark_lines_from_lines(size_t unit_break_threshold) {
+  ifstream fin("/home/itarato/CHECKOUT/p1brc/data/weather_1M.csv");
+  vector<string> lines{};
+  for (string line; getline(fin, line);) lines.emplace_back(line);
+
+  string name = "Lines from 1M lines with threshold " + to_string(unit_break_threshold);
+  measure(name, [&]() { Lines l = Lines::from_lines(make_shared<LinesConfig>(unit_break_threshold), std::move(lines)); });
+}
+
+vector<string> generated_lines(size_t count) {
+  vector<string> lines{};
+  for (size_t i = 0; i < count; i++) lines.push_back("line " + to_string(i));
+  return lines;
+}
+
+template <typename T>
+void benchmark_random_access(string name, T &lines, size_t line_count) {
+  size_t sum = 0;
+  measure(name, [&]() {
+    srand(1);
+    for (int i = 0; i < 1'000'000; i++) sum += lines[rand() % line_count].size();
+  });
+  if (sum == 0) printf("unexpected\n");
+}
+
+void random_access_benchmark() {
+  const size_t line_count = 1'000'000;
+
+  for (size_t i = 8; i <= 512; i *= 4) {
+    Lines lines = Lines::from_lines(make_shared<LinesConfig>(i), generated_lines(line_count));
+    benchmark_random_access("Lines random access 1M on 1M lines with threshold " + to_string(i), lines, line_count);
+
+    LinesBTree btree = LinesBTree::from_lines(make_shared<LinesConfig>(i), generated_lines(line_count));
+    benchmark_random_access("LinesBTree random access 1M on 1M lines with threshold " + to_string(i), btree,
+                            line_count);
+  }
+}
+
 void emplace_back_benchmark() {
   for (size_t i = 8; i <= 8192; i *= 2) {
     benchmark_lines_emplace_back(i);
@@ -50,6 +89,12 @@ void emplace_back_benchmark() {
   benchmark_vector_emplace_back();
 }
 
+void from_lines_benchmark() {
+  for (size_t i = 8; i <= 8192; i *= 2) {
+    benchmark_lines_from_lines(i);
+  }
+}
+
 void heavy_run_emplace_back() {
   Lines l{make_shared<LinesConfig>((size_t)512)};
   ifstream fin("/home/itarato/CHECKOUT/p1brc/data/weather_1M.csv");
@@ -61,6 +106,8 @@ void heavy_run_emplace_back() {
 
 int main(void) {
   emplace_back_benchmark();
+  from_lines_benchmark();
+  random_access_benchmark();
   // heavy_run_emplace_back();
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,434 @@
+#pragma once
+
+#include <assert.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lines.h"
+
+/**
+ * B+ tree variant of `Lines`: wide intermediate nodes keep the line count of each child in one contiguous array, so a
+ * lookup is a short linear scan per level instead of a pointer chase per binary level. All leaves are on the same
+ * depth and keep the left/right sibling links for iteration.
+ *
+ * Only empty nodes are removed - underfull nodes are not merged (same as `Lines`).
+ *
+ * Experiment: the editor doesn't use it. `LinesBuffer` runs on `Lines`, whose byte offsets, per leaf arenas and saved
+ * prefix tracking this tree doesn't have yet. See lines_benchmark.cpp for the random access comparison.
+ */
+
+#define LINES_BTREE_FANOUT 32
+#define LINES_BTREE_MAX_DEPTH 16
+
+struct LinesBTreeNode {
+  const bool is_leaf;
+
+  LinesBTreeNode(bool is_leaf) : is_leaf(is_leaf) {
+  }
+  virtual ~LinesBTreeNode() {
+  }
+
+  LinesBTreeNode(LinesBTreeNode &) = delete;
+  LinesBTreeNode &operator=(LinesBTreeNode &) = delete;
+};
+
+struct LinesBTreeLeaf : LinesBTreeNode {
+  vector<string> lines{};
+  LinesBTreeLeaf *left{nullptr};
+  LinesBTreeLeaf *right{nullptr};
+
+  LinesBTreeLeaf() : LinesBTreeNode(true) {
+  }
+  LinesBTreeLeaf(vector<string> &&lines) : LinesBTreeNode(true), lines(std::forward<vector<string>>(lines)) {
+  }
+};
+
+struct LinesBTreeIntermediate : LinesBTreeNode {
+  size_t child_count{0};
+  // Separate from the children so the lookup scan stays on a few cache lines.
+  size_t line_counts[LINES_BTREE_FANOUT];
+  unique_ptr<LinesBTreeNode> children[LINES_BTREE_FANOUT];
+
+  LinesBTreeIntermediate() : LinesBTreeNode(false) {
+  }
+
+  /**
+   * Index of the child holding line `at` - `at` becomes relative to that child. Past the end goes to the last child.
+   */
+  size_t child_index(size_t &at) const {
+    size_t i = 0;
+    while (i + 1 < child_count && at >= line_counts[i]) {
+      at -= line_counts[i];
+      i++;
+    }
+    return i;
+  }
+
+  void insert_child(size_t idx, unique_ptr<LinesBTreeNode> &&child, size_t line_count) {
+    assert(child_count < LINES_BTREE_FANOUT);
+
+    for (size_t i = child_count; i > idx; i--) {
+      line_counts[i] = line_counts[i - 1];
+      children[i] = std::move(children[i - 1]);
+    }
+
+    line_counts[idx] = line_count;
+    children[idx] = std::forward<unique_ptr<LinesBTreeNode>>(child);
+    child_count++;
+  }
+
+  unique_ptr<LinesBTreeNode> erase_child(size_t idx) {
+    unique_ptr<LinesBTreeNode> child = std::move(children[idx]);
+
+    for (size_t i = idx; i + 1 < child_count; i++) {
+      line_counts[i] = line_counts[i + 1];
+      children[i] = std::move(children[i + 1]);
+    }
+
+    child_count--;
+    return child;
+  }
+
+  size_t line_count() const {
+    size_t sum = 0;
+    for (size_t i = 0; i < child_count; i++) sum += line_counts[i];
+    return sum;
+  }
+};
+
+/**
+ * Intermediate nodes (and the child index taken in each) from the root to a leaf.
+ */
+struct LinesBTreePath {
+  LinesBTreeIntermediate *nodes[LINES_BTREE_MAX_DEPTH];
+  size_t child_idxs[LINES_BTREE_MAX_DEPTH];
+  size_t depth{0};
+};
+
+struct LinesBTree {
+  shared_ptr<LinesConfig> config;
+  unique_ptr<LinesBTreeNode> root;
+  size_t line_count{0};
+
+  LinesBTree(shared_ptr<LinesConfig> config) : config(config), root(make_unique<LinesBTreeLeaf>()) {
+  }
+
+  LinesBTree(LinesBTree &&) = default;
+  LinesBTree &operator=(LinesBTree &&) = default;
+
+  LinesBTree(LinesBTree &) = delete;
+  LinesBTree &operator=(LinesBTree &) = delete;
+
+  /**
+   * Builds the tree level by level from even leaves of at most `unit_break_threshold` lines, in O(n).
+   */
+  static LinesBTree from_lines(shared_ptr<LinesConfig> config, vector<string> &&lines) {
+    LinesBTree out{config};
+    if (lines.empty()) return out;
+
+    out.line_count = lines.size();
+
+    vector<unique_ptr<LinesBTreeNode>> level{};
+    vector<size_t> level_line_counts{};
+
+    size_t leaf_count = (lines.size() + config->unit_break_threshold - 1) / config->unit_break_threshold;
+    LinesBTreeLeaf *prev_leaf = nullptr;
+    for (size_t i = 0; i < leaf_count; i++) {
+      auto from = lines.begin() + lines.size() * i / leaf_count;
+      auto to = lines.begin() + lines.size() * (i + 1) / leaf_count;
+
+      auto leaf = make_unique<LinesBTreeLeaf>(vector<string>{make_move_iterator(from), make_move_iterator(to)});
+      leaf->left = prev_leaf;
+      if (prev_leaf) prev_leaf->right = leaf.get();
+      prev_leaf = leaf.get();
+
+      level_line_counts.push_back(leaf->lines.size());
+      level.push_back(std::move(leaf));
+    }
+
+    // Leave room in each intermediate node for later inserts.
+    while (level.size() > 1) {
+      size_t group_count = (level.size() + LINES_BTREE_FANOUT / 2 - 1) / (LINES_BTREE_FANOUT / 2);
+
+      vector<unique_ptr<LinesBTreeNode>> upper_level{};
+      vector<size_t> upper_level_line_counts{};
+
+      for (size_t i = 0; i < group_count; i++) {
+        size_t from = level.size() * i / group_count;
+        size_t to = level.size() * (i + 1) / group_count;
+
+        auto node = make_unique<LinesBTreeIntermediate>();
+        for (size_t j = from; j < to; j++) node->insert_child(j - from, std::move(level[j]), level_line_counts[j]);
+
+        upper_level_line_counts.push_back(node->line_count());
+        upper_level.push_back(std::move(node));
+      }
+
+      level = std::move(upper_level);
+      level_line_counts = std::move(upper_level_line_counts);
+    }
+
+    out.root = std::move(level.front());
+    return out;
+  }
+
+  /**
+   * ACCESS
+   */
+
+  bool empty() const {
+    return line_count == 0;
+  }
+
+  string &operator[](size_t line_idx) const {
+    assert(line_idx < line_count);
+
+    LinesBTreeNode *node = root.get();
+    while (!node->is_leaf) {
+      auto intermediate = (LinesBTreeIntermediate *)node;
+      node = intermediate->children[intermediate->child_index(line_idx)].get();
+    }
+
+    return ((LinesBTreeLeaf *)node)->lines[line_idx];
+  }
+
+  /**
+   * OPERATIONS
+   */
+
+  void emplace_back(string s) {
+    insert_line(line_count, std::forward<string>(s));
+  }
+
+  bool insert_line(size_t at, string snippet) {
+    if (at > line_count) LOG_RETURN(false, "ERR: insert line bad range");
+
+    LinesBTreePath path{};
+    LinesBTreeLeaf *leaf = descend(at, path);
+
+    leaf->lines.insert(leaf->lines.begin() + at, std::forward<string>(snippet));
+    for (size_t i = 0; i < path.depth; i++) path.nodes[i]->line_counts[path.child_idxs[i]]++;
+    line_count++;
+
+    if (leaf->lines.size() > config->unit_break_threshold) split_leaf(leaf, path);
+
+    return true;
+  }
+
+  bool remove_line(size_t line_idx) {
+    if (line_idx >= line_count) LOG_RETURN(false, "ERR: remove line bad range");
+
+    LinesBTreePath path{};
+    LinesBTreeLeaf *leaf = descend(line_idx, path);
+
+    leaf->lines.erase(leaf->lines.begin() + line_idx);
+    for (size_t i = 0; i < path.depth; i++) path.nodes[i]->line_counts[path.child_idxs[i]]--;
+    line_count--;
+
+    if (leaf->lines.empty() && path.depth > 0) {
+      if (leaf->left) leaf->left->right = leaf->right;
+      if (leaf->right) leaf->right->left = leaf->left;
+
+      // Drop the empty leaf and every ancestor it leaves empty.
+      size_t level = path.depth;
+      do {
+        level--;
+        path.nodes[level]->erase_child(path.child_idxs[level]);
+      } while (level > 0 && path.nodes[level]->child_count == 0);
+
+      if (path.nodes[0]->child_count == 0) root = make_unique<LinesBTreeLeaf>();
+    }
+
+    // Shrink a root with a single child.
+    while (!root->is_leaf && ((LinesBTreeIntermediate *)root.get())->child_count == 1) {
+      unique_ptr<LinesBTreeNode> only_child = ((LinesBTreeIntermediate *)root.get())->erase_child(0);
+      root = std::move(only_child);
+    }
+
+    return true;
+  }
+
+  /**
+   * Finds the leaf of line `at` (which becomes leaf relative) and records the route.
+   */
+  LinesBTreeLeaf *descend(size_t &at, LinesBTreePath &path) const {
+    LinesBTreeNode *node = root.get();
+
+    while (!node->is_leaf) {
+      assert(path.depth < LINES_BTREE_MAX_DEPTH);
+
+      auto intermediate = (LinesBTreeIntermediate *)node;
+      size_t idx = intermediate->child_index(at);
+
+      path.nodes[path.depth] = intermediate;
+      path.child_idxs[path.depth] = idx;
+      path.depth++;
+
+      node = intermediate->children[idx].get();
+    }
+
+    return (LinesBTreeLeaf *)node;
+  }
+
+  void split_leaf(LinesBTreeLeaf *leaf, LinesBTreePath &path) {
+    auto mid = leaf->lines.begin() + leaf->lines.size() / 2;
+    auto new_leaf = make_unique<LinesBTreeLeaf>(
+        vector<string>{make_move_iterator(mid), make_move_iterator(leaf->lines.end())});
+    leaf->lines.erase(mid, leaf->lines.end());
+
+    new_leaf->left = leaf;
+    new_leaf->right = leaf->right;
+    if (leaf->right) leaf->right->left = new_leaf.get();
+    leaf->right = new_leaf.get();
+
+    size_t new_leaf_line_count = new_leaf->lines.size();
+    add_sibling(path, path.depth, leaf->lines.size(), std::move(new_leaf), new_leaf_line_count);
+  }
+
+  /**
+   * Puts `sibling` right after the node reached at `level` of the path (whose line count shrunk to `line_count`),
+   * splitting full intermediate nodes upwards.
+   */
+  void add_sibling(LinesBTreePath &path, size_t level, size_t line_count, unique_ptr<LinesBTreeNode> &&sibling,
+                   size_t sibling_line_count) {
+    if (level == 0) {
+      auto new_root = make_unique<LinesBTreeIntermediate>();
+      new_root->insert_child(0, std::move(root), line_count);
+      new_root->insert_child(1, std::forward<unique_ptr<LinesBTreeNode>>(sibling), sibling_line_count);
+      root = std::move(new_root);
+      return;
+    }
+
+    LinesBTreeIntermediate *parent = path.nodes[level - 1];
+    size_t idx = path.child_idxs[level - 1];
+
+    parent->line_counts[idx] = line_count;
+    parent->insert_child(idx + 1, std::forward<unique_ptr<LinesBTreeNode>>(sibling), sibling_line_count);
+
+    if (parent->child_count < LINES_BTREE_FANOUT) return;
+
+    auto new_parent = make_unique<LinesBTreeIntermediate>();
+    size_t keep = parent->child_count / 2;
+    for (size_t i = keep; i < LINES_BTREE_FANOUT; i++) {
+      new_parent->insert_child(i - keep, std::move(parent->children[i]), parent->line_counts[i]);
+    }
+    parent->child_count = keep;
+
+    size_t new_parent_line_count = new_parent->line_count();
+    add_sibling(path, level - 1, parent->line_count(), std::move(new_parent), new_parent_line_count);
+  }
+
+  /**
+   * VALIDATION
+   */
+
+  bool integrity_check() const {
+    vector<LinesBTreeLeaf *> leaves{};
+    size_t leaf_depth = 0;
+    size_t counted_lines = 0;
+    if (!integrity_check_node(root.get(), 0, leaf_depth, leaves, counted_lines)) return false;
+
+    if (counted_lines != line_count) LOG_RETURN(false, "ICERR: line count mismatch");
+
+    for (size_t i = 0; i < leaves.size(); i++) {
+      if (leaves[i]->left != (i == 0 ? nullptr : leaves[i - 1])) LOG_RETURN(false, "ICERR: left sibling mismatch");
+      if (leaves[i]->right != (i + 1 == leaves.size() ? nullptr : leaves[i + 1]))
+        LOG_RETURN(false, "ICERR: right sibling mismatch");
+      if (leaves.size() > 1 && leaves[i]->lines.empty()) LOG_RETURN(false, "ICERR: empty non root leaf");
+    }
+
+    return true;
+  }
+
+  bool integrity_check_node(LinesBTreeNode *node, size_t depth, size_t &leaf_depth, vector<LinesBTreeLeaf *> &leaves,
+                            size_t &counted_lines) const {
+    if (node->is_leaf) {
+      if (leaves.empty()) leaf_depth = depth;
+      if (leaf_depth != depth) LOG_RETURN(false, "ICERR: leaf depth mismatch");
+
+      leaves.push_back((LinesBTreeLeaf *)node);
+      counted_lines += ((LinesBTreeLeaf *)node)->lines.size();
+      return true;
+    }
+
+    auto intermediate = (LinesBTreeIntermediate *)node;
+    if (intermediate->child_count == 0) LOG_RETURN(false, "ICERR: empty intermediate node");
+
+    for (size_t i = 0; i < intermediate->child_count; i++) {
+      size_t lines_before = counted_lines;
+      if (!integrity_check_node(intermediate->children[i].get(), depth + 1, leaf_depth, leaves, counted_lines))
+        return false;
+      if (counted_lines - lines_before != intermediate->line_counts[i]) LOG_RETURN(false, "ICERR: child count mismatch");
+    }
+
+    return true;
+  }
+
+  /**
+   * ITERATOR
+   */
+
+  struct LinesBTreeIter {
+    using iterator_category = forward_iterator_tag;
+    using difference_type = ptrdiff_t;
+    using value_type = string;
+    using pointer = string *;
+    using reference = string &;
+
+    LinesBTreeLeaf *leaf;
+    size_t idx;
+
+    LinesBTreeIter(LinesBTreeLeaf *leaf, size_t idx) : leaf(leaf), idx(idx) {
+    }
+
+    reference operator*() const {
+      return leaf->lines[idx];
+    }
+
+    pointer operator->() {
+      return leaf->lines.data() + idx;
+    }
+
+    LinesBTreeIter operator++() {
+      if (leaf && ++idx >= leaf->lines.size()) {
+        leaf = leaf->right;
+        idx = 0;
+      }
+
+      return *this;
+    }
+
+    LinesBTreeIter operator++(int) {
+      LinesBTreeIter current = *this;
+      ++(*this);
+      return current;
+    }
+
+    friend bool operator==(const LinesBTreeIter &lhs, const LinesBTreeIter &rhs) {
+      return lhs.leaf == rhs.leaf && lhs.idx == rhs.idx;
+    }
+
+    friend bool operator!=(const LinesBTreeIter &lhs, const LinesBTreeIter &rhs) {
+      return !(lhs == rhs);
+    }
+  };
+
+  LinesBTreeIter begin() const {
+    if (empty()) return end();
+
+    LinesBTreeNode *node = root.get();
+    while (!node->is_leaf) node = ((LinesBTreeIntermediate *)node)->children[0].get();
+
+    return LinesBTreeIter((LinesBTreeLeaf *)node, 0);
+  }
+
+  LinesBTreeIter end() const {
+    return LinesBTreeIter(nullptr, 0);
+  }
+};
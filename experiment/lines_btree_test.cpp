@@ -0,0 +1,144 @@
+#include "lines_btree.h"
+
+#include <cstdlib>
+#include <string>
+#include <utility>
+
+#define ASSERT_EQ(v1, v2) assert_eq(v1, v2, __LINE__)
+#define ASSERT_IC(root) ASSERT_EQ(true, root.integrity_check())
+
+template <typename T>
+void assert_eq(T v1, T v2, int lineNo) {
+  if (v1 == v2) {
+    cout << ".";
+  } else {
+    cout << "\n\nFail!\nLine: " << lineNo << "\nExpected: <" << v1 << ">\n  Actual: <" << v2 << ">\n\n";
+  }
+}
+
+bool is_same_content(LinesBTree &l, vector<string> &expected) {
+  if (l.line_count != expected.size()) return false;
+
+  size_t i = 0;
+  for (auto it = l.begin(); it != l.end(); it++, i++) {
+    if (*it != expected[i] || l[i] != expected[i]) return false;
+  }
+
+  return i == expected.size();
+}
+
+void test_basic_empty() {
+  LinesBTree l{make_shared<LinesConfig>((size_t)4)};
+
+  ASSERT_IC(l);
+  ASSERT_EQ((size_t)0, l.line_count);
+  ASSERT_EQ(true, l.begin() == l.end());
+}
+
+void test_from_lines() {
+  for (size_t n = 0; n <= 2000; n += 37) {
+    vector<string> src{};
+    for (size_t i = 0; i < n; i++) src.push_back(to_string(i));
+    vector<string> expected = src;
+
+    LinesBTree l = LinesBTree::from_lines(make_shared<LinesConfig>((size_t)4), std::move(src));
+    ASSERT_IC(l);
+    ASSERT_EQ(true, is_same_content(l, expected));
+  }
+}
+
+void test_emplace_back() {
+  LinesBTree l{make_shared<LinesConfig>((size_t)2)};
+  vector<string> expected{};
+
+  for (int i = 0; i < 3000; i++) {
+    l.emplace_back(to_string(i));
+    expected.push_back(to_string(i));
+  }
+
+  ASSERT_IC(l);
+  ASSERT_EQ(true, is_same_content(l, expected));
+}
+
+void test_insert_line() {
+  LinesBTree l{make_shared<LinesConfig>((size_t)3)};
+  vector<string> expected{};
+
+  ASSERT_EQ(false, l.insert_line(1, "x"));
+
+  srand(42);
+  for (int i = 0; i < 3000; i++) {
+    size_t at = rand() % (expected.size() + 1);
+    l.insert_line(at, to_string(i));
+    expected.insert(expected.begin() + at, to_string(i));
+  }
+
+  ASSERT_IC(l);
+  ASSERT_EQ(true, is_same_content(l, expected));
+}
+
+void test_remove_line() {
+  vector<string> expected{};
+  for (int i = 0; i < 3000; i++) expected.push_back(to_string(i));
+  LinesBTree l = LinesBTree::from_lines(make_shared<LinesConfig>((size_t)3), vector<string>{expected});
+
+  ASSERT_EQ(false, l.remove_line(3000));
+
+  srand(7);
+  while (expected.size() > 1000) {
+    size_t at = rand() % expected.size();
+    l.remove_line(at);
+    expected.erase(expected.begin() + at);
+  }
+
+  ASSERT_IC(l);
+  ASSERT_EQ(true, is_same_content(l, expected));
+
+  while (!expected.empty()) {
+    l.remove_line(0);
+    expected.erase(expected.begin());
+  }
+
+  ASSERT_IC(l);
+  ASSERT_EQ(true, is_same_content(l, expected));
+
+  l.emplace_back("again");
+  ASSERT_IC(l);
+  ASSERT_EQ("again"s, l[0]);
+}
+
+void test_mixed_operations() {
+  LinesBTree l{make_shared<LinesConfig>((size_t)4)};
+  vector<string> expected{};
+
+  srand(1);
+  for (int i = 0; i < 20000; i++) {
+    if (expected.empty() || rand() % 3 != 0) {
+      size_t at = rand() % (expected.size() + 1);
+      l.insert_line(at, to_string(i));
+      expected.insert(expected.begin() + at, to_string(i));
+    } else {
+      size_t at = rand() % expected.size();
+      l.remove_line(at);
+      expected.erase(expected.begin() + at);
+    }
+  }
+
+  ASSERT_IC(l);
+  ASSERT_EQ(true, is_same_content(l, expected));
+}
+
+int main() {
+  test_basic_empty();
+
+  test_from_lines();
+  test_emplace_back();
+
+  test_insert_line();
+  test_remove_line();
+  test_mixed_operations();
+
+  printf("\nCompleted\n");
+
+  return EXIT_SUCCESS;
+}
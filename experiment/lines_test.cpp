@@ -473,6 +473,305 @@ void test_move_ctor() {
   }
 }
 
+void test_assign() {
+  Lines l{make_shared<LinesConfig>((size_t)2)};
+  l.emplace_back("x");
+
+  vector<string> src{"a", "b", "c", "d", "e", "f", "g"};
+  l.assign(std::move(src));
+
+  ASSERT_IC(l);
+  ASSERT_EQ((size_t)7, l.line_count);
+  ASSERT_EQ("((0:0[a])(1:2[b][c]))((3:4[d][e])(5:6[f][g]))"s, l.debug_to_string());
+
+  string joined{};
+  for (auto it = l.begin(); it != l.end(); it++) joined += *it;
+  ASSERT_EQ("abcdefg"s, joined);
+
+  l.insert_line(7, "h");
+  ASSERT_IC(l);
+  ASSERT_EQ("h"s, l[7]);
+
+  l.assign({});
+  ASSERT_IC(l);
+  ASSERT_EQ((size_t)0, l.line_count);
+}
+
+void test_move_ctor_relinks_nodes() {
+  Lines src{make_shared<LinesConfig>((size_t)2)};
+  for (auto &e : {"a", "b", "c", "d", "e"}) src.emplace_back(e);
+
+  Lines moved{std::move(src)};
+  ASSERT_IC(moved);
+  ASSERT_IC(src);
+  ASSERT_EQ((size_t)0, src.line_count);
+  ASSERT_EQ((size_t)5, moved.line_count);
+
+  moved.insert_line(5, "f");
+  ASSERT_IC(moved);
+  ASSERT_EQ("a\nb\nc\nd\ne\nf\n"s, moved.to_string());
+
+  Lines assigned{{"x"}};
+  assigned = std::move(moved);
+  ASSERT_IC(assigned);
+  ASSERT_EQ((size_t)6, assigned.line_count);
+  ASSERT_EQ("f"s, assigned[5]);
+}
+
+void test_from_lines() {
+  for (size_t n = 0; n <= 40; n++) {
+    vector<string> src{};
+    for (size_t i = 0; i < n; i++) src.push_back(to_string(i));
+
+    Lines l = Lines::from_lines(make_shared<LinesConfig>((size_t)4), std::move(src));
+    ASSERT_IC(l);
+    ASSERT_EQ(n, l.line_count);
+
+    auto h = l.height();
+    ASSERT_EQ(true, abs(h.first - h.second) <= 1);
+
+    size_t i = 0;
+    for (auto it = l.begin(); it != l.end(); it++, i++) ASSERT_EQ(to_string(i), *it);
+    ASSERT_EQ(n, i);
+
+    l.emplace_back("end");
+    ASSERT_IC(l);
+    ASSERT_EQ("end"s, l[n]);
+  }
+}
+
+bool is_balanced(Lines &l) {
+  if (l.type == LinesNodeType::Leaf) return true;
+
+  auto h = l.height();
+  return abs(h.first - h.second) <= 1 && is_balanced(*l.intermediateNode.lhs) && is_balanced(*l.intermediateNode.rhs);
+}
+
+void test_cached_height() {
+  Lines l{make_shared<LinesConfig>((size_t)1)};
+  for (int i = 0; i < 1000; i++) l.emplace_back(to_string(i));
+
+  ASSERT_IC(l);
+  ASSERT_EQ(true, is_balanced(l));
+  // 1000 leaves fit in an AVL tree of at most 1.44 * log2(1000) levels.
+  ASSERT_EQ(true, l.tree_height <= 14);
+
+  for (int i = 0; i < 500; i++) l.remove_line(i);
+
+  ASSERT_IC(l);
+  ASSERT_EQ(true, is_balanced(l));
+  ASSERT_EQ((size_t)500, l.line_count);
+  ASSERT_EQ("1"s, l[0]);
+  ASSERT_EQ("999"s, l[499]);
+}
+
+void test_cached_height_without_autobalance() {
+  Lines l{make_shared<LinesConfig>(false), {"a", "b", "c", "d"}};
+  l.split(1);
+  l.split(2);
+  l.split(3);
+
+  ASSERT_EQ(3, l.tree_height);
+  ASSERT_IC(l);
+
+  l.remove_line(3);
+  ASSERT_EQ(2, l.tree_height);
+  ASSERT_IC(l);
+}
+
+void test_node_pool_reuses_released_nodes() {
+  Lines l{make_shared<LinesConfig>((size_t)1), {"a"}};
+  l.emplace_back("b");
+  ASSERT_EQ(LinesNodeType::Intermediate == l.type, true);
+  Lines *released_leaf = l.intermediateNode.rhs.get();
+
+  l.remove_line(1);
+  ASSERT_IC(l);
+  l.emplace_back("c");
+  ASSERT_IC(l);
+
+  // The freed slots are handed out again (last freed first).
+  ASSERT_EQ(true, l.intermediateNode.lhs.get() == released_leaf || l.intermediateNode.rhs.get() == released_leaf);
+  ASSERT_EQ(l.ctx, l.intermediateNode.lhs->ctx);
+}
+
+void test_assign_from_buffer() {
+  string data{"ab\ncd\n\nef\ngh"};
+  vector<size_t> line_ends{2, 5, 6, 9, 12};
+
+  Lines l{make_shared<LinesConfig>((size_t)2)};
+  l.assign(data.data(), line_ends);
+  // The leaves have their own copy.
+  data.assign(data.size(), 'x');
+
+  ASSERT_IC(l);
+  ASSERT_EQ((size_t)5, l.line_count);
+  ASSERT_EQ("(0:0[ab])((1:2[cd][])(3:4[ef][gh]))"s, l.debug_to_string());
+  ASSERT_EQ(true, l.view(1) == "cd");
+  ASSERT_EQ(true, l.view(2).empty());
+
+  l[1].append("!");
+  ASSERT_EQ("cd!"s, l[1]);
+  ASSERT_EQ(true, l.view(0) == "ab");
+
+  // Split halves keep pointing into the same arena.
+  l.split(1);
+  ASSERT_IC(l);
+  ASSERT_EQ(true, l.view(0) == "ab");
+  ASSERT_EQ(true, l.view(1) == "cd!");
+
+  l.insert(3, 1, "\nX");
+  ASSERT_IC(l);
+  ASSERT_EQ("ab\ncd!\n\ne\nXf\ngh\n"s, l.to_string());
+
+  l.remove_line(0);
+  l.remove_line(0);
+  ASSERT_IC(l);
+  ASSERT_EQ("\ne\nXf\ngh\n"s, l.to_string());
+}
+
+void test_lines_line() {
+  string arena{"hello"};
+  LinesLine line{string_view(arena)};
+  ASSERT_EQ((size_t)5, line.size());
+  ASSERT_EQ(true, line.view().data() == arena.data());
+
+  line.str().append("!");
+  ASSERT_EQ(true, line.view() == "hello!");
+  ASSERT_EQ(true, line.view().data() != arena.data());
+  ASSERT_EQ("hello"s, arena);
+
+  LinesLine moved{std::move(line)};
+  ASSERT_EQ(true, moved.view() == "hello!");
+}
+
+// Expected offset of each line start from the flattened text.
+size_t brute_force_byte_offset(Lines &l, size_t line_idx) {
+  size_t out{0};
+  for (size_t i = 0; i < line_idx; i++) out += l.view(i).size() + 1;
+  return out;
+}
+
+size_t brute_force_char_offset(Lines &l, size_t line_idx) {
+  size_t out{0};
+  for (size_t i = 0; i < line_idx; i++) out += LinesUtil::codepoint_count(l.view(i)) + 1;
+  return out;
+}
+
+void test_aggregates() {
+  Lines l{make_shared<LinesConfig>((size_t)3)};
+  for (int i = 0; i < 40; i++) l.emplace_back("line" + to_string(i));
+  ASSERT_EQ(l.to_string().size(), l.total_bytes());
+
+  srand(7);
+  for (int i = 0; i < 300; i++) {
+    size_t row = rand() % l.line_count;
+    switch (rand() % 7) {
+      case 0:
+        l.insert(row, l.view(row).size() / 2, "ab");
+        break;
+      case 1:
+        l.insert(row, 0, "x\ny");
+        break;
+      case 2:
+        l.backspace(row, rand() % (l.view(row).size() + 1));
+        break;
+      case 3:
+        if (l.line_count > 1) l.remove_line(row);
+        break;
+      case 4:
+        l[row].append("z");
+        break;
+      case 5:
+        l.insert(row, 0, "\xc3\xa9\n\xe2\x82\xac");
+        break;
+      case 6:
+        // Cuts into a multibyte char too.
+        l.backspace(row, l.view(row).size());
+        break;
+    }
+
+    // Query every few edits, after edits of all kinds.
+    if (i % 3 == 0) {
+      size_t probe = rand() % (l.line_count + 1);
+      ASSERT_EQ(brute_force_byte_offset(l, probe), l.byte_offset(probe, 0));
+      ASSERT_EQ(brute_force_char_offset(l, probe), l.char_offset(probe, 0));
+      ASSERT_IC(l);
+    }
+  }
+
+  ASSERT_EQ(l.to_string().size(), l.total_bytes());
+  ASSERT_EQ(LinesUtil::codepoint_count(l.to_string()), l.total_chars());
+  ASSERT_EQ(true, is_balanced(l));
+  ASSERT_IC(l);
+}
+
+void test_offsets() {
+  // "é" and "ő" are 2 bytes, "€" is 3 - 14 bytes, 10 codepoints and 5 line breaks.
+  Lines l{make_shared<LinesConfig>((size_t)2), {"héllo", "", "ab", "€x", "ő"}};
+  l.split(2);
+  l.split(4);
+  ASSERT_IC(l);
+
+  ASSERT_EQ((size_t)19, l.total_bytes());
+  ASSERT_EQ((size_t)15, l.total_chars());
+
+  ASSERT_EQ((size_t)0, l.byte_offset(0, 0));
+  ASSERT_EQ((size_t)3, l.byte_offset(0, 3));
+  ASSERT_EQ((size_t)2, l.char_offset(0, 3));
+  ASSERT_EQ((size_t)7, l.byte_offset(1, 0));
+  ASSERT_EQ((size_t)8, l.byte_offset(2, 0));
+  ASSERT_EQ((size_t)14, l.byte_offset(3, 3));
+  ASSERT_EQ((size_t)11, l.char_offset(3, 3));
+  ASSERT_EQ((size_t)19, l.byte_offset(5, 0));
+
+  for (size_t row = 0; row < l.line_count; row++) {
+    for (size_t col = 0; col <= l.view(row).size(); col++) {
+      if ((l.view(row)[col] & 0xC0) == 0x80) continue;
+
+      ASSERT_EQ(true, make_pair(row, col) == l.position_at_byte_offset(l.byte_offset(row, col)));
+      ASSERT_EQ(true, make_pair(row, col) == l.position_at_char_offset(l.char_offset(row, col)));
+    }
+  }
+
+  // Past the end.
+  ASSERT_EQ(true, make_pair((size_t)4, (size_t)2) == l.position_at_byte_offset(100));
+
+  l.backspace(3, 0);
+  ASSERT_EQ((size_t)18, l.total_bytes());
+  ASSERT_EQ(true, make_pair((size_t)2, (size_t)2) == l.position_at_byte_offset(10));
+  ASSERT_EQ(true, make_pair((size_t)2, (size_t)5) == l.position_at_char_offset(10));
+  ASSERT_IC(l);
+}
+
+void test_file_clean_prefix() {
+  string data{"ab\ncd\n\nef\ngh"};
+  vector<size_t> line_ends{2, 5, 6, 9, 12};
+
+  Lines l{make_shared<LinesConfig>((size_t)2)};
+  l.assign(data.data(), line_ends);
+  ASSERT_EQ("(0:0[ab])((1:2[cd][])(3:4[ef][gh]))"s, l.debug_to_string());
+  ASSERT_EQ((size_t)13, l.file_clean_prefix_bytes());
+
+  // Reading doesn't make a leaf dirty.
+  ASSERT_EQ(true, l.view(3) == "ef");
+  ASSERT_EQ((size_t)13, l.file_clean_prefix_bytes());
+
+  l[3].append("!");
+  ASSERT_EQ((size_t)7, l.file_clean_prefix_bytes());
+
+  l.insert(1, 0, "x");
+  ASSERT_EQ((size_t)3, l.file_clean_prefix_bytes());
+
+  l.mark_file_clean();
+  ASSERT_EQ(l.total_bytes(), l.file_clean_prefix_bytes());
+
+  // The following leaves are clean, but not at their file offsets anymore.
+  l.remove_line(0);
+  ASSERT_IC(l);
+  ASSERT_EQ((size_t)0, l.file_clean_prefix_bytes());
+}
+
 int main() {
   test_basic_empty();
   test_basic_leaf();
@@ -514,11 +813,26 @@ int main() {
 
   test_balance();
   test_balance_auto();
+  test_cached_height();
+  test_cached_height_without_autobalance();
+
+  test_aggregates();
+  test_offsets();
+  test_file_clean_prefix();
 
   test_remove_line();
 
   test_move_ctor();
 
+  test_move_ctor_relinks_nodes();
+
+  test_node_pool_reuses_released_nodes();
+
+  test_assign();
+  test_assign_from_buffer();
+  test_lines_line();
+  test_from_lines();
+
   printf("\nCompleted\n");
 
   return EXIT_SUCCESS;
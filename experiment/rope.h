@@ -5,6 +5,7 @@
 
 #include <algorithm>
 #include <cstddef>
+#include <cstring>
 #include <iostream>
 #include <iterator>
 #include <memory>
@@ -13,6 +14,10 @@
 #include <utility>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
 /**
@@ -26,7 +31,7 @@ using namespace std;
  * - [done] line count (how many lines)
  * - [done] get Nth line
  * - [done] get Nth line length
- * - search for substring
+ * - [done] search for substring
  * - jump to next/pref substring match
  * - clear all
  */
@@ -65,44 +70,35 @@ struct RopeLeaf {
   string s;
   Rope *left{nullptr};
   Rope *right{nullptr};
-
-  int next_char_after(size_t pos, char ch) const {
-    while (pos < s.size()) {
-      if (s[pos] == ch) return pos;
-      pos++;
-    }
-    return -1;
-  }
-
-  int prev_char_before(size_t pos, char ch) const {
-    while (pos >= 0) {
-      if (s[pos] == ch) return pos;
-      if (pos == 0) return -1;
-
-      pos--;
-    }
-
-    return -1;
-  }
 };
 
 struct RopeConfig {
   size_t unit_break_threshold;
+  bool autobalance{true};
 
   RopeConfig(size_t unit_break_threshold)
       : unit_break_threshold(unit_break_threshold) {}
 };
 
 namespace RopeUtil {
+size_t count_new_lines(const char *s, size_t len);
 size_t count_new_lines(const string &s);
 size_t count_new_lines(const string &s, size_t from, size_t to);
 int nth_new_line_pos(const string &s, size_t nth);
 size_t new_line_count(Rope const &rope);
 };  // namespace RopeUtil
 
+/**
+ * Positions are relative to the node they're passed to: the right child starts
+ * after the size of the left one. No node stores where it starts, positions
+ * are worked out on the way down - an edit only updates the sizes on its path.
+ */
 struct Rope {
-  size_t start;
   size_t size;
+  // Line breaks in the subtree.
+  size_t new_line_count;
+  // Height of the subtree (leaf: 0).
+  int tree_height{0};
   RopeNodeType type{RopeNodeType::Intermediate};
   shared_ptr<RopeConfig> config;
   Rope *parent;
@@ -113,46 +109,109 @@ struct Rope {
   };
 
   Rope()
-      : start(0),
-        size(0),
+      : size(0),
+        new_line_count(0),
         type(RopeNodeType::Leaf),
         config(std::make_shared<RopeConfig>(ROPE_UNIT_BREAK_THRESHOLD)),
         parent(nullptr),
         leafNode({std::forward<string>(""s)}) {}
 
   Rope(string &&s)
-      : start(0),
-        size(s.size()),
+      : size(s.size()),
+        new_line_count(RopeUtil::count_new_lines(s)),
         type(RopeNodeType::Leaf),
         config(std::make_shared<RopeConfig>(ROPE_UNIT_BREAK_THRESHOLD)),
         parent(nullptr),
         leafNode({std::forward<string>(s)}) {}
 
   Rope(shared_ptr<RopeConfig> config, string &&s)
-      : start(0),
-        size(s.size()),
+      : size(s.size()),
+        new_line_count(RopeUtil::count_new_lines(s)),
         type(RopeNodeType::Leaf),
         config(config),
         parent(nullptr),
         leafNode({std::forward<string>(s)}) {}
 
-  Rope(shared_ptr<RopeConfig> config, size_t start, Rope *parent, string &&s)
-      : start(start),
-        size(s.size()),
+  Rope(shared_ptr<RopeConfig> config, Rope *parent, string &&s)
+      : size(s.size()),
+        new_line_count(RopeUtil::count_new_lines(s)),
         type(RopeNodeType::Leaf),
         config(config),
         parent(parent),
         leafNode({std::forward<string>(s)}) {}
 
-  ~Rope() {
+  Rope(Rope &&other) : Rope(other.config, ""s) { take(other); }
+
+  Rope &operator=(Rope &&other) {
+    if (this != &other) take(other);
+    return *this;
+  }
+
+  ~Rope() { destroy_payload(); }
+
+  void destroy_payload() {
     if (type == RopeNodeType::Intermediate) {
-      delete intermediateNode.lhs.release();
-      delete intermediateNode.rhs.release();
+      intermediateNode.RopeIntermediateNode::~RopeIntermediateNode();
     } else {
       leafNode.RopeLeaf::~RopeLeaf();
     }
   }
 
+  /**
+   * Moves the content of other (a root or a detached subtree) into this node
+   * and re-links the nodes pointing at it. Other is left as an empty leaf.
+   */
+  void take(Rope &other) {
+    destroy_payload();
+
+    size = other.size;
+    new_line_count = other.new_line_count;
+    tree_height = other.tree_height;
+    type = other.type;
+    config = other.config;
+
+    if (type == RopeNodeType::Intermediate) {
+      new (&intermediateNode)
+          RopeIntermediateNode{std::move(other.intermediateNode.lhs),
+                               std::move(other.intermediateNode.rhs)};
+      intermediateNode.lhs->parent = this;
+      intermediateNode.rhs->parent = this;
+    } else {
+      new (&leafNode) RopeLeaf{std::move(other.leafNode)};
+      if (leafNode.left) leafNode.left->leafNode.right = this;
+      if (leafNode.right) leafNode.right->leafNode.left = this;
+    }
+
+    other.destroy_payload();
+    other.type = RopeNodeType::Leaf;
+    new (&other.leafNode) RopeLeaf{};
+    other.size = 0;
+    other.new_line_count = 0;
+    other.tree_height = 0;
+  }
+
+  /**
+   * Moves the content into a new heap node - this is left as an empty leaf.
+   */
+  unique_ptr<Rope> detach() {
+    auto node = make_unique<Rope>(config, ""s);
+    node->take(*this);
+    return node;
+  }
+
+  static unique_ptr<Rope> make_intermediate(unique_ptr<Rope> &&lhs,
+                                            unique_ptr<Rope> &&rhs) {
+    auto node = make_unique<Rope>(lhs->config, ""s);
+    node->leafNode.RopeLeaf::~RopeLeaf();
+    node->type = RopeNodeType::Intermediate;
+    new (&node->intermediateNode)
+        RopeIntermediateNode{std::move(lhs), std::move(rhs)};
+    node->intermediateNode.lhs->parent = node.get();
+    node->intermediateNode.rhs->parent = node.get();
+    node->update_node();
+    return node;
+  }
+
   /**
    * OUTPUT
    */
@@ -166,42 +225,62 @@ struct Rope {
     }
   }
 
-  string debug_to_string() const {
+  string debug_to_string(size_t node_start = 0) const {
     if (type == RopeNodeType::Intermediate) {
-      return intermediateNode.lhs->debug_to_string() +
-             intermediateNode.rhs->debug_to_string();
+      const Rope &lhs = *intermediateNode.lhs;
+      return lhs.debug_to_string(node_start) +
+             intermediateNode.rhs->debug_to_string(node_start + lhs.size);
     } else {
       if (empty()) {
-        return "[" + std::to_string(start) + ":-]";
+        return "[" + std::to_string(node_start) + ":-]";
       } else {
-        return "[" + std::to_string(start) + ":" + std::to_string(endpos()) +
-               " " + leafNode.s + "]";
+        return "[" + std::to_string(node_start) + ":" +
+               std::to_string(node_start + size - 1) + " " + leafNode.s + "]";
       }
     }
   }
 
   string substr(size_t at, size_t len) const {
-    if (!in_range(at)) return "";
+    size_t node_start;
+    Rope *node = node_at(at, node_start);
+    if (!node) return "";
+
+    string out{};
+    size_t pos = at - node_start;
+    while (node && out.size() < len) {
+      out.append(node->leafNode.s, pos, len - out.size());
+      node = node->leafNode.right;
+      pos = 0;
+    }
 
+    return out;
+  }
+
+  bool integrity_check() const {
     if (type == RopeNodeType::Intermediate) {
-      Rope *start_node = node_at(at);
-      if (!start_node) return "";
-      return start_node->substr(at, len);
-    } else {
-      size_t pos = at - start;
-      size_t in_node_len = min(len, size - pos);
+      const Rope &lhs = *intermediateNode.lhs;
+      const Rope &rhs = *intermediateNode.rhs;
 
-      string out = leafNode.s.substr(pos, in_node_len);
+      if (lhs.parent != this || rhs.parent != this) return false;
+      if (size != lhs.size + rhs.size) return false;
+      if (new_line_count != lhs.new_line_count + rhs.new_line_count)
+        return false;
+      if (tree_height != max(lhs.tree_height, rhs.tree_height) + 1)
+        return false;
 
-      bool need_more = in_node_len < len;
-      if (need_more) {
-        Rope *next_node = leafNode.right;
-        if (next_node) {
-          return out + next_node->substr(next_node->start, len - in_node_len);
-        }
-      }
+      return lhs.integrity_check() && rhs.integrity_check();
+    } else {
+      if (size != leafNode.s.size()) return false;
+      if (new_line_count != RopeUtil::count_new_lines(leafNode.s))
+        return false;
+      if (tree_height != 0) return false;
+      if (parent && empty()) return false;
 
-      return out;
+      if (leafNode.left && leafNode.left->leafNode.right != this) return false;
+      if (leafNode.right && leafNode.right->leafNode.left != this)
+        return false;
+
+      return true;
     }
   }
 
@@ -211,173 +290,140 @@ struct Rope {
 
   RopeSplitResult split(size_t at) {
     if (type == RopeNodeType::Intermediate) {
-      if (intermediateNode.rhs->start <= at) {
-        return intermediateNode.rhs->split(at);
+      size_t lhs_size = intermediateNode.lhs->size;
+      if (lhs_size <= at) {
+        return intermediateNode.rhs->split(at - lhs_size);
       } else {
         return intermediateNode.lhs->split(at);
       }
     } else {
-      if (!in_range(at)) return RopeSplitResult::RangeError;
-
-      if (at == start || endpos() + 1 == at)
-        return RopeSplitResult::EmptySplitError;
-
-      unique_ptr<Rope> lhs = make_unique<Rope>(
-          config, start, this, leafNode.s.substr(0, at - start));
-      unique_ptr<Rope> rhs =
-          make_unique<Rope>(config, at, this, leafNode.s.substr(at - start));
-
-      // Set sibling pointers.
-      Rope *old_left_sib = leafNode.left;
-      Rope *old_right_sib = leafNode.right;
-      lhs->leafNode.right = rhs.get();
-      lhs->leafNode.left = old_left_sib;
-      rhs->leafNode.left = lhs.get();
-      rhs->leafNode.right = old_right_sib;
-      if (old_left_sib) old_left_sib->leafNode.right = lhs.get();
-      if (old_right_sib) old_right_sib->leafNode.left = rhs.get();
-
-      leafNode.RopeLeaf::~RopeLeaf();
-
-      type = RopeNodeType::Intermediate;
-      intermediateNode.lhs.release();
-      intermediateNode.rhs.release();
-      intermediateNode.lhs.reset(lhs.release());
-      intermediateNode.rhs.reset(rhs.release());
+      RopeSplitResult result = split_leaf(at);
+      if (result == RopeSplitResult::Success) balance();
 
-      return RopeSplitResult::Success;
+      return result;
     }
   }
 
-  bool insert(size_t at, string &&snippet) {
-    if (!in_range(at)) return false;
+  /**
+   * Splits a leaf in two without rebalancing - the caller must call `balance`
+   * once the sizes on the path are consistent again.
+   */
+  RopeSplitResult split_leaf(size_t at) {
+    assert(type == RopeNodeType::Leaf);
 
-    if (type == RopeNodeType::Intermediate) {
-      size += snippet.size();
+    if (!in_range(at)) return RopeSplitResult::RangeError;
 
-      if (intermediateNode.rhs->start <= at) {
-        return intermediateNode.rhs->insert(at, std::forward<string>(snippet));
-      } else {
-        intermediateNode.rhs->adjust_start(snippet.size());
-        return intermediateNode.lhs->insert(at, std::forward<string>(snippet));
-      }
-    } else {
-      if (size >= config->unit_break_threshold) {
-        size_t mid = start + size / 2;
-        split(mid);
+    if (at == 0 || at == size) return RopeSplitResult::EmptySplitError;
 
-        return insert(at, std::forward<string>(snippet));
-      } else {
-        size += snippet.size();
+    unique_ptr<Rope> lhs =
+        make_unique<Rope>(config, this, leafNode.s.substr(0, at));
+    unique_ptr<Rope> rhs =
+        make_unique<Rope>(config, this, leafNode.s.substr(at));
 
-        size_t pos = at - start;
-        leafNode.s.insert(pos, snippet);
+    // Set sibling pointers.
+    Rope *old_left_sib = leafNode.left;
+    Rope *old_right_sib = leafNode.right;
+    lhs->leafNode.right = rhs.get();
+    lhs->leafNode.left = old_left_sib;
+    rhs->leafNode.left = lhs.get();
+    rhs->leafNode.right = old_right_sib;
+    if (old_left_sib) old_left_sib->leafNode.right = lhs.get();
+    if (old_right_sib) old_right_sib->leafNode.left = rhs.get();
 
-        return true;
-      }
-    }
-  }
+    leafNode.RopeLeaf::~RopeLeaf();
 
-  void adjust_start(int diff) {
-    start += diff;
+    type = RopeNodeType::Intermediate;
+    new (&intermediateNode) RopeIntermediateNode{std::move(lhs), std::move(rhs)};
+    update_node();
 
-    if (type == RopeNodeType::Intermediate) {
-      intermediateNode.lhs->adjust_start(diff);
-      intermediateNode.rhs->adjust_start(diff);
-    }
+    return RopeSplitResult::Success;
+  }
+
+  bool insert(size_t at, string &&snippet) {
+    size_t snippet_new_lines = RopeUtil::count_new_lines(snippet);
+    return insert(at, std::forward<string>(snippet), snippet_new_lines);
   }
 
-  RopeRemoveResult remove(size_t at) {
-    if (!in_range_chars(at)) return RopeRemoveResult::RangeError;
+  bool insert(size_t at, string &&snippet, size_t snippet_new_lines) {
+    if (!in_range(at)) return false;
 
     if (type == RopeNodeType::Intermediate) {
-      size--;
-
-      bool is_left_adjusted = !intermediateNode.lhs->empty() &&
-                              intermediateNode.lhs->endpos() >= at;
-      RopeRemoveResult result;
+      size += snippet.size();
+      new_line_count += snippet_new_lines;
 
-      if (is_left_adjusted) {
-        intermediateNode.rhs->adjust_start(-1);
-        result = intermediateNode.lhs->remove(at);
+      size_t lhs_size = intermediateNode.lhs->size;
+      if (lhs_size <= at) {
+        return intermediateNode.rhs->insert(
+            at - lhs_size, std::forward<string>(snippet), snippet_new_lines);
       } else {
-        result = intermediateNode.rhs->remove(at);
+        return intermediateNode.lhs->insert(
+            at, std::forward<string>(snippet), snippet_new_lines);
       }
+    } else {
+      if (size >= config->unit_break_threshold && size > 1) {
+        split_leaf(size / 2);
 
-      if (result == RopeRemoveResult::NeedMergeUp) {
-        merge_up(is_left_adjusted);
-        return RopeRemoveResult::Success;
+        return insert(at, std::forward<string>(snippet), snippet_new_lines);
       } else {
-        return result;
-      }
-    } else {
-      size--;
+        size += snippet.size();
+        new_line_count += snippet_new_lines;
 
-      size_t pos = at - start;
-      leafNode.s.erase(pos, 1);
+        leafNode.s.insert(at, snippet);
 
-      if (empty()) {
-        return RopeRemoveResult::NeedMergeUp;
-      } else {
-        return RopeRemoveResult::Success;
+        // The whole path is up to date only now - the splits above are
+        // balanced here.
+        if (parent) parent->balance();
+
+        return true;
       }
     }
   }
 
+  RopeRemoveResult remove(size_t at) { return remove_range(at, at); }
+
+  /**
+   * Removes [from, to] leaf by leaf: partially covered leaves are trimmed,
+   * emptied ones merged up.
+   */
   RopeRemoveResult remove_range(size_t from, size_t to) {
-    if (!in_range_chars(from) || !in_range_chars(to)) {
+    if (from > to || !in_range_chars(from) || !in_range_chars(to)) {
       return RopeRemoveResult::RangeError;
     }
 
-    if (type == RopeNodeType::Intermediate) {
-      size_t rhs_from = max(intermediateNode.rhs->start, from);
-      size_t lhs_to = min(intermediateNode.lhs->endpos(), to);
-
-      if (rhs_from <= to) {
-        size -= to - rhs_from + 1;
-        RopeRemoveResult result =
-            intermediateNode.rhs->remove_range(rhs_from, to);
-        if (result == RopeRemoveResult::NeedMergeUp) {
-          merge_up(RIGHT);
-        } else if (result == RopeRemoveResult::RangeError) {
-          return result;
-        }
-
-        if (from <= lhs_to) {
-          return remove_range(from, lhs_to);
-        } else {
-          return RopeRemoveResult::Success;
-        }
-      }
+    size_t remaining = to - from + 1;
+    while (remaining > 0) {
+      size_t leaf_start;
+      Rope *leaf = node_at(from, leaf_start);
+      assert(leaf);
 
-      if (from <= lhs_to) {
-        size -= lhs_to - from + 1;
-        intermediateNode.rhs->adjust_start(-(lhs_to - from + 1));
-
-        RopeRemoveResult result =
-            intermediateNode.lhs->remove_range(from, lhs_to);
-        if (result == RopeRemoveResult::NeedMergeUp) {
-          merge_up(LEFT);
-        } else if (result == RopeRemoveResult::RangeError) {
-          return result;
-        }
-
-        return RopeRemoveResult::Success;
-      }
+      size_t pos = from - leaf_start;
+      size_t len = min(remaining, leaf->size - pos);
+      leaf->erase_from_leaf(pos, len);
+      remaining -= len;
+    }
 
-      return RopeRemoveResult::RangeError;
+    if (empty()) {
+      return RopeRemoveResult::NeedMergeUp;
     } else {
-      size -= to - from + 1;
+      return RopeRemoveResult::Success;
+    }
+  }
 
-      size_t pos = from - start;
-      leafNode.s.erase(pos, to - from + 1);
+  void erase_from_leaf(size_t pos, size_t len) {
+    assert(type == RopeNodeType::Leaf);
 
-      if (empty()) {
-        return RopeRemoveResult::NeedMergeUp;
-      } else {
-        return RopeRemoveResult::Success;
-      }
+    size_t removed_new_lines =
+        RopeUtil::count_new_lines(leafNode.s.data() + pos, len);
+    leafNode.s.erase(pos, len);
+    size -= len;
+    new_line_count -= removed_new_lines;
+
+    for (Rope *node = parent; node; node = node->parent) {
+      node->size -= len;
+      node->new_line_count -= removed_new_lines;
     }
+
+    if (empty() && parent) parent->merge_up(is_left_child());
   }
 
   void merge_up(bool empty_node) {
@@ -398,10 +444,13 @@ struct Rope {
                             ->intermediateNode.child(!empty_node)
                             .release();
       intermediateNode.child(!empty_node).reset(grandchild);
+
+      intermediateNode.lhs->parent = this;
+      intermediateNode.rhs->parent = this;
     } else {
       assert(type == RopeNodeType::Intermediate);
 
-      string s = intermediateNode.child(!empty_node)->leafNode.s;
+      string s = std::move(intermediateNode.child(!empty_node)->leafNode.s);
       Rope *old_left_sib = intermediateNode.lhs->leafNode.left;
       Rope *old_right_sib = intermediateNode.rhs->leafNode.right;
 
@@ -409,32 +458,230 @@ struct Rope {
       intermediateNode.RopeIntermediateNode::~RopeIntermediateNode();
 
       type = RopeNodeType::Leaf;
-      leafNode.s.swap(s);
+      new (&leafNode) RopeLeaf{std::move(s)};
       leafNode.left = old_left_sib;
       leafNode.right = old_right_sib;
       if (old_left_sib) old_left_sib->leafNode.right = this;
       if (old_right_sib) old_right_sib->leafNode.left = this;
     }
+
+    balance();
   }
 
   /**
-   * BOUNDS
+   * Appends other to the end. The trees are joined along the spine of the
+   * taller one, so the result stays balanced - O(log n).
    */
+  void append(Rope &&other) {
+    if (other.empty()) return;
+    if (empty()) {
+      take(other);
+      return;
+    }
 
-  bool empty() const { return size == 0; }
+    size_t old_size = size;
+    auto joined = join(detach(), other.detach());
+    take(*joined);
 
-  size_t endpos() const {
-    // Must check emptiness before calling this.
-    assert(!empty());
-    return start + size - 1;
+    // Linked only now - a root leaf moves to a new node on the way.
+    Rope *left_end = node_at(old_size - 1);
+    Rope *right_start = node_at(old_size);
+    left_end->leafNode.right = right_start;
+    right_start->leafNode.left = left_end;
   }
 
-  bool in_range(size_t at) const {
-    return (empty() && at == start) || (start <= at && at <= endpos() + 1);
+  /**
+   * Cuts [at, size) off into a new rope. Both halves are balanced, built by
+   * joining the subtrees along the split path - O(log n).
+   */
+  Rope split_off(size_t at) {
+    Rope out{config, ""s};
+    if (!in_range(at) || at == size) return out;
+
+    Rope *left_end = nullptr;
+    if (at > 0) {
+      size_t left_start;
+      left_end = node_at(at - 1, left_start);
+      if (left_start + left_end->size != at) {
+        left_end->split(at - left_start);
+        left_end = node_at(at - 1);
+      }
+
+      Rope *right_start = left_end->leafNode.right;
+      left_end->leafNode.right = nullptr;
+      right_start->leafNode.left = nullptr;
+    }
+
+    auto halves = split_subtree(detach(), at);
+    if (halves.first) take(*halves.first);
+    if (halves.second) out.take(*halves.second);
+
+    return out;
   }
 
-  bool in_range_chars(size_t at) const {
-    return !empty() && start <= at && at <= endpos();
+  /**
+   * AVL join of two detached subtrees (either might be null) holding
+   * consecutive text.
+   */
+  static unique_ptr<Rope> join(unique_ptr<Rope> &&lhs, unique_ptr<Rope> &&rhs) {
+    if (!lhs || lhs->empty()) return std::move(rhs);
+    if (!rhs || rhs->empty()) return std::move(lhs);
+
+    if (lhs->tree_height > rhs->tree_height + 1) {
+      auto joined =
+          join(std::move(lhs->intermediateNode.rhs), std::move(rhs));
+      joined->parent = lhs.get();
+      lhs->intermediateNode.rhs = std::move(joined);
+      lhs->balance_node();
+      return std::move(lhs);
+    }
+
+    if (rhs->tree_height > lhs->tree_height + 1) {
+      auto joined =
+          join(std::move(lhs), std::move(rhs->intermediateNode.lhs));
+      joined->parent = rhs.get();
+      rhs->intermediateNode.lhs = std::move(joined);
+      rhs->balance_node();
+      return std::move(rhs);
+    }
+
+    return make_intermediate(std::move(lhs), std::move(rhs));
+  }
+
+  /**
+   * Splits a detached subtree at a leaf boundary into [0, at) and [at, size).
+   */
+  static pair<unique_ptr<Rope>, unique_ptr<Rope>> split_subtree(
+      unique_ptr<Rope> &&node, size_t at) {
+    if (node->type == RopeNodeType::Leaf) {
+      node->parent = nullptr;
+      if (at == 0) return {nullptr, std::move(node)};
+      return {std::move(node), nullptr};
+    }
+
+    auto lhs = std::move(node->intermediateNode.lhs);
+    auto rhs = std::move(node->intermediateNode.rhs);
+    lhs->parent = nullptr;
+    rhs->parent = nullptr;
+
+    if (at < lhs->size) {
+      auto halves = split_subtree(std::move(lhs), at);
+      return {std::move(halves.first),
+              join(std::move(halves.second), std::move(rhs))};
+    } else {
+      auto halves = split_subtree(std::move(rhs), at - lhs->size);
+      return {join(std::move(lhs), std::move(halves.first)),
+              std::move(halves.second)};
+    }
+  }
+
+  bool rot_left() {
+    if (type != RopeNodeType::Intermediate) return false;
+    if (intermediateNode.rhs->type != RopeNodeType::Intermediate) return false;
+
+    // Release all connections.
+    auto old_rhs_lhs = intermediateNode.rhs->intermediateNode.lhs.release();
+    auto old_rhs_rhs = intermediateNode.rhs->intermediateNode.rhs.release();
+    auto old_lhs = intermediateNode.lhs.release();
+    auto old_rhs = intermediateNode.rhs.release();
+
+    // Re-connect nodes.
+    intermediateNode.lhs.reset(old_rhs);
+    intermediateNode.rhs.reset(old_rhs_rhs);
+    intermediateNode.lhs->intermediateNode.lhs.reset(old_lhs);
+    intermediateNode.lhs->intermediateNode.rhs.reset(old_rhs_lhs);
+
+    old_lhs->parent = old_rhs;
+    old_rhs_lhs->parent = old_rhs;
+    old_rhs_rhs->parent = this;
+
+    old_rhs->update_node();
+    update_node();
+
+    return true;
+  }
+
+  bool rot_right() {
+    if (type != RopeNodeType::Intermediate) return false;
+    if (intermediateNode.lhs->type != RopeNodeType::Intermediate) return false;
+
+    // Release all connections.
+    auto old_lhs_lhs = intermediateNode.lhs->intermediateNode.lhs.release();
+    auto old_lhs_rhs = intermediateNode.lhs->intermediateNode.rhs.release();
+    auto old_lhs = intermediateNode.lhs.release();
+    auto old_rhs = intermediateNode.rhs.release();
+
+    // Re-connect nodes.
+    intermediateNode.lhs.reset(old_lhs_lhs);
+    intermediateNode.rhs.reset(old_lhs);
+    intermediateNode.rhs->intermediateNode.lhs.reset(old_lhs_rhs);
+    intermediateNode.rhs->intermediateNode.rhs.reset(old_rhs);
+
+    old_lhs_rhs->parent = old_lhs;
+    old_rhs->parent = old_lhs;
+    old_lhs_lhs->parent = this;
+
+    old_lhs->update_node();
+    update_node();
+
+    return true;
+  }
+
+  /**
+   * Restores the AVL property of this node - the children must be balanced.
+   */
+  void balance_node() {
+    update_node();
+    if (type != RopeNodeType::Intermediate || !config->autobalance) return;
+
+    Rope *lhs = intermediateNode.lhs.get();
+    Rope *rhs = intermediateNode.rhs.get();
+
+    if (lhs->tree_height - rhs->tree_height > 1) {
+      if (lhs->child_height(RIGHT) > lhs->child_height(LEFT)) lhs->rot_left();
+      rot_right();
+    } else if (rhs->tree_height - lhs->tree_height > 1) {
+      if (rhs->child_height(LEFT) > rhs->child_height(RIGHT)) rhs->rot_right();
+      rot_left();
+    }
+  }
+
+  void balance() {
+    balance_node();
+    if (parent) parent->balance();
+  }
+
+  /**
+   * Recomputes the cached attributes of an intermediate node from its
+   * children.
+   */
+  void update_node() {
+    if (type == RopeNodeType::Intermediate) {
+      const Rope &lhs = *intermediateNode.lhs;
+      const Rope &rhs = *intermediateNode.rhs;
+
+      size = lhs.size + rhs.size;
+      new_line_count = lhs.new_line_count + rhs.new_line_count;
+      tree_height = max(lhs.tree_height, rhs.tree_height) + 1;
+    } else {
+      tree_height = 0;
+    }
+  }
+
+  /**
+   * BOUNDS
+   */
+
+  bool empty() const { return size == 0; }
+
+  bool in_range(size_t at) const { return at <= size; }
+
+  bool in_range_chars(size_t at) const { return at < size; }
+
+  int child_height(bool is_left) const {
+    if (type != RopeNodeType::Intermediate) return -1;
+    return is_left ? intermediateNode.lhs->tree_height
+                   : intermediateNode.rhs->tree_height;
   }
 
   /**
@@ -467,69 +714,118 @@ struct Rope {
     }
   }
 
-  Rope *node_at(size_t at) const {
+  /**
+   * Leaf of the char at `at`, `leaf_start` is set to where the leaf starts.
+   */
+  Rope *node_at(size_t at, size_t &leaf_start) const {
+    leaf_start = 0;
     if (!in_range_chars(at)) return nullptr;
 
-    if (type == RopeNodeType::Intermediate) {
-      if (intermediateNode.rhs->start <= at) {
-        return intermediateNode.rhs->node_at(at);
+    const Rope *node = this;
+    while (node->type == RopeNodeType::Intermediate) {
+      size_t lhs_size = node->intermediateNode.lhs->size;
+      if (leaf_start + lhs_size <= at) {
+        leaf_start += lhs_size;
+        node = node->intermediateNode.rhs.get();
       } else {
-        return intermediateNode.lhs->node_at(at);
+        node = node->intermediateNode.lhs.get();
       }
     }
 
-    return (Rope *)this;
+    return (Rope *)node;
   }
 
-  int next_line_at(size_t at) const {
-    if (type == RopeNodeType::Intermediate) {
-      auto node = node_at(at);
-      if (!node) return -1;
-      return node->next_line_at(at);
+  Rope *node_at(size_t at) const {
+    size_t leaf_start;
+    return node_at(at, leaf_start);
+  }
+
+  /**
+   * Line breaks in [0, at) - O(log n) using the cached counts.
+   */
+  size_t new_lines_before(size_t at) const {
+    size_t out{0};
+    const Rope *node = this;
+    while (node->type == RopeNodeType::Intermediate) {
+      const Rope *lhs = node->intermediateNode.lhs.get();
+      if (lhs->size <= at) {
+        out += lhs->new_line_count;
+        at -= lhs->size;
+        node = node->intermediateNode.rhs.get();
+      } else {
+        node = lhs;
+      }
     }
 
-    int result = leafNode.next_char_after(at - start, '\n');
-    if (result >= 0) return result + start;
+    size_t leaf_len = min(at, node->size);
+    return out + RopeUtil::count_new_lines(node->leafNode.s.data(), leaf_len);
+  }
 
-    auto next_node = leafNode.right;
-    if (!next_node) return -1;
+  /**
+   * Position of the nth line break (or the size when there is none).
+   */
+  size_t new_line_pos(size_t nth) const {
+    if (nth >= new_line_count) return size;
+
+    size_t node_start{0};
+    const Rope *node = this;
+    while (node->type == RopeNodeType::Intermediate) {
+      const Rope *lhs = node->intermediateNode.lhs.get();
+      if (nth < lhs->new_line_count) {
+        node = lhs;
+      } else {
+        nth -= lhs->new_line_count;
+        node_start += lhs->size;
+        node = node->intermediateNode.rhs.get();
+      }
+    }
 
-    return next_node->next_line_at(next_node->start);
+    return node_start + RopeUtil::nth_new_line_pos(node->leafNode.s, nth);
   }
 
-  int prev_line_at(size_t at) const {
-    if (type == RopeNodeType::Intermediate) {
-      auto node = node_at(at);
-      if (!node) return -1;
-      return node->prev_line_at(at);
-    }
+  int next_line_at(size_t at) const {
+    if (!in_range_chars(at)) return -1;
 
-    int result = leafNode.prev_char_before(at - start, '\n');
-    if (result >= 0) return result + start;
+    size_t nth = new_lines_before(at);
+    return nth < new_line_count ? new_line_pos(nth) : -1;
+  }
 
-    auto prev_node = leafNode.left;
-    if (!prev_node) return -1;
+  int prev_line_at(size_t at) const {
+    if (!in_range_chars(at)) return -1;
 
-    return prev_node->prev_line_at(prev_node->endpos());
+    size_t nth = new_lines_before(at + 1);
+    return nth > 0 ? new_line_pos(nth - 1) : -1;
   }
 
   int nth_new_line_at(size_t nth) const {
-    if (type == RopeNodeType::Intermediate) {
-      return leftmost()->nth_new_line_at(nth);
-    } else {
-      for (size_t i = 0; i < leafNode.s.size(); i++) {
-        if (leafNode.s[i] == '\n') {
-          if (nth == 0) return start + i;
-          nth--;
-        }
-      }
+    return nth < new_line_count ? new_line_pos(nth) : -1;
+  }
 
-      if (leafNode.right) {
-        return leafNode.right->nth_new_line_at(nth);
-      } else {
-        return -1;
-      }
-    }
+  /**
+   * LINES
+   *
+   * Line N is the text between line break N - 1 and N, the last line runs to
+   * the end.
+   */
+
+  size_t line_count() const { return new_line_count + 1; }
+
+  size_t line_start(size_t line_idx) const {
+    assert(line_idx < line_count());
+    return line_idx == 0 ? 0 : new_line_pos(line_idx - 1) + 1;
+  }
+
+  size_t line_size(size_t line_idx) const {
+    return new_line_pos(line_idx) - line_start(line_idx);
+  }
+
+  string line(size_t line_idx) const {
+    return substr(line_start(line_idx), line_size(line_idx));
+  }
+
+  pair<size_t, size_t> position_at(size_t at) const {
+    size_t line_idx = new_lines_before(min(at, size));
+    return {line_idx, min(at, size) - line_start(line_idx)};
   }
 
   /**
@@ -545,20 +841,25 @@ struct Rope {
 
     size_t at_ptr;
 
-    RopeIter(Rope *rope, size_t at_ptr) : at_ptr(at_ptr), rope(rope) {}
+    // The leaf holds at_ptr, it starts at leaf_start.
+    RopeIter(Rope *rope, size_t leaf_start, size_t at_ptr)
+        : at_ptr(at_ptr), rope(rope), leaf_start(leaf_start) {}
 
     reference operator*() const {
-      return rope->leafNode.s[at_ptr - rope->start];
+      return rope->leafNode.s[at_ptr - leaf_start];
     }
 
     pointer operator->() {
-      return rope->leafNode.s.data() + (at_ptr - rope->start);
+      return rope->leafNode.s.data() + (at_ptr - leaf_start);
     }
 
     RopeIter operator++() {
       if (rope) {
         at_ptr++;
-        if (at_ptr > rope->endpos()) rope = rope->leafNode.right;
+        if (at_ptr == leaf_start + rope->size) {
+          leaf_start = at_ptr;
+          rope = rope->leafNode.right;
+        }
       }
 
       return *this;
@@ -580,73 +881,79 @@ struct Rope {
 
    private:
     Rope *rope;
+    size_t leaf_start;
   };
 
-  RopeIter begin() { return RopeIter(leftmost(), 0); }
-  RopeIter end() { return RopeIter(nullptr, size); }
+  RopeIter begin() { return RopeIter(leftmost(), 0, 0); }
+  RopeIter end() { return RopeIter(nullptr, size, size); }
 };
 
 namespace RopeUtil {
-size_t count_new_lines(const string &s) {
+/**
+ * Compares 16 bytes at a time where SSE2 is available (every x86-64).
+ */
+size_t count_new_lines(const char *s, size_t len) {
   size_t out{0};
-  for (auto &c : s) {
-    if (c == '\n') out++;
+  size_t i{0};
+
+#ifdef __SSE2__
+  const __m128i new_line = _mm_set1_epi8('\n');
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(s + i));
+    out += __builtin_popcount(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, new_line)));
   }
-  return out;
-}
-size_t count_new_lines(const string &s, size_t from, size_t to) {
-  size_t out{0};
-  for (size_t i = from; i <= to; i++) {
+#endif
+
+  for (; i < len; i++) {
     if (s[i] == '\n') out++;
   }
   return out;
 }
 
+size_t count_new_lines(const string &s) {
+  return count_new_lines(s.data(), s.size());
+}
+
+size_t count_new_lines(const string &s, size_t from, size_t to) {
+  return count_new_lines(s.data() + from, to - from + 1);
+}
+
 int nth_new_line_pos(const string &s, size_t nth) {
-  for (int i = 0; i < s.size(); i++) {
-    if (s[i] == '\n') {
-      if (nth == 0) return i;
-      nth--;
-    }
+  const char *from = s.data();
+  const char *end = s.data() + s.size();
+  while (from < end) {
+    const char *new_line = (const char *)memchr(from, '\n', end - from);
+    if (!new_line) break;
+    if (nth == 0) return new_line - s.data();
+
+    nth--;
+    from = new_line + 1;
   }
   return -1;
 }
 
 string nth_line(Rope const &rope, size_t nth) {
-  if (rope.empty()) return "";
-
-  int start_pos = nth == 0 ? 0 : rope.nth_new_line_at(nth - 1);
-  if (start_pos == -1) return "";
-
-  int end_pos = rope.nth_new_line_at(nth);
-  if (end_pos == -1) end_pos = rope.endpos();
-  if (start_pos >= end_pos - 1) return "";
-
-  return rope.substr(start_pos + 1, end_pos - start_pos - 1);
+  if (nth >= rope.line_count()) return "";
+  return rope.line(nth);
 }
 
-size_t new_line_count(Rope const &rope) {
-  Rope *r = rope.leftmost();
-  size_t out{0};
-  while (r) {
-    for (auto &c : r->leafNode.s) {
-      if (c == '\n') out++;
-    }
-    r = r->leafNode.right;
-  }
-  return out;
-}
+size_t new_line_count(Rope const &rope) { return rope.new_line_count; }
 
 int find_str(Rope &rope, string const &pattern, size_t pos) {
-  Rope::RopeIter it = Rope::RopeIter(rope.node_at(pos), pos);
+  if (pattern.empty()) return -1;
+
+  size_t leaf_start;
+  Rope *leaf = rope.node_at(pos, leaf_start);
+  Rope::RopeIter it = Rope::RopeIter(leaf, leaf_start, pos);
   Rope::RopeIter it_end = rope.end();
 
   while (it != it_end) {
     if (*it == pattern[0]) {
       auto it_current = it;
       bool has_found{true};
-      for (int i = 0; i < pattern.size() && it_current != it_end; i++) {
-        if (*it_current != pattern[i]) {
+      for (size_t i = 0; i < pattern.size(); i++, it_current++) {
+        if (it_current == it_end || *it_current != pattern[i]) {
           has_found = false;
           break;
         }
@@ -656,8 +963,76 @@ int find_str(Rope &rope, string const &pattern, size_t pos) {
         return it.at_ptr;
       }
     }
+
+    it++;
   }
 
   return -1;
 }
 };  // namespace RopeUtil
+
+/**
+ * Line based editing on top of a rope - the same operations `Lines` has, for
+ * content where lines are too long to be stored one by one (eg. minified
+ * JSON). Lines are separated by a line break, the last line has none.
+ */
+struct RopeLines {
+  Rope rope;
+
+  RopeLines() {}
+  RopeLines(shared_ptr<RopeConfig> config, string &&text)
+      : rope(config, std::forward<string>(text)) {}
+
+  size_t line_count() const { return rope.line_count(); }
+
+  size_t line_size(size_t line_idx) const { return rope.line_size(line_idx); }
+
+  string line(size_t line_idx) const { return rope.line(line_idx); }
+
+  string to_string() const { return rope.to_string(); }
+
+  bool insert(size_t line_idx, size_t pos, string snippet) {
+    if (line_idx >= line_count() || pos > line_size(line_idx)) return false;
+    return rope.insert(rope.line_start(line_idx) + pos, std::move(snippet));
+  }
+
+  bool insert_line(size_t at, string snippet) {
+    if (at > line_count()) return false;
+
+    if (at == line_count()) {
+      return rope.insert(rope.size, "\n" + snippet);
+    } else {
+      return rope.insert(rope.line_start(at), snippet + "\n");
+    }
+  }
+
+  /**
+   * Removes the character before pos - or the line break before the line.
+   */
+  bool backspace(size_t line_idx, size_t pos) {
+    if (line_idx >= line_count() || pos > line_size(line_idx)) return false;
+    if (line_idx == 0 && pos == 0) return false;
+
+    rope.remove(rope.line_start(line_idx) + pos - 1);
+    return true;
+  }
+
+  void remove_line(size_t line_idx) {
+    assert(line_idx < line_count());
+
+    size_t from = rope.line_start(line_idx);
+    size_t to = rope.new_line_pos(line_idx);
+    // The last line takes the line break before it.
+    if (to == rope.size && from > 0) from--;
+
+    if (to > from) rope.remove_range(from, min(to, rope.size - 1));
+  }
+
+  size_t byte_offset(size_t line_idx, size_t pos) const {
+    return rope.line_start(line_idx) + pos;
+  }
+
+  pair<size_t, size_t> position_at_byte_offset(size_t offset) const {
+    return rope.position_at(offset);
+  }
+};
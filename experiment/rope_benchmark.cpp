@@ -3,6 +3,7 @@
 #include <iostream>
 #include <sstream>
 
+#include "lines.h"
 #include "rope.h"
 
 using namespace std;
@@ -65,6 +66,48 @@ String insert 1000 times | T: 1024.83 ms
 
 */
 
+// Minified JSON like content: one line of `bytes` length.
+string make_long_line(size_t bytes) {
+  string out{};
+  out.reserve(bytes);
+  for (size_t i = 0; out.size() < bytes; i++) {
+    out.append("{\"id\":" + to_string(i) + ",\"tags\":[\"a\",\"b\"]},");
+  }
+  out.resize(bytes);
+  return out;
+}
+
+void benchmark_long_line_edits(size_t bytes, int edit_count) {
+  vector<size_t> positions{};
+  srand(1);
+  for (int i = 0; i < edit_count; i++) positions.push_back(rand() % bytes);
+
+  Lines lines{vector<string>{make_long_line(bytes)}};
+  measure("Lines edits in a " + to_string(bytes >> 20) + "MB line", [&]() {
+    for (auto pos : positions) {
+      lines.insert(0, pos, "x");
+      lines.backspace(0, pos + 1);
+    }
+  });
+
+  RopeLines rope_lines{make_shared<RopeConfig>(1024), make_long_line(bytes)};
+  measure("RopeLines edits in a " + to_string(bytes >> 20) + "MB line", [&]() {
+    for (auto pos : positions) {
+      rope_lines.insert(0, pos, "x");
+      rope_lines.backspace(0, pos + 1);
+    }
+  });
+}
+
+/*
+
+-O2, 1 core:
+
+Lines edits in a 16MB line | T: 1007.30 ms
+RopeLines edits in a 16MB line | T: 122.19 ms
+
+*/
+
 int main(void) {
   for (size_t i = 8; i <= 4096; i *= 2) {
     benchmark_insert_rope(i);
@@ -72,5 +115,7 @@ int main(void) {
 
   benchmark_insert_string();
 
+  benchmark_long_line_edits(16 << 20, 1000);
+
   return EXIT_SUCCESS;
 }
\ No newline at end of file
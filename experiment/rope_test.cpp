@@ -9,6 +9,7 @@
 #define ASSERT_EQ(v1, v2) assert_eq(v1, v2, __LINE__)
 #define ASSERT_NOT_NULLPTR(ptr) assert_not_nullptr(ptr, __LINE__)
 #define ASSERT_NULLPTR(ptr) assert_nullptr(ptr, __LINE__)
+#define ASSERT_IC(root) ASSERT_EQ(true, root.integrity_check())
 
 template <typename T>
 void assert_eq(T v1, T v2, int lineNo) {
@@ -483,9 +484,164 @@ void test_find_str() {
   ASSERT_EQ(0, RopeUtil::find_str(*(rope.get()), "a", 0));
   ASSERT_EQ(0, RopeUtil::find_str(*(rope.get()), "ab", 0));
   ASSERT_EQ(0, RopeUtil::find_str(*(rope.get()), "abc", 0));
-  ASSERT_EQ(0, RopeUtil::find_str(*(rope.get()), "abcdedg", 0));
+  ASSERT_EQ(-1, RopeUtil::find_str(*(rope.get()), "abcdedg", 0));
 
   ASSERT_EQ(5, RopeUtil::find_str(*(rope.get()), "fghi", 0));
+  ASSERT_EQ(14, RopeUtil::find_str(*(rope.get()), "op", 3));
+  ASSERT_EQ(-1, RopeUtil::find_str(*(rope.get()), "opq", 3));
+}
+
+void test_count_new_lines() {
+  srand(3);
+  for (size_t len = 0; len < 70; len++) {
+    string s{};
+    for (size_t i = 0; i < len; i++) s.push_back(rand() % 4 == 0 ? '\n' : 'a');
+
+    ASSERT_EQ((size_t)count(s.begin(), s.end(), '\n'),
+              RopeUtil::count_new_lines(s));
+  }
+
+  ASSERT_EQ((size_t)2, RopeUtil::count_new_lines("ab\ncd\nef", 1, 5));
+}
+
+void test_cached_new_line_count() {
+  Rope r{make_shared<RopeConfig>(4), "\n"s};
+
+  srand(11);
+  for (int i = 0; i < 500; i++) {
+    size_t at = rand() % (r.size + 1);
+    if (rand() % 3 == 0 && r.size > 1) {
+      size_t to = min(r.size - 1, at + rand() % 6);
+      r.remove_range(min(at, to), to);
+    } else {
+      r.insert(at, rand() % 2 ? "x\ny"s : "ab"s);
+    }
+
+    string text = r.to_string();
+    ASSERT_EQ((size_t)count(text.begin(), text.end(), '\n'), r.new_line_count);
+  }
+
+  ASSERT_IC(r);
+}
+
+bool is_balanced(const Rope &r) {
+  if (r.type == RopeNodeType::Leaf) return true;
+
+  const Rope &lhs = *r.intermediateNode.lhs;
+  const Rope &rhs = *r.intermediateNode.rhs;
+  return abs(lhs.tree_height - rhs.tree_height) <= 1 && is_balanced(lhs) &&
+         is_balanced(rhs);
+}
+
+void test_balanced_appends() {
+  Rope r{make_shared<RopeConfig>(4), ""s};
+  for (int i = 0; i < 2000; i++) r.insert(r.size, "abc");
+
+  ASSERT_IC(r);
+  ASSERT_EQ(true, is_balanced(r));
+  // About 1500 leaves: an AVL tree of those is at most 1.44 * log2 levels.
+  ASSERT_EQ(true, r.tree_height <= 16);
+
+  r.remove_range(10, 5000);
+  ASSERT_IC(r);
+  ASSERT_EQ(true, is_balanced(r));
+  ASSERT_EQ((size_t)1009, r.size);
+}
+
+void test_append() {
+  Rope lhs{make_shared<RopeConfig>(2), ""s};
+  for (int i = 0; i < 100; i++) lhs.insert(lhs.size, "ab\n");
+  Rope rhs{make_shared<RopeConfig>(2), "x\ny"s};
+
+  string expected = lhs.to_string() + rhs.to_string();
+  lhs.append(std::move(rhs));
+
+  ASSERT_EQ(expected, lhs.to_string());
+  ASSERT_EQ((size_t)101, lhs.new_line_count);
+  ASSERT_EQ(true, rhs.empty());
+  ASSERT_IC(lhs);
+  ASSERT_EQ(true, is_balanced(lhs));
+  ASSERT_EQ("b\nx\ny"s, lhs.substr(298, 10));
+
+  Rope single{"q"};
+  single.append(Rope{"rs"});
+  ASSERT_EQ("[0:0 q][1:2 rs]"s, single.debug_to_string());
+  ASSERT_IC(single);
+}
+
+void test_split_off() {
+  Rope r{make_shared<RopeConfig>(2), ""s};
+  for (int i = 0; i < 100; i++) r.insert(r.size, std::to_string(i % 10) + "\n");
+  string text = r.to_string();
+
+  Rope tail = r.split_off(51);
+  ASSERT_EQ(text.substr(0, 51), r.to_string());
+  ASSERT_EQ(text.substr(51), tail.to_string());
+  ASSERT_EQ(text.substr(51, 4), tail.substr(0, 4));
+  ASSERT_IC(r);
+  ASSERT_IC(tail);
+  ASSERT_EQ(true, is_balanced(r));
+  ASSERT_EQ(true, is_balanced(tail));
+  ASSERT_EQ((size_t)25, r.new_line_count);
+  ASSERT_EQ((size_t)75, tail.new_line_count);
+
+  r.append(std::move(tail));
+  ASSERT_EQ(text, r.to_string());
+  ASSERT_IC(r);
+
+  Rope all = r.split_off(0);
+  ASSERT_EQ(true, r.empty());
+  ASSERT_EQ(text, all.to_string());
+  ASSERT_EQ(true, all.split_off(all.size).empty());
+}
+
+void test_lines() {
+  Rope r{make_shared<RopeConfig>(3), "ab\n\ncdef\ng"s};
+  r.split(5);
+  r.split(8);
+
+  ASSERT_EQ((size_t)4, r.line_count());
+  ASSERT_EQ("ab"s, r.line(0));
+  ASSERT_EQ(""s, r.line(1));
+  ASSERT_EQ("cdef"s, r.line(2));
+  ASSERT_EQ("g"s, r.line(3));
+  ASSERT_EQ((size_t)4, r.line_size(2));
+  ASSERT_EQ((size_t)4, r.line_start(2));
+
+  ASSERT_EQ(true, make_pair((size_t)2, (size_t)3) == r.position_at(7));
+  ASSERT_EQ(true, make_pair((size_t)3, (size_t)1) == r.position_at(100));
+  ASSERT_EQ((size_t)2, r.new_lines_before(4));
+}
+
+void test_rope_lines() {
+  RopeLines l{make_shared<RopeConfig>(4), "hello\nworld"s};
+
+  ASSERT_EQ(true, l.insert(1, 5, "!"));
+  ASSERT_EQ(false, l.insert(2, 0, "x"));
+  ASSERT_EQ("hello\nworld!"s, l.to_string());
+
+  ASSERT_EQ(true, l.insert_line(1, "mid"));
+  ASSERT_EQ(true, l.insert_line(3, "end"));
+  ASSERT_EQ("hello\nmid\nworld!\nend"s, l.to_string());
+  ASSERT_EQ((size_t)4, l.line_count());
+
+  ASSERT_EQ(true, l.backspace(2, 0));
+  ASSERT_EQ("hello\nmidworld!\nend"s, l.to_string());
+  ASSERT_EQ(true, l.backspace(1, 3));
+  ASSERT_EQ(false, l.backspace(0, 0));
+  ASSERT_EQ("miworld!"s, l.line(1));
+
+  l.remove_line(2);
+  ASSERT_EQ("hello\nmiworld!"s, l.to_string());
+  l.remove_line(0);
+  ASSERT_EQ("miworld!"s, l.to_string());
+  l.remove_line(0);
+  ASSERT_EQ(""s, l.to_string());
+  ASSERT_EQ((size_t)1, l.line_count());
+
+  RopeLines json{make_shared<RopeConfig>(8), "{\"a\":[1,2,3]}"s};
+  ASSERT_EQ((size_t)7, json.byte_offset(0, 7));
+  ASSERT_EQ(true, make_pair((size_t)0, (size_t)7) == json.position_at_byte_offset(7));
 }
 
 // void test_find_str_from_mid() { Rope r{"abc012abc345abc678"};
@@ -534,6 +690,16 @@ int main() {
 
   test_iterator();
 
+  test_find_str();
+
+  test_count_new_lines();
+  test_cached_new_line_count();
+  test_balanced_appends();
+  test_append();
+  test_split_off();
+  test_lines();
+  test_rope_lines();
+
   printf("\nCompleted\n");
 
   return EXIT_SUCCESS;
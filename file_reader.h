@@ -0,0 +1,336 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "debug.h"
+
+// Below this much work per thread the thread startup costs more than it saves.
+#define FILE_READER_MIN_BYTES_PER_THREAD (1 << 20)
+// Unit of lazy line indexing.
+#define LAZY_LINE_INDEX_CHUNK_SIZE (64 << 20)
+// The line count is estimated from this many evenly spread windows of the file.
+#define LAZY_LINE_INDEX_SAMPLE_COUNT 16
+#define LAZY_LINE_INDEX_SAMPLE_SIZE (64 << 10)
+
+using namespace std;
+
+/**
+ * Runs fn(0) .. fn(taskCount - 1), each on its own thread (the first one on the caller's).
+ */
+template <typename F>
+void parallelFor(size_t taskCount, const F &fn) {
+  vector<thread> workers{};
+  for (size_t i = 1; i < taskCount; i++) workers.emplace_back(fn, i);
+  fn(0);
+  for (auto &worker : workers) worker.join();
+}
+
+size_t fileReaderThreadCount(size_t byteCount) {
+  return min((size_t)max(thread::hardware_concurrency(), 1u),
+             max(byteCount / FILE_READER_MIN_BYTES_PER_THREAD, (size_t)1));
+}
+
+/**
+ * Read only memory map of a whole file.
+ */
+struct MappedFile {
+  const char *data{nullptr};
+  size_t size{0};
+
+  MappedFile() {
+  }
+  MappedFile(MappedFile &) = delete;
+  MappedFile &operator=(MappedFile &) = delete;
+
+  ~MappedFile() {
+    unmap();
+  }
+
+  bool map(const string &filePath) {
+    unmap();
+
+    int fd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      close(fd);
+      return false;
+    }
+
+    size = st.st_size;
+    if (size > 0) {
+      // Shared: a file saved in place shows through (see `PieceTableBuffer::markSaved`).
+      void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (addr == MAP_FAILED) {
+        close(fd);
+        size = 0;
+        return false;
+      }
+
+      madvise(addr, size, MADV_WILLNEED);
+      data = (const char *)addr;
+    }
+
+    // The mapping stays valid without the descriptor.
+    close(fd);
+    return true;
+  }
+
+  void unmap() {
+    if (data) munmap((void *)data, size);
+    data = nullptr;
+    size = 0;
+  }
+};
+
+/**
+ * Collects the (exclusive) end offset of every line of the mapped file, see `indexFileLines`.
+ */
+void indexLines(const MappedFile &file, vector<size_t> &lineEnds) {
+  lineEnds.clear();
+  if (file.size == 0) return;
+
+  size_t threadCount = fileReaderThreadCount(file.size);
+
+  // Newline offsets per byte chunk.
+  vector<vector<size_t>> chunkNewLines(threadCount);
+  parallelFor(threadCount, [&](size_t chunkIdx) {
+    const char *from = file.data + file.size * chunkIdx / threadCount;
+    const char *to = file.data + file.size * (chunkIdx + 1) / threadCount;
+
+    while (from < to) {
+      const char *newLine = (const char *)memchr(from, '\n', to - from);
+      if (!newLine) break;
+
+      chunkNewLines[chunkIdx].push_back(newLine - file.data);
+      from = newLine + 1;
+    }
+  });
+
+  lineEnds = std::move(chunkNewLines[0]);
+  for (size_t i = 1; i < threadCount; i++) {
+    lineEnds.insert(lineEnds.end(), chunkNewLines[i].begin(), chunkNewLines[i].end());
+  }
+  if (file.data[file.size - 1] != '\n') lineEnds.push_back(file.size);
+}
+
+/**
+ * Maps the file and collects the (exclusive) end offset of every line, splitting the same way `getline` does (no
+ * trailing empty line after a closing newline). The newline scan (memchr - vectorized in libc) is split across the
+ * cores.
+ */
+bool indexFileLines(const string &filePath, MappedFile &file, vector<size_t> &lineEnds) {
+  if (!file.map(filePath)) return false;
+
+  DLOG("Indexing %s (%lu bytes)", filePath.c_str(), file.size);
+  indexLines(file, lineEnds);
+  return true;
+}
+
+/**
+ * Identity and version of a file on disk - tells whether it has been replaced or changed since.
+ */
+struct FileStamp {
+  dev_t device{0};
+  ino_t inode{0};
+  size_t size{0};
+  int64_t modifiedNs{0};
+
+  bool operator==(const FileStamp &) const = default;
+};
+
+bool readFileStamp(const string &filePath, FileStamp &out) {
+  struct stat st;
+  if (stat(filePath.c_str(), &st) == -1) return false;
+
+  out = FileStamp{st.st_dev, st.st_ino, (size_t)st.st_size, st.st_mtim.tv_sec * 1000000000l + st.st_mtim.tv_nsec};
+  return true;
+}
+
+/**
+ * Reads the file from `from` to its current end. False when it can't be read or it's shorter than `from`.
+ */
+bool readFileFrom(const string &filePath, size_t from, string &out) {
+  int fd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < from) {
+    close(fd);
+    return false;
+  }
+
+  out.resize(st.st_size - from);
+  size_t readLen{0};
+  while (readLen < out.size()) {
+    ssize_t chunkLen = pread(fd, out.data() + readLen, out.size() - readLen, from + readLen);
+    if (chunkLen <= 0) break;
+
+    readLen += chunkLen;
+  }
+  out.resize(readLen);
+
+  close(fd);
+  return true;
+}
+
+/**
+ * Reads the file into separate line strings (see `indexFileLines`), copying the lines on all cores.
+ */
+bool readFileLines(const string &filePath, vector<string> &lines) {
+  MappedFile file{};
+  vector<size_t> lineEnds{};
+  if (!indexFileLines(filePath, file, lineEnds)) return false;
+
+  lines.clear();
+  lines.resize(lineEnds.size());
+
+  size_t threadCount = fileReaderThreadCount(file.size);
+  parallelFor(threadCount, [&](size_t chunkIdx) {
+    size_t from = lineEnds.size() * chunkIdx / threadCount;
+    size_t to = lineEnds.size() * (chunkIdx + 1) / threadCount;
+
+    for (size_t i = from; i < to; i++) {
+      size_t lineStart = i == 0 ? 0 : lineEnds[i - 1] + 1;
+      lines[i].assign(file.data + lineStart, lineEnds[i] - lineStart);
+    }
+  });
+
+  return true;
+}
+
+/**
+ * Newline index of a mapped file built chunk by chunk: on demand by `ensure` and by a background thread walking the
+ * rest. Until it's complete the line count is only an estimate, sampled on construction.
+ */
+struct LazyLineIndex {
+  shared_ptr<MappedFile> file;
+  size_t chunkSize;
+  size_t estimatedLineBreakCount{0};
+
+  // Serializes the chunk indexers (the chunks have to be indexed in order).
+  mutex chunkLock{};
+  // Guards the index below.
+  mutex indexLock{};
+  vector<size_t> lineBreaks{};
+  size_t indexedBytes{0};
+
+  atomic<bool> stopping{false};
+  thread worker{};
+
+  LazyLineIndex(shared_ptr<MappedFile> file, size_t chunkSize = LAZY_LINE_INDEX_CHUNK_SIZE)
+      : file(file), chunkSize(chunkSize) {
+    estimatedLineBreakCount = sampleLineBreakCount();
+    indexNextChunk();
+
+    worker = thread([this]() {
+      while (!stopping && indexNextChunk()) {
+      }
+    });
+  }
+  LazyLineIndex(LazyLineIndex &) = delete;
+  LazyLineIndex &operator=(LazyLineIndex &) = delete;
+
+  ~LazyLineIndex() {
+    stopping = true;
+    worker.join();
+  }
+
+  bool isComplete() {
+    lock_guard<mutex> guard(indexLock);
+    return indexedBytes == file->size;
+  }
+
+  size_t knownLineBreakCount() {
+    lock_guard<mutex> guard(indexLock);
+    return lineBreaks.size();
+  }
+
+  /**
+   * The exact count when complete, the sampled estimate otherwise.
+   */
+  size_t lineBreakCount() {
+    lock_guard<mutex> guard(indexLock);
+    if (indexedBytes == file->size) return lineBreaks.size();
+
+    // The estimate might be off - still no less than what's known.
+    return max(estimatedLineBreakCount, lineBreaks.size());
+  }
+
+  /**
+   * Indexes (in the calling thread) until `count` line breaks are known or the whole file is indexed.
+   */
+  void ensure(size_t count) {
+    while (knownLineBreakCount() < count && indexNextChunk()) {
+    }
+  }
+
+  // Offset of the nth line break, it has to be ensured.
+  size_t lineBreak(size_t nth) {
+    lock_guard<mutex> guard(indexLock);
+    return lineBreaks[nth];
+  }
+
+  /**
+   * Finishes the index in the calling thread and hands it over.
+   */
+  vector<size_t> take() {
+    while (indexNextChunk()) {
+    }
+
+    lock_guard<mutex> guard(indexLock);
+    return std::move(lineBreaks);
+  }
+
+ private:
+  bool indexNextChunk() {
+    lock_guard<mutex> chunkGuard(chunkLock);
+
+    size_t from{0};
+    {
+      lock_guard<mutex> guard(indexLock);
+      from = indexedBytes;
+    }
+    if (from >= file->size) return false;
+
+    size_t to = min(from + chunkSize, file->size);
+    vector<size_t> chunkLineBreaks{};
+    for (const char *it = file->data + from, *end = file->data + to; it < end; it++) {
+      it = (const char *)memchr(it, '\n', end - it);
+      if (!it) break;
+
+      chunkLineBreaks.push_back(it - file->data);
+    }
+
+    lock_guard<mutex> guard(indexLock);
+    lineBreaks.insert(lineBreaks.end(), chunkLineBreaks.begin(), chunkLineBreaks.end());
+    indexedBytes = to;
+    return true;
+  }
+
+  size_t sampleLineBreakCount() {
+    size_t sampleSize = min((size_t)LAZY_LINE_INDEX_SAMPLE_SIZE, file->size / LAZY_LINE_INDEX_SAMPLE_COUNT);
+    if (sampleSize == 0) return count(file->data, file->data + file->size, '\n');
+
+    size_t sampledLineBreaks{0};
+    for (size_t i = 0; i < LAZY_LINE_INDEX_SAMPLE_COUNT; i++) {
+      const char *from = file->data + (file->size - sampleSize) * i / (LAZY_LINE_INDEX_SAMPLE_COUNT - 1);
+      sampledLineBreaks += count(from, from + sampleSize, '\n');
+    }
+
+    return (double)sampledLineBreaks * file->size / (sampleSize * LAZY_LINE_INDEX_SAMPLE_COUNT);
+  }
+};
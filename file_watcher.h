@@ -19,21 +19,27 @@ using namespace std;
 struct FileWatcher {
   FileWatcher() {}
 
-  bool watch(string filePathArg) {
-    if (fd != -1 && wd != -1) {
-      if (inotify_rm_watch(fd, wd) == -1)
-        reportAndExit("Cannot remove file monitoring");
-
-      fd = -1;
-    }
+  // Set when a modification was read from the fd but not handled yet.
+  bool hasPendingModification{false};
 
-    fd = inotify_init();
-    if (fd == -1) reportAndExit("Cannot init inotify");
+  /**
+   * Watching again (a new file or the same one replaced by a save) keeps the inotify instance - its fd stays registered
+   * in the event loop, only the watch is swapped.
+   */
+  bool watch(string filePathArg) {
+    if (fd == -1) {
+      fd = inotify_init();
+      if (fd == -1) reportAndExit("Cannot init inotify");
 
-    int flags = fcntl(fd, F_GETFL);
-    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-      reportAndExit("Cannot make file watch event read non blocking");
+      int flags = fcntl(fd, F_GETFL);
+      if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        reportAndExit("Cannot make file watch event read non blocking");
+      }
+    } else if (wd != -1) {
+      // Fails when the watched file is gone already (it removes the watch) - nothing to do then.
+      if (inotify_rm_watch(fd, wd) == -1) DLOG("Cannot remove watch of %s", filePath.c_str());
     }
+    hasPendingModification = false;
 
     filePath = filePathArg;
     wd = inotify_add_watch(fd, filePathArg.c_str(), IN_MODIFY);
@@ -58,21 +64,34 @@ struct FileWatcher {
       reportAndExit("Invalid length (0) for event read");
     }
 
+    bool hasModify{false};
     char *p;
     for (p = buf; p < buf + readLen;) {
       struct inotify_event *event = (struct inotify_event *)p;
       p += sizeof(struct inotify_event) + event->len;
 
-      if ((event->mask & IN_MODIFY) ? "modify" : "not modify") {
-        return true;
-      }
+      // Events of a previous watch (and its removal) might still be queued.
+      if (event->wd == wd && (event->mask & IN_MODIFY)) hasModify = true;
     }
 
-    return false;
+    return hasModify;
   }
 
   void ignoreEventCycle() { hasBeenModified(); }
 
+  void unwatch() {
+    if (fd == -1) return;
+
+    // Closing the inotify instance removes the watch too.
+    if (close(fd) == -1) reportAndExit("Cannot remove file monitoring");
+
+    fd = -1;
+    wd = -1;
+    hasPendingModification = false;
+  }
+
+  inline int getFd() const { return fd; }
+
  private:
   int fd{-1};
   int wd{-1};
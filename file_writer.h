@@ -0,0 +1,190 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std;
+
+// Chunks per writev call (IOV_MAX on Linux).
+#define FILE_WRITER_BATCH_SIZE 1024
+
+enum class FsyncPolicy {
+  // Flushing is left to the OS - after a crash the file might be empty or the old one.
+  None,
+  // The content is synced before the rename - after a crash the file is either the old or the new one.
+  File,
+  // Big files are rewritten in place from their first changed byte, then synced - the save costs as much as the change,
+  // but a crash in the middle leaves the file half old, half new. Other files are saved as with File.
+  InPlace,
+  // The directory is synced after the rename too - the save survives a crash once it's done.
+  Full,
+};
+
+/**
+ * Gathers the written chunks into writev batches, so they have to stay valid until the commit.
+ */
+struct BatchedFileWriter {
+  int fd{-1};
+  vector<iovec> batch{};
+  bool failed{false};
+
+  bool write(string_view chunk) {
+    if (chunk.empty()) return !failed;
+
+    batch.push_back(iovec{(void *)chunk.data(), chunk.size()});
+    if (batch.size() == FILE_WRITER_BATCH_SIZE) flush();
+
+    return !failed;
+  }
+
+  void flush() {
+    size_t from{0};
+    while (!failed && from < batch.size()) {
+      ssize_t written = writev(fd, batch.data() + from, batch.size() - from);
+      if (written == -1) {
+        if (errno != EINTR) failed = true;
+        continue;
+      }
+
+      // Skip the written chunks and cut the partially written one.
+      while (from < batch.size() && (size_t)written >= batch[from].iov_len) written -= batch[from++].iov_len;
+      if (from < batch.size()) {
+        batch[from].iov_base = (char *)batch[from].iov_base + written;
+        batch[from].iov_len -= written;
+      }
+    }
+
+    batch.clear();
+  }
+};
+
+/**
+ * Writes a file through a temp file in the same directory, renamed over the target on commit - the original is never
+ * partially overwritten.
+ */
+struct AtomicFileWriter : BatchedFileWriter {
+  string filePath;
+  string tempPath{};
+
+  AtomicFileWriter(const string &filePath) : filePath(filePath) {
+  }
+  AtomicFileWriter(AtomicFileWriter &) = delete;
+  AtomicFileWriter &operator=(AtomicFileWriter &) = delete;
+
+  ~AtomicFileWriter() {
+    discard();
+  }
+
+  bool open() {
+    // Replacing a symlink would turn it into a regular file - its target is replaced instead.
+    error_code ec{};
+    if (filesystem::is_symlink(filePath, ec)) {
+      filePath = filesystem::canonical(filePath, ec);
+      if (ec) return false;
+    }
+
+    tempPath = filePath + ".XXXXXX";
+    fd = mkstemp(tempPath.data());
+    if (fd == -1) {
+      tempPath.clear();
+      return false;
+    }
+
+    // The temp file is created as 0600 - keep the mode of the replaced file or use the default one for a new file.
+    struct stat st;
+    if (stat(filePath.c_str(), &st) == 0) {
+      fchmod(fd, st.st_mode & 07777);
+    } else {
+      mode_t mask = umask(0);
+      umask(mask);
+      fchmod(fd, 0666 & ~mask);
+    }
+
+    return true;
+  }
+
+  bool commit(FsyncPolicy fsyncPolicy) {
+    flush();
+
+    if (failed || (fsyncPolicy != FsyncPolicy::None && fsync(fd) == -1) || close(fd) == -1) {
+      fd = -1;
+      discard();
+      return false;
+    }
+    fd = -1;
+
+    if (rename(tempPath.c_str(), filePath.c_str()) == -1) {
+      discard();
+      return false;
+    }
+    tempPath.clear();
+
+    if (fsyncPolicy == FsyncPolicy::Full) {
+      string dirPath = filesystem::path(filePath).parent_path();
+      int dirFd = ::open(dirPath.empty() ? "." : dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dirFd == -1) return false;
+
+      bool isSynced = fsync(dirFd) == 0;
+      close(dirFd);
+      return isSynced;
+    }
+
+    return true;
+  }
+
+  /**
+   * Drops the temp file, the target is left untouched.
+   */
+  void discard() {
+    if (fd != -1) close(fd);
+    fd = -1;
+
+    if (!tempPath.empty()) unlink(tempPath.c_str());
+    tempPath.clear();
+  }
+};
+
+/**
+ * Overwrites an existing file from an offset on and cuts it at the end of the written content. The bytes before the
+ * offset are left alone, so the cost is the size of the rewritten tail. Not atomic: a crash in the middle leaves a
+ * partially written tail.
+ */
+struct FileTailWriter : BatchedFileWriter {
+  FileTailWriter() {
+  }
+  FileTailWriter(FileTailWriter &) = delete;
+  FileTailWriter &operator=(FileTailWriter &) = delete;
+
+  ~FileTailWriter() {
+    if (fd != -1) close(fd);
+  }
+
+  bool open(const string &filePath, size_t from) {
+    fd = ::open(filePath.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+
+    return lseek(fd, from, SEEK_SET) != -1;
+  }
+
+  bool commit(FsyncPolicy fsyncPolicy) {
+    flush();
+    if (failed) return false;
+
+    off_t end = lseek(fd, 0, SEEK_CUR);
+    if (end == -1 || ftruncate(fd, end) == -1) return false;
+    if (fsyncPolicy != FsyncPolicy::None && fsync(fd) == -1) return false;
+
+    bool isClosed = close(fd) == 0;
+    fd = -1;
+    return isClosed;
+  }
+};
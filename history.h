@@ -1,14 +1,31 @@
 #pragma once
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <deque>
+#include <functional>
+#include <memory>
 #include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "command.h"
+#include "debug.h"
+#include "history_journal.h"
 #include "utility.h"
 
-#define UNDO_LIMIT 64
+// Memory held by the history - the oldest units are dropped above this.
+#define HISTORY_MEMORY_LIMIT (64 << 20)
+// Command payloads from this size on are kept compressed.
+#define HISTORY_PACK_MIN_SIZE 4096
+// Typing after a pause this long starts a new undo unit.
+#define HISTORY_COALESCE_IDLE_MS 1000
 
 using namespace std;
 
@@ -23,29 +40,81 @@ struct HistoryUnit {
   optional<SelectionEdge> afterSelectionEnd;
   Point afterCursor;
 
+  // The state after the unit, and the one it was applied on (see `History::baseId`).
+  uint64_t id{0};
+  uint64_t parentId{0};
+
+  // Memory held by the commands (packed payloads by their compressed size).
+  size_t bytes{0};
+  chrono::steady_clock::time_point closedAt{};
+  // Wall clock time of the last edit in the unit.
+  chrono::system_clock::time_point time{};
+
+  // Where the unit is in the journal, SIZE_MAX when it's not journaled.
+  size_t journalOffset{SIZE_MAX};
+  size_t journalEnd{0};
+
   // Debug flag protecting against nested blocks.
   bool final{false};
 
   HistoryUnit() {}
 };
 
+/**
+ * Units undone and then left for a new edit - kept for switching back to them.
+ */
+struct HistoryBranch {
+  // The state the branch starts from.
+  uint64_t parentId;
+  // Like `redos`: the back is the first unit of the branch.
+  deque<HistoryUnit> units;
+};
+
+/**
+ * Units are only ever moved between the undo and redo lists, their payloads are never copied.
+ *
+ * The history is a tree of states: `undos` lead from `baseId` to the current state, `redos` go on from there on the
+ * active branch, and the other branches hang off their parent state. A new edit after undo moves the redo list into a
+ * branch instead of dropping it.
+ *
+ * With a journal each closed unit is appended to it too. The units dropped from memory (or left in an earlier session)
+ * are read back from it one by one when undo gets past the ones in memory.
+ */
 struct History {
   deque<HistoryUnit> undos;
   deque<HistoryUnit> redos;
+  vector<HistoryBranch> branches{};
+  unique_ptr<HistoryJournal> journal{};
+
+  // The state before the oldest unit in memory.
+  uint64_t baseId{0};
+  uint64_t nextId{1};
+
+  size_t memoryLimit{HISTORY_MEMORY_LIMIT};
+  // Held by all the units, branches included.
+  size_t memoryBytes{0};
+  chrono::milliseconds coalesceIdle{HISTORY_COALESCE_IDLE_MS};
 
   void newBlock(ITextViewState* textViewState) {
     if (!undos.empty() && !undos.back().final)
       reportAndExit("Nested history detected");
 
-    redos.clear();
+    if (!redos.empty()) {
+      unjournal(redos);
+      branches.push_back(HistoryBranch{currentId(), move(redos)});
+      redos.clear();
+    }
 
+    uint64_t parentId = currentId();
     undos.emplace_back();
+    last().id = nextId++;
+    last().parentId = parentId;
+    last().bytes = sizeof(HistoryUnit);
+    memoryBytes += last().bytes;
 
     last().beforeSelectionStart = textViewState->getSelectionStart();
     last().beforeSelectionEnd = textViewState->getSelectionEnd();
     last().beforeCursor = textViewState->getCursor();
-
-    while (undos.size() > UNDO_LIMIT) undos.pop_front();
   }
 
   void closeBlock(ITextViewState* textViewState) {
@@ -54,35 +123,444 @@ struct History {
     last().afterCursor = textViewState->getCursor();
 
     last().final = true;
+    last().closedAt = chrono::steady_clock::now();
+    last().time = chrono::system_clock::now();
+
+    coalesceLast();
+    journalLast();
+
+    // Branches go first, oldest first. The last unit stays even when it's over the limit alone.
+    while (memoryBytes > memoryLimit && !branches.empty()) dropBranch(oldestBranch());
+    while (memoryBytes > memoryLimit && undos.size() > 1) {
+      uint64_t oldBaseId = baseId;
+      baseId = undos.front().id;
+      memoryBytes -= undos.front().bytes;
+      undos.pop_front();
+      dropBranchesAt(oldBaseId);
+    }
   }
 
   void record(Command&& cmd) {
     if (last().final) reportAndExit("Adding command to a final unit");
 
+    if (cmd.memoryStr.size() >= HISTORY_PACK_MIN_SIZE) {
+      cmd.packedMemory = make_shared<const PackedString>(cmd.memoryStr);
+      // Releases the buffer too - clear() would keep it.
+      cmd.memoryStr = string{};
+    }
+
+    size_t bytes = commandBytes(cmd);
+    last().bytes += bytes;
+    memoryBytes += bytes;
+
     last().commands.push_back(move(cmd));
   }
 
   HistoryUnit& useUndo() {
     if (undos.empty()) reportAndExit("Empty undo list, cannot undo");
 
-    redos.push_back(undos.back());
+    redos.push_back(move(undos.back()));
     undos.pop_back();
 
+    if (journal && redos.back().journalOffset != SIZE_MAX) journal->end = redos.back().journalOffset;
+
     return redos.back();
   }
 
   HistoryUnit& useRedo() {
     if (redos.empty()) reportAndExit("Empty redo list, cannot undo");
 
-    undos.push_back(redos.back());
+    undos.push_back(move(redos.back()));
     redos.pop_back();
 
+    if (journal) {
+      if (undos.back().journalOffset != SIZE_MAX) {
+        journal->end = undos.back().journalEnd;
+      } else {
+        // Switched to from a branch.
+        journalLast();
+      }
+    }
+
     return undos.back();
   }
 
+  uint64_t currentId() const {
+    return undos.empty() ? baseId : undos.back().id;
+  }
+
+  /**
+   * Makes the next branch from the current state the one to redo - the branches there take turns. False when there's
+   * no other branch.
+   */
+  bool switchBranch() {
+    uint64_t at = currentId();
+    auto it = find_if(branches.begin(), branches.end(), [&](auto& branch) { return branch.parentId == at; });
+    if (it == branches.end()) return false;
+
+    takeBranch(it - branches.begin());
+    return true;
+  }
+
+  /**
+   * Makes the unit `id` (a child of the current state) the one to redo.
+   */
+  bool selectRedo(uint64_t id) {
+    if (!redos.empty() && redos.back().id == id) return true;
+
+    uint64_t at = currentId();
+    for (size_t i = 0; i < branches.size(); i++) {
+      if (branches[i].parentId == at && branches[i].units.back().id == id) {
+        takeBranch(i);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /**
+   * Units leading from `baseId` to the state at `time`: after the last unit closed by then, on any branch. Nullopt when
+   * it's unknown.
+   */
+  optional<vector<uint64_t>> pathAt(chrono::system_clock::time_point time) {
+    unordered_map<uint64_t, uint64_t> parents{};
+    uint64_t target{baseId};
+    auto targetTime = chrono::system_clock::time_point::min();
+
+    auto visit = [&](const deque<HistoryUnit>& units) {
+      for (auto& unit : units) {
+        parents[unit.id] = unit.parentId;
+        if (unit.time <= time && unit.time >= targetTime) {
+          target = unit.id;
+          targetTime = unit.time;
+        }
+      }
+    };
+    visit(undos);
+    visit(redos);
+    for (auto& branch : branches) visit(branch.units);
+
+    vector<uint64_t> path{};
+    for (uint64_t id = target; id != baseId; id = parents[id]) {
+      if (!parents.count(id)) return nullopt;
+      path.push_back(id);
+    }
+
+    reverse(path.begin(), path.end());
+    return path;
+  }
+
+  /**
+   * Makes sure the unit to undo next is in memory - when the ones in memory are used up it's read from the journal.
+   * False when there's nothing to undo.
+   */
+  bool prepareUndo() {
+    if (!undos.empty()) return true;
+    if (!journal) return false;
+
+    string payload{};
+    size_t offset;
+    if (!journal->readUnitBefore(journal->end, payload, offset)) return false;
+
+    HistoryUnit unit{};
+    if (!decodeUnit(payload, unit)) {
+      DLOG("Corrupt unit in the undo journal at %lu", offset);
+      return false;
+    }
+
+    // The unit leads to the base state - it becomes the new base.
+    unit.id = baseId;
+    unit.parentId = baseId = nextId++;
+    unit.final = true;
+    unit.journalOffset = offset;
+    unit.journalEnd = offset + HistoryJournal::recordSize(payload.size());
+    unit.bytes = sizeof(HistoryUnit);
+    for (auto& cmd : unit.commands) unit.bytes += commandBytes(cmd);
+    memoryBytes += unit.bytes;
+
+    undos.push_back(move(unit));
+    return true;
+  }
+
+  /**
+   * Attaches the journal of the file, see `HistoryJournal::open`. The history has to be empty.
+   */
+  bool openJournal(const string& dir, const string& filePath, const FileStamp& stamp) {
+    journal = make_unique<HistoryJournal>();
+    if (journal->open(dir, filePath, stamp)) return true;
+
+    DLOG("Cannot open undo journal for %s in %s", filePath.c_str(), dir.c_str());
+    journal.reset();
+    return false;
+  }
+
+  /**
+   * Marks the file saved (as it's at `stamp`) with the current content - the journal is valid for it from now on.
+   */
+  void checkpoint(const FileStamp& stamp) {
+    if (!journal) return;
+
+    if (journal->append(HistoryJournalRecordType::Checkpoint, HistoryJournal::checkpointPayload(stamp)) == SIZE_MAX) {
+      dropJournal();
+      return;
+    }
+
+    // The append cut the records of the undone units.
+    unjournal(redos);
+    for (auto& branch : branches) unjournal(branch.units);
+  }
+
   HistoryUnit& last() {
     if (undos.empty()) reportAndExit("Empty history");
 
     return undos.back();
   }
+
+  void journalLast() {
+    if (!journal || last().commands.empty()) return;
+
+    // A unit grown by coalescing replaces its old record.
+    if (last().journalOffset != SIZE_MAX) journal->end = last().journalOffset;
+
+    last().journalOffset = journal->append(HistoryJournalRecordType::Unit, encodeUnit(last()));
+    last().journalEnd = journal->end;
+    if (last().journalOffset == SIZE_MAX) dropJournal();
+  }
+
+  void dropJournal() {
+    DLOG("Cannot write the undo journal, the history is kept in memory only");
+    journal.reset();
+    unjournal(undos);
+    unjournal(redos);
+  }
+
+  // Their records are cut from the journal on the next append - journaled again when redone.
+  static void unjournal(deque<HistoryUnit>& units) {
+    for (auto& unit : units) unit.journalOffset = SIZE_MAX;
+  }
+
+  // Swaps the branch with the redo list. It goes to the end of the branches, so the branches of a state take turns.
+  void takeBranch(size_t idx) {
+    unjournal(redos);
+    swap(redos, branches[idx].units);
+
+    if (idx + 1 != branches.size()) swap(branches[idx], branches.back());
+    if (branches.back().units.empty()) branches.pop_back();
+  }
+
+  size_t oldestBranch() {
+    size_t out{0};
+    for (size_t i = 1; i < branches.size(); i++) {
+      if (branches[i].units.back().time < branches[out].units.back().time) out = i;
+    }
+    return out;
+  }
+
+  void dropBranch(size_t idx) {
+    vector<uint64_t> ids{};
+    for (auto& unit : branches[idx].units) {
+      ids.push_back(unit.id);
+      memoryBytes -= unit.bytes;
+    }
+
+    if (idx + 1 != branches.size()) swap(branches[idx], branches.back());
+    branches.pop_back();
+
+    // The branches off it are unreachable.
+    for (uint64_t id : ids) dropBranchesAt(id);
+  }
+
+  void dropBranchesAt(uint64_t id) {
+    for (;;) {
+      auto it = find_if(branches.begin(), branches.end(), [&](auto& branch) { return branch.parentId == id; });
+      if (it == branches.end()) return;
+
+      dropBranch(it - branches.begin());
+    }
+  }
+
+  static size_t commandBytes(const Command& cmd) {
+    return sizeof(Command) + cmd.memoryStr.capacity() + (cmd.packedMemory ? cmd.packedMemory->data.size() : 0);
+  }
+
+  /**
+   * Typing run: a single char insert or delete right where the previous unit left the cursor, shortly after it, folds
+   * into the previous unit - its char command becomes a slice command growing with each key. A new word (after a
+   * whitespace) starts a new unit.
+   */
+  void coalesceLast() {
+    if (undos.size() < 2) return;
+
+    HistoryUnit& unit = undos.back();
+    HistoryUnit& prev = undos[undos.size() - 2];
+    if (unit.commands.size() != 1 || prev.commands.size() != 1) return;
+    if (unit.beforeSelectionStart.has_value() || prev.afterSelectionStart.has_value()) return;
+    if (unit.beforeCursor.x != prev.afterCursor.x || unit.beforeCursor.y != prev.afterCursor.y) return;
+    if (unit.closedAt - prev.closedAt >= coalesceIdle) return;
+
+    Command& cmd = unit.commands.front();
+    Command& run = prev.commands.front();
+    if (cmd.row != run.row || run.packedMemory) return;
+    // Not across a checkpoint after the previous unit.
+    if (journal && prev.journalOffset != SIZE_MAX && prev.journalEnd != journal->end) return;
+    // The state after the previous unit is where other branches start.
+    if (any_of(branches.begin(), branches.end(), [&](auto& branch) { return branch.parentId == prev.id; })) return;
+
+    bool isCharRun = run.type == CommandType::InsertChar || run.type == CommandType::DeleteChar;
+    string_view runText = isCharRun ? string_view(&run.memoryChr, 1) : string_view(run.memoryStr);
+
+    bool isInsertRun = run.type == CommandType::InsertChar || run.type == CommandType::InsertSlice;
+    bool isDeleteRun = run.type == CommandType::DeleteChar || run.type == CommandType::DeleteSlice;
+    if (runText.empty() || runText.find('\n') != string::npos) return;
+
+    bool isTyping = cmd.type == CommandType::InsertChar && isInsertRun && cmd.col == run.col + (int)runText.size();
+    bool isBackspace = cmd.type == CommandType::DeleteChar && isDeleteRun && cmd.col + 1 == run.col;
+    bool isDelete = cmd.type == CommandType::DeleteChar && isDeleteRun && cmd.col == run.col;
+    if (!isTyping && !isBackspace && !isDelete) return;
+
+    if (isBackspace ? isWordStart(cmd.memoryChr, runText.front()) : isWordStart(runText.back(), cmd.memoryChr)) return;
+
+    if (isCharRun) run.memoryStr.assign(1, run.memoryChr);
+    run.type = isInsertRun ? CommandType::InsertSlice : CommandType::DeleteSlice;
+
+    if (isBackspace) {
+      run.col = cmd.col;
+      run.memoryStr.insert(0, 1, cmd.memoryChr);
+    } else {
+      run.memoryStr.push_back(cmd.memoryChr);
+    }
+
+    prev.afterSelectionStart = unit.afterSelectionStart;
+    prev.afterSelectionEnd = unit.afterSelectionEnd;
+    prev.afterCursor = unit.afterCursor;
+    prev.closedAt = unit.closedAt;
+    prev.time = unit.time;
+
+    memoryBytes -= prev.bytes + unit.bytes;
+    prev.bytes = sizeof(HistoryUnit) + commandBytes(run);
+    memoryBytes += prev.bytes;
+
+    undos.pop_back();
+  }
+
+  static bool isWordStart(char before, char after) {
+    return isspace(before) && !isspace(after);
+  }
+
+  template <typename T>
+  static void put(string& out, T value) {
+    out.append((const char*)&value, sizeof(T));
+  }
+
+  template <typename T>
+  static bool get(string_view& in, T& value) {
+    if (in.size() < sizeof(T)) return false;
+
+    memcpy(&value, in.data(), sizeof(T));
+    in.remove_prefix(sizeof(T));
+    return true;
+  }
+
+  static void putEdge(string& out, const optional<SelectionEdge>& edge) {
+    put<uint8_t>(out, edge.has_value());
+    put<int32_t>(out, edge ? edge->row : 0);
+    put<int32_t>(out, edge ? edge->col : 0);
+  }
+
+  static bool getEdge(string_view& in, optional<SelectionEdge>& edge) {
+    uint8_t hasEdge;
+    int32_t row, col;
+    if (!get(in, hasEdge) || !get(in, row) || !get(in, col)) return false;
+
+    edge = hasEdge ? optional<SelectionEdge>(SelectionEdge(row, col)) : nullopt;
+    return true;
+  }
+
+  static string encodeUnit(const HistoryUnit& unit) {
+    string out{};
+    put<int32_t>(out, unit.beforeCursor.x);
+    put<int32_t>(out, unit.beforeCursor.y);
+    put<int32_t>(out, unit.afterCursor.x);
+    put<int32_t>(out, unit.afterCursor.y);
+    put<int64_t>(out, chrono::duration_cast<chrono::nanoseconds>(unit.time.time_since_epoch()).count());
+    putEdge(out, unit.beforeSelectionStart);
+    putEdge(out, unit.beforeSelectionEnd);
+    putEdge(out, unit.afterSelectionStart);
+    putEdge(out, unit.afterSelectionEnd);
+
+    put<uint32_t>(out, unit.commands.size());
+    for (auto& cmd : unit.commands) {
+      put<uint8_t>(out, (uint8_t)cmd.type);
+      put<int32_t>(out, cmd.row);
+      put<int32_t>(out, cmd.col);
+      put<char>(out, cmd.memoryChr);
+
+      // Packed payloads are written as they are.
+      put<uint8_t>(out, cmd.packedMemory != nullptr);
+      string_view memory = cmd.packedMemory ? string_view(cmd.packedMemory->data) : string_view(cmd.memoryStr);
+      put<uint64_t>(out, cmd.packedMemory ? cmd.packedMemory->size : memory.size());
+      put<uint64_t>(out, memory.size());
+      out.append(memory);
+    }
+
+    return out;
+  }
+
+  static bool decodeUnit(string_view in, HistoryUnit& unit) {
+    if (!get(in, unit.beforeCursor.x) || !get(in, unit.beforeCursor.y) || !get(in, unit.afterCursor.x) ||
+        !get(in, unit.afterCursor.y)) {
+      return false;
+    }
+    int64_t timeNs;
+    if (!get(in, timeNs)) return false;
+    unit.time = chrono::system_clock::time_point(
+        chrono::duration_cast<chrono::system_clock::duration>(chrono::nanoseconds(timeNs)));
+
+    if (!getEdge(in, unit.beforeSelectionStart) || !getEdge(in, unit.beforeSelectionEnd) ||
+        !getEdge(in, unit.afterSelectionStart) || !getEdge(in, unit.afterSelectionEnd)) {
+      return false;
+    }
+
+    uint32_t commandCount;
+    if (!get(in, commandCount)) return false;
+
+    for (uint32_t i = 0; i < commandCount; i++) {
+      uint8_t type, isPacked;
+      int32_t row, col;
+      char memoryChr;
+      uint64_t size, memorySize;
+      if (!get(in, type) || !get(in, row) || !get(in, col) || !get(in, memoryChr) || !get(in, isPacked) ||
+          !get(in, size) || !get(in, memorySize)) {
+        return false;
+      }
+      if (type > (uint8_t)CommandType::SwapLine || in.size() < memorySize) return false;
+
+      Command cmd{(CommandType)type, row, col, memoryChr};
+      if (isPacked) {
+        // Packed payloads are checked before they are trusted on undo.
+        string unpacked{};
+        if (!Lz::decompress(in.substr(0, memorySize), size, unpacked)) return false;
+        cmd.packedMemory = make_shared<const PackedString>(string(in.substr(0, memorySize)), size);
+      } else {
+        cmd.memoryStr.assign(in.substr(0, memorySize));
+      }
+      in.remove_prefix(memorySize);
+
+      unit.commands.push_back(move(cmd));
+    }
+
+    return in.empty();
+  }
+
+  /**
+   * Restores the payload of a packed command for replaying it - drop it with `repack` after.
+   */
+  static void unpack(Command& cmd) {
+    if (cmd.packedMemory) cmd.memoryStr = cmd.packedMemory->unpack();
+  }
+
+  static void repack(Command& cmd) {
+    if (cmd.packedMemory) cmd.memoryStr = string{};
+  }
 };
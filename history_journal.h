@@ -0,0 +1,246 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+#include "debug.h"
+#include "file_reader.h"
+
+// Record: payload length (u32), type (u8), payload, payload length again (u32) - so it can be walked backwards.
+#define HISTORY_JOURNAL_RECORD_OVERHEAD 9
+#define HISTORY_JOURNAL_HASH_SEED 14695981039346656037ull
+
+using namespace std;
+
+uint64_t fnv1a(string_view data, uint64_t hash = HISTORY_JOURNAL_HASH_SEED) {
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+/**
+ * $XDG_CACHE_HOME/pedit/`name` (or ~/.cache/pedit/`name`), empty when neither is set.
+ */
+string defaultCacheDir(const string &name) {
+  if (const char *cacheHome = getenv("XDG_CACHE_HOME"); cacheHome && *cacheHome) {
+    return string(cacheHome) + "/pedit/" + name;
+  }
+  if (const char *home = getenv("HOME"); home && *home) return string(home) + "/.cache/pedit/" + name;
+
+  return "";
+}
+
+string defaultUndoJournalDir() {
+  return defaultCacheDir("undo");
+}
+
+enum class HistoryJournalRecordType : uint8_t {
+  // The path of the file, first in the journal.
+  Header,
+  // A closed history unit.
+  Unit,
+  // The stamp of the file when it was saved.
+  Checkpoint,
+};
+
+/**
+ * Append only log of the history units of a file, kept across sessions. It's a stack: the units before `end` are the
+ * undo history of the file as it's at `end`. Undone units stay in the file after `end` (for redo) until the next
+ * append cuts them.
+ */
+struct HistoryJournal {
+  int fd{-1};
+  size_t end{0};
+  size_t fileSize{0};
+  size_t headerEnd{0};
+
+  HistoryJournal() {
+  }
+  HistoryJournal(HistoryJournal &) = delete;
+  HistoryJournal &operator=(HistoryJournal &) = delete;
+
+  ~HistoryJournal() {
+    if (fd != -1) close(fd);
+  }
+
+  static string canonicalPath(const string &filePath) {
+    error_code ec{};
+    string out = filesystem::weakly_canonical(filePath, ec);
+    return ec ? filePath : out;
+  }
+
+  // Named by the hash of the canonical path of the file.
+  static string pathFor(const string &dir, const string &filePath) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016lx.journal", fnv1a(canonicalPath(filePath)));
+    return dir + "/" + name;
+  }
+
+  /**
+   * Opens (or creates) the journal of `filePath` in `dir`. It's kept up to its last checkpoint matching the file as it
+   * is now (`stamp`). A journal without such checkpoint (the file was changed elsewhere or never saved) or of another
+   * file is emptied. Fails when another view (or editor) has the file open with its journal.
+   */
+  bool open(const string &dir, const string &filePath, const FileStamp &stamp) {
+    error_code ec{};
+    filesystem::create_directories(dir, ec);
+
+    fd = ::open(pathFor(dir, filePath).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) return false;
+    // One writer per journal, released with the fd.
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+      close(fd);
+      fd = -1;
+      return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) return false;
+    fileSize = st.st_size;
+
+    string path = canonicalPath(filePath);
+    end = validEnd(path, checkpointPayload(stamp));
+    if (end == 0) {
+      fileSize = 0;
+      if (ftruncate(fd, 0) == -1 || append(HistoryJournalRecordType::Header, path) == SIZE_MAX) return false;
+    } else if (end < fileSize && ftruncate(fd, end) == 0) {
+      // The units after the checkpoint were never saved.
+      fileSize = end;
+    }
+
+    headerEnd = recordSize(path.size());
+    return true;
+  }
+
+  /**
+   * Appends a record at `end` (cutting what's after it). Returns its offset, SIZE_MAX on failure.
+   */
+  size_t append(HistoryJournalRecordType type, string_view payload) {
+    if (payload.size() > UINT32_MAX) return SIZE_MAX;
+    if (fileSize > end) {
+      if (ftruncate(fd, end) == -1) return SIZE_MAX;
+      fileSize = end;
+    }
+
+    uint32_t length = payload.size();
+    string record{};
+    record.reserve(recordSize(payload.size()));
+    record.append((const char *)&length, sizeof(length));
+    record.push_back((char)type);
+    record.append(payload);
+    record.append((const char *)&length, sizeof(length));
+
+    if (!writeAt(record, end)) return SIZE_MAX;
+
+    size_t offset = end;
+    end += record.size();
+    fileSize = end;
+    return offset;
+  }
+
+  /**
+   * The last unit record ending at or before `at`, checkpoints are skipped. False at the start of the journal.
+   */
+  bool readUnitBefore(size_t at, string &payload, size_t &offset) {
+    while (at > headerEnd) {
+      uint32_t length;
+      if (!readAt(&length, sizeof(length), at - sizeof(length))) return false;
+      if (recordSize(length) > at - headerEnd) return false;
+
+      offset = at - recordSize(length);
+      uint8_t type;
+      if (!readAt(&type, sizeof(type), offset + sizeof(length))) return false;
+
+      if (type == (uint8_t)HistoryJournalRecordType::Unit) {
+        payload.resize(length);
+        return readAt(payload.data(), length, offset + sizeof(length) + sizeof(type));
+      }
+
+      at = offset;
+    }
+
+    return false;
+  }
+
+  static size_t recordSize(size_t payloadSize) {
+    return payloadSize + HISTORY_JOURNAL_RECORD_OVERHEAD;
+  }
+
+  // The stamp identifies the saved file - cheap unlike hashing the content of a huge one.
+  static string checkpointPayload(const FileStamp &stamp) {
+    string out{};
+    for (uint64_t field : {(uint64_t)stamp.device, (uint64_t)stamp.inode, (uint64_t)stamp.size,
+                           (uint64_t)stamp.modifiedNs}) {
+      out.append((const char *)&field, sizeof(field));
+    }
+    return out;
+  }
+
+ private:
+  /**
+   * End of the last checkpoint matching the file, 0 when there's none (or the journal is of another file).
+   */
+  size_t validEnd(const string &filePath, const string &checkpoint) {
+    size_t out{0};
+
+    size_t offset{0};
+    while (offset + HISTORY_JOURNAL_RECORD_OVERHEAD <= fileSize) {
+      uint32_t length;
+      uint8_t type;
+      if (!readAt(&length, sizeof(length), offset) || !readAt(&type, sizeof(type), offset + sizeof(length))) break;
+      // Cut short by a crash.
+      if (offset + recordSize(length) > fileSize) break;
+
+      size_t payloadOffset = offset + sizeof(length) + sizeof(type);
+      if (offset == 0) {
+        string path(length, '\0');
+        if (type != (uint8_t)HistoryJournalRecordType::Header || !readAt(path.data(), length, payloadOffset) ||
+            path != filePath) {
+          DLOG("Undo journal is not of %s", filePath.c_str());
+          return 0;
+        }
+      } else if (type == (uint8_t)HistoryJournalRecordType::Checkpoint && length == checkpoint.size()) {
+        string payload(length, '\0');
+        if (!readAt(payload.data(), length, payloadOffset)) break;
+
+        if (payload == checkpoint) out = offset + recordSize(length);
+      }
+
+      offset += recordSize(length);
+    }
+
+    return out;
+  }
+
+  bool readAt(void *out, size_t length, size_t offset) {
+    return pread(fd, out, length, offset) == (ssize_t)length;
+  }
+
+  bool writeAt(string_view data, size_t offset) {
+    while (!data.empty()) {
+      ssize_t written = pwrite(fd, data.data(), data.size(), offset);
+      if (written == -1) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+
+      data.remove_prefix(written);
+      offset += written;
+    }
+
+    return true;
+  }
+};
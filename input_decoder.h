@@ -0,0 +1,241 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <deque>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "debug.h"
+#include "terminal_util.h"
+#include "utility.h"
+
+#define INPUT_DECODER_READ_CHUNK 4096
+#define ESCAPE_TRIE_ALPHABET 128
+#define BRACKETED_PASTE_END "\x1b[201~"
+
+using namespace std;
+
+struct EscapeTrieNode {
+  int children[ESCAPE_TRIE_ALPHABET];
+  optional<EscapeChar> escapeChar{nullopt};
+
+  EscapeTrieNode() {
+    fill(begin(children), end(children), -1);
+  }
+};
+
+/**
+ * Prefix tree of the escape sequences (without the leading ESC).
+ */
+struct EscapeTrie {
+  vector<EscapeTrieNode> nodes{1};
+
+  EscapeTrie(vector<pair<string, EscapeChar>> &sequences) {
+    for (auto &[sequence, escapeChar] : sequences) insert(sequence, escapeChar);
+  }
+
+  void insert(const string &sequence, EscapeChar escapeChar) {
+    int nodeIdx{0};
+
+    for (char c : sequence) {
+      int &childIdx = nodes[nodeIdx].children[(u_int8_t)c];
+
+      if (childIdx == -1) {
+        childIdx = nodes.size();
+        // Must not keep references into `nodes` over a push.
+        nodes.emplace_back();
+      }
+
+      nodeIdx = nodes[nodeIdx].children[(u_int8_t)c];
+    }
+
+    nodes[nodeIdx].escapeChar = escapeChar;
+  }
+
+  /**
+   * Returns the child node index or -1.
+   */
+  inline int step(int nodeIdx, char c) const {
+    if ((u_int8_t)c >= ESCAPE_TRIE_ALPHABET) return -1;
+    return nodes[nodeIdx].children[(u_int8_t)c];
+  }
+};
+
+/**
+ * Reads stdin in large chunks and turns the bytes into a queue of typed chars.
+ */
+struct InputDecoder {
+  EscapeTrie escapeTrie{escapeCharMap};
+  deque<TypedChar> typedChars{};
+  // Undecoded tail - an escape sequence cut in half by a read.
+  string pending{};
+  // Payloads of the EscapeChar::BracketedPaste typed chars, in order.
+  deque<string> pastes{};
+  bool isInPaste{false};
+  bool isPasteAfterCarriageReturn{false};
+
+  /**
+   * Reads everything currently available on stdin and decodes it.
+   */
+  void readAvailable() {
+    readChunks();
+    decode(false);
+
+    // Follow up bytes of a cut escape sequence arrive within the terminal read timeout. The rest of a paste comes with
+    // the next wakeup - waiting for it would stall at every chunk of a large paste.
+    if (!pending.empty() && !isInPaste) {
+      readChunks();
+      decode(true);
+    }
+  }
+
+  /**
+   * Decodes raw input. With `isFinal` an incomplete trailing escape sequence is
+   * resolved instead of waiting for more bytes.
+   */
+  void feed(const string &bytes, bool isFinal = true) {
+    pending.append(bytes);
+    decode(isFinal);
+  }
+
+  inline bool hasTypedChars() const {
+    return !typedChars.empty();
+  }
+
+  TypedChar nextTypedChar() {
+    TypedChar tc = typedChars.front();
+    typedChars.pop_front();
+    return tc;
+  }
+
+  /**
+   * Must be called once for each EscapeChar::BracketedPaste typed char.
+   */
+  string nextPaste() {
+    string paste = move(pastes.front());
+    pastes.pop_front();
+    return paste;
+  }
+
+ private:
+  void readChunks() {
+    char buf[INPUT_DECODER_READ_CHUNK];
+
+    for (;;) {
+      ssize_t result = read(STDIN_FILENO, buf, sizeof(buf));
+
+      if (result == -1) {
+        if (errno != EAGAIN && errno != EINTR) reportAndExit("Failed reading input");
+        return;
+      }
+
+      pending.append(buf, result);
+
+      if (result < (ssize_t)sizeof(buf)) return;
+    }
+  }
+
+  void decode(bool isFinal) {
+    size_t i{0};
+
+    while (i < pending.size()) {
+      if (isInPaste) {
+        i = collectPaste(i);
+        // Rest of the paste is not read yet.
+        if (isInPaste) break;
+
+        continue;
+      }
+
+      if (pending[i] != '\x1b') {
+        typedChars.emplace_back(pending[i++]);
+        continue;
+      }
+
+      int nodeIdx{0};
+      size_t j = i + 1;
+
+      for (; j < pending.size(); j++) {
+        nodeIdx = escapeTrie.step(nodeIdx, pending[j]);
+        if (nodeIdx == -1 || escapeTrie.nodes[nodeIdx].escapeChar.has_value()) break;
+      }
+
+      if (j >= pending.size()) {
+        // Sequence is cut - wait for the rest unless this is all we get.
+        if (!isFinal) break;
+
+        if (j == i + 1) {
+          typedChars.emplace_back('\x1b');
+        } else {
+          DLOG("Incomplete key combo. Prefix %s", pending.substr(i + 1, j - i - 1).c_str());
+        }
+      } else if (nodeIdx == -1) {
+        DLOG("Failed detecting key combo. Prefix %s", pending.substr(i + 1, j - i).c_str());
+      } else {
+        EscapeChar escapeChar = escapeTrie.nodes[nodeIdx].escapeChar.value();
+
+        if (escapeChar == EscapeChar::BracketedPaste) {
+          // Typed char is emitted when the paste ends.
+          isInPaste = true;
+          pastes.emplace_back();
+        } else {
+          typedChars.emplace_back(escapeChar);
+        }
+      }
+
+      i = min(j + 1, pending.size());
+    }
+
+    pending.erase(0, i);
+  }
+
+  /**
+   * Moves paste payload from `pending` to the current paste until the end
+   * marker. Returns the position after the consumed bytes.
+   */
+  size_t collectPaste(size_t i) {
+    static const string pasteEnd{BRACKETED_PASTE_END};
+
+    size_t endPos = pending.find(pasteEnd, i);
+    size_t payloadEnd = endPos;
+
+    // The end marker itself might be cut by the read - only a tail starting it is kept.
+    if (endPos == string::npos) payloadEnd = pending.size() - pasteEndPrefixLength(i);
+
+    string &paste = pastes.back();
+    paste.reserve(paste.size() + payloadEnd - i);
+
+    // Terminals send line breaks as carriage returns.
+    for (size_t k = i; k < payloadEnd; k++) {
+      if (pending[k] == '\r') {
+        paste.push_back('\n');
+      } else if (pending[k] != '\n' || !isPasteAfterCarriageReturn) {
+        paste.push_back(pending[k]);
+      }
+
+      isPasteAfterCarriageReturn = pending[k] == '\r';
+    }
+
+    if (endPos == string::npos) return payloadEnd;
+
+    isInPaste = false;
+    isPasteAfterCarriageReturn = false;
+    typedChars.emplace_back(EscapeChar::BracketedPaste);
+
+    return endPos + pasteEnd.size();
+  }
+
+  // Length of the longest tail of `pending` (from `i` on) the paste end marker starts with.
+  size_t pasteEndPrefixLength(size_t i) const {
+    static const string pasteEnd{BRACKETED_PASTE_END};
+
+    for (size_t length = min(pasteEnd.size() - 1, pending.size() - i); length > 0; length--) {
+      if (pending.compare(pending.size() - length, length, pasteEnd, 0, length) == 0) return length;
+    }
+    return 0;
+  }
+};
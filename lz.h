@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+// A byte of compressed data stands for at most this many bytes (a match length byte).
+#define LZ_MAX_RATIO 256
+
+/**
+ * Small LZ77 compressor (LZ4 like sequences) for text kept around in memory - fast and good on repetitive text, not
+ * made for ratio.
+ *
+ * A sequence is a token (literal count and match length - LZ_MIN_MATCH, 4 bits each, 15 extended by 255 valued bytes),
+ * the literals, then a 2 byte little endian match offset. The last sequence has literals only.
+ */
+namespace Lz {
+
+void putLength(string &out, size_t length) {
+  for (; length >= 255; length -= 255) out.push_back((char)255);
+  out.push_back((char)length);
+}
+
+size_t getLength(string_view in, size_t &pos) {
+  size_t length{0};
+  for (uint8_t byte = 255; byte == 255 && pos < in.size(); length += byte) byte = in[pos++];
+  return length;
+}
+
+void putSequence(string &out, string_view literals, size_t offset, size_t matchLength) {
+  size_t matchCode = matchLength == 0 ? 0 : matchLength - LZ_MIN_MATCH;
+  out.push_back((char)((min(literals.size(), (size_t)15) << 4) | min(matchCode, (size_t)15)));
+  if (literals.size() >= 15) putLength(out, literals.size() - 15);
+  out.append(literals);
+
+  if (matchLength == 0) return;
+
+  out.push_back((char)(offset & 0xff));
+  out.push_back((char)(offset >> 8));
+  if (matchCode >= 15) putLength(out, matchCode - 15);
+}
+
+string compress(string_view in) {
+  string out{};
+  // Last position of each hashed 4 byte prefix.
+  vector<size_t> lastPos(1 << LZ_HASH_BITS, SIZE_MAX);
+
+  size_t anchor{0};
+  size_t pos{0};
+  while (pos + LZ_MIN_MATCH <= in.size()) {
+    uint32_t prefix;
+    memcpy(&prefix, in.data() + pos, sizeof(prefix));
+    uint32_t hash = (prefix * 2654435761u) >> (32 - LZ_HASH_BITS);
+
+    size_t candidate = lastPos[hash];
+    lastPos[hash] = pos;
+
+    if (candidate == SIZE_MAX || pos - candidate > LZ_MAX_OFFSET ||
+        memcmp(in.data() + candidate, in.data() + pos, LZ_MIN_MATCH) != 0) {
+      pos++;
+      continue;
+    }
+
+    size_t matchLength = LZ_MIN_MATCH;
+    while (pos + matchLength < in.size() && in[candidate + matchLength] == in[pos + matchLength]) matchLength++;
+
+    putSequence(out, in.substr(anchor, pos - anchor), pos - candidate, matchLength);
+    pos += matchLength;
+    anchor = pos;
+  }
+
+  putSequence(out, in.substr(anchor), 0, 0);
+  return out;
+}
+
+/**
+ * `size` is the size of the original text. False when `in` is not a valid compressed text of that size - it might come
+ * from disk.
+ */
+bool decompress(string_view in, size_t size, string &out) {
+  out.clear();
+  if (size / LZ_MAX_RATIO > in.size() + 1) return false;
+  out.reserve(size);
+
+  size_t pos{0};
+  while (pos < in.size()) {
+    uint8_t token = in[pos++];
+
+    size_t literalLength = token >> 4;
+    if (literalLength == 15) literalLength += getLength(in, pos);
+    if (literalLength > in.size() - pos || literalLength > size - out.size()) return false;
+    out.append(in.substr(pos, literalLength));
+    pos += literalLength;
+
+    if (pos == in.size()) break;
+    if (pos + 2 > in.size()) return false;
+
+    size_t offset = (uint8_t)in[pos] | ((uint8_t)in[pos + 1] << 8);
+    pos += 2;
+    if (offset == 0 || offset > out.size()) return false;
+
+    size_t matchLength = token & 15;
+    if (matchLength == 15) matchLength += getLength(in, pos);
+    matchLength += LZ_MIN_MATCH;
+    if (matchLength > size - out.size()) return false;
+
+    // The match might overlap the bytes it produces (runs) - copied byte by byte.
+    size_t from = out.size() - offset;
+    for (size_t i = 0; i < matchLength; i++) out.push_back(out[from + i]);
+  }
+
+  return out.size() == size;
+}
+
+}  // namespace Lz
+
+/**
+ * Compressed text, see `Lz`.
+ */
+struct PackedString {
+  string data{};
+  size_t size{0};
+
+  PackedString(string_view text) : data(Lz::compress(text)), size(text.size()) {
+  }
+  // From already compressed data.
+  PackedString(string &&data, size_t size) : data(std::move(data)), size(size) {
+  }
+
+  // Only for data known to be valid (compressed here or checked with `Lz::decompress`).
+  string unpack() const {
+    string out{};
+    Lz::decompress(data, size, out);
+    return out;
+  }
+};
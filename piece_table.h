@@ -0,0 +1,443 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Text as a sequence of pieces over two buffers: the original (read only, usually a mapped file - not owned) and an
+ * append only add buffer holding every inserted text. Edits only cut pieces and append to the add buffer, the original
+ * bytes are never copied.
+ *
+ * The pieces live in a treap keyed by their byte length, every node keeping the byte and line break count of its
+ * subtree, so both byte and line lookups are O(log pieces). Line breaks inside a piece are found via the line break
+ * index of its buffer, a piece doesn't store its own.
+ *
+ * Lines are separated by '\n', the last line has no break.
+ */
+struct PieceTable {
+  struct Piece {
+    bool added{false};
+    size_t start{0};
+    size_t length{0};
+  };
+
+  struct Node {
+    Piece piece{};
+    uint32_t priority{0};
+    Node *left{nullptr};
+    Node *right{nullptr};
+
+    size_t lineBreakCount{0};
+    // Subtree aggregates.
+    size_t bytes{0};
+    size_t lineBreaks{0};
+  };
+
+  const char *original{nullptr};
+  vector<size_t> originalLineBreaks{};
+
+  string add{};
+  vector<size_t> addLineBreaks{};
+
+  Node *root{nullptr};
+  size_t pieceCount{0};
+  uint32_t rngState{0x9e3779b9};
+
+  PieceTable() {
+  }
+  PieceTable(PieceTable &) = delete;
+  PieceTable &operator=(PieceTable &) = delete;
+
+  ~PieceTable() {
+    destroy(root);
+  }
+
+  /**
+   * The original text is data[0 .. size), lineBreaks are the offsets of all '\n'-s in it.
+   */
+  void reset(const char *data, size_t size, vector<size_t> &&lineBreaks) {
+    destroy(root);
+    root = nullptr;
+    pieceCount = 0;
+
+    original = data;
+    originalLineBreaks = std::move(lineBreaks);
+    add.clear();
+    addLineBreaks.clear();
+
+    if (size > 0) root = makeNode(Piece{false, 0, size});
+  }
+
+  size_t size() const {
+    return root ? root->bytes : 0;
+  }
+
+  size_t lineCount() const {
+    return (root ? root->lineBreaks : 0) + 1;
+  }
+
+  /**
+   * Byte offset of the first char of the line.
+   */
+  size_t lineStart(size_t row) const {
+    return row == 0 ? 0 : lineBreakOffset(row - 1) + 1;
+  }
+
+  /**
+   * Byte offset of the end of the line (its line break or the end of the text).
+   */
+  size_t lineEnd(size_t row) const {
+    return row + 1 >= lineCount() ? size() : lineBreakOffset(row);
+  }
+
+  /**
+   * Calls fn with the consecutive chunks of [from, to).
+   */
+  void forEachChunk(size_t from, size_t to, const function<void(string_view)> &fn) const {
+    forEachChunk(root, from, to, fn);
+  }
+
+  /**
+   * The text in [from, to). Points into the buffers when it's inside a single piece, otherwise it's copied to `out`.
+   * Valid until the next edit.
+   */
+  string_view slice(size_t from, size_t to, string &out) const {
+    size_t chunkCount{0};
+    string_view first{};
+    forEachChunk(from, to, [&](string_view chunk) {
+      if (chunkCount++ == 0) {
+        first = chunk;
+      } else {
+        if (chunkCount == 2) out.assign(first);
+        out.append(chunk);
+      }
+    });
+
+    if (chunkCount < 2) return first;
+    return out;
+  }
+
+  void insert(size_t at, string_view text) {
+    if (text.empty()) return;
+    assert(at <= size());
+
+    size_t addStart = add.size();
+    add.append(text);
+    for (size_t pos = text.find('\n'); pos != string_view::npos; pos = text.find('\n', pos + 1)) {
+      addLineBreaks.push_back(addStart + pos);
+    }
+
+    auto [left, right] = split(root, at);
+
+    // Typing appends to the add buffer right after the previous insert - that piece only grows.
+    if (!extendRightmost(left, addStart, text.size())) left = merge(left, makeNode(Piece{true, addStart, text.size()}));
+
+    root = merge(left, right);
+  }
+
+  void remove(size_t from, size_t len) {
+    if (len == 0) return;
+    assert(from + len <= size());
+
+    auto [left, rest] = split(root, from);
+    auto [removed, right] = split(rest, len);
+    destroy(removed);
+
+    root = merge(left, right);
+  }
+
+  /**
+   * Bytes from the start that are the original at its own offsets.
+   */
+  size_t originalPrefixBytes() const {
+    size_t prefix{0};
+    forEachPiece(root, 0, 0, [&](size_t at, const Piece &piece) {
+      if (piece.added || piece.start != at) return false;
+
+      prefix = at + piece.length;
+      return true;
+    });
+    return prefix;
+  }
+
+  /**
+   * Bytes of the text from `from` on that are read from the original past `from`.
+   */
+  size_t originalBytesAfter(size_t from) const {
+    size_t bytes{0};
+    forEachOriginalAfter(from, [&](size_t at, const Piece &piece) { bytes += piece.length; });
+    return bytes;
+  }
+
+  /**
+   * Copies the text from `from` on that is read from the original past `from` to the add buffer - the original can be
+   * rewritten from `from` on then.
+   */
+  void copyOriginalAfter(size_t from) {
+    vector<pair<size_t, Piece>> pieces{};
+    forEachOriginalAfter(from, [&](size_t at, const Piece &piece) { pieces.push_back({at, piece}); });
+
+    for (auto &[at, piece] : pieces) {
+      string bytes(original + piece.start, piece.length);
+      remove(at, piece.length);
+      insert(at, bytes);
+    }
+  }
+
+  /**
+   * The original (of `originalSize`) was rewritten with the text from `from` on, in place: the text up to the end of
+   * the original becomes a single piece of it again. The text before `from` has to be the original's, the rest can't
+   * read the original past `from` (see `copyOriginalAfter`).
+   */
+  void rebaseOnOriginal(size_t from, size_t originalSize) {
+    assert(from <= originalPrefixBytes() && originalBytesAfter(from) == 0);
+    size_t to = max(from, min(size(), originalSize));
+
+    auto [left, rest] = split(root, from);
+    auto [rewritten, right] = split(rest, to - from);
+    destroy(rewritten);
+
+    originalLineBreaks.erase(lower_bound(originalLineBreaks.begin(), originalLineBreaks.end(), from),
+                             originalLineBreaks.end());
+    for (const char *at = original + from; (at = (const char *)memchr(at, '\n', original + to - at)); at++) {
+      originalLineBreaks.push_back(at - original);
+    }
+
+    if (to > from) left = merge(left, makeNode(Piece{false, from, to - from}));
+    root = merge(left, right);
+  }
+
+  bool integrityCheck() const {
+    return integrityCheck(root);
+  }
+
+ private:
+  const char *sourceData(const Piece &piece) const {
+    return piece.added ? add.data() : original;
+  }
+
+  const vector<size_t> &sourceLineBreaks(const Piece &piece) const {
+    return piece.added ? addLineBreaks : originalLineBreaks;
+  }
+
+  // Index of the first line break of the source at or after the piece start.
+  size_t firstLineBreakIdx(const Piece &piece) const {
+    auto &breaks = sourceLineBreaks(piece);
+    return lower_bound(breaks.begin(), breaks.end(), piece.start) - breaks.begin();
+  }
+
+  size_t countLineBreaks(const Piece &piece) const {
+    auto &breaks = sourceLineBreaks(piece);
+    return lower_bound(breaks.begin(), breaks.end(), piece.start + piece.length) - breaks.begin() -
+           firstLineBreakIdx(piece);
+  }
+
+  uint32_t nextPriority() {
+    // Xorshift.
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+  }
+
+  Node *makeNode(Piece piece) {
+    Node *node = new Node{piece, nextPriority()};
+    node->lineBreakCount = countLineBreaks(piece);
+    update(node);
+    pieceCount++;
+    return node;
+  }
+
+  void destroy(Node *node) {
+    if (!node) return;
+
+    destroy(node->left);
+    destroy(node->right);
+    delete node;
+    pieceCount--;
+  }
+
+  static size_t bytesOf(Node *node) {
+    return node ? node->bytes : 0;
+  }
+
+  static size_t lineBreaksOf(Node *node) {
+    return node ? node->lineBreaks : 0;
+  }
+
+  static void update(Node *node) {
+    node->bytes = bytesOf(node->left) + node->piece.length + bytesOf(node->right);
+    node->lineBreaks = lineBreaksOf(node->left) + node->lineBreakCount + lineBreaksOf(node->right);
+  }
+
+  /**
+   * Splits into the first `at` bytes and the rest, cutting a piece if needed.
+   */
+  pair<Node *, Node *> split(Node *node, size_t at) {
+    Node *tail = cut(node, at);
+    auto [left, right] = splitAtPieceEdge(node, at);
+    return {left, merge(tail, right)};
+  }
+
+  /**
+   * Shortens the piece spanning over `at` to end there and returns the rest as a new node, not yet in the tree.
+   */
+  Node *cut(Node *node, size_t at) {
+    if (!node) return nullptr;
+
+    Node *tail{nullptr};
+    size_t leftBytes = bytesOf(node->left);
+    size_t pieceEnd = leftBytes + node->piece.length;
+    if (at < leftBytes) {
+      tail = cut(node->left, at);
+    } else if (at > pieceEnd) {
+      tail = cut(node->right, at - pieceEnd);
+    } else if (at > leftBytes && at < pieceEnd) {
+      size_t headLength = at - leftBytes;
+      Piece &piece = node->piece;
+      tail = makeNode(Piece{piece.added, piece.start + headLength, piece.length - headLength});
+
+      piece.length = headLength;
+      node->lineBreakCount -= tail->lineBreakCount;
+    }
+
+    if (tail) update(node);
+    return tail;
+  }
+
+  pair<Node *, Node *> splitAtPieceEdge(Node *node, size_t at) {
+    if (!node) return {nullptr, nullptr};
+
+    size_t leftBytes = bytesOf(node->left);
+    if (at <= leftBytes) {
+      auto [left, right] = splitAtPieceEdge(node->left, at);
+      node->left = right;
+      update(node);
+      return {left, node};
+    } else {
+      auto [left, right] = splitAtPieceEdge(node->right, at - leftBytes - node->piece.length);
+      node->right = left;
+      update(node);
+      return {node, right};
+    }
+  }
+
+  Node *merge(Node *left, Node *right) {
+    if (!left) return right;
+    if (!right) return left;
+
+    if (left->priority > right->priority) {
+      left->right = merge(left->right, right);
+      update(left);
+      return left;
+    } else {
+      right->left = merge(left, right->left);
+      update(right);
+      return right;
+    }
+  }
+
+  bool extendRightmost(Node *node, size_t addStart, size_t length) {
+    if (!node) return false;
+
+    if (node->right) {
+      if (!extendRightmost(node->right, addStart, length)) return false;
+    } else {
+      Piece &piece = node->piece;
+      if (!piece.added || piece.start + piece.length != addStart) return false;
+
+      piece.length += length;
+      node->lineBreakCount = countLineBreaks(piece);
+    }
+
+    update(node);
+    return true;
+  }
+
+  /**
+   * Byte offset of the nth (0 based) line break.
+   */
+  size_t lineBreakOffset(size_t nth) const {
+    assert(nth < lineBreaksOf(root));
+
+    size_t offset{0};
+    Node *node = root;
+    for (;;) {
+      size_t leftBreaks = lineBreaksOf(node->left);
+      if (nth < leftBreaks) {
+        node = node->left;
+      } else if (nth < leftBreaks + node->lineBreakCount) {
+        const Piece &piece = node->piece;
+        size_t idx = firstLineBreakIdx(piece) + nth - leftBreaks;
+        return offset + bytesOf(node->left) + sourceLineBreaks(piece)[idx] - piece.start;
+      } else {
+        nth -= leftBreaks + node->lineBreakCount;
+        offset += bytesOf(node->left) + node->piece.length;
+        node = node->right;
+      }
+    }
+  }
+
+  void forEachChunk(Node *node, size_t from, size_t to, const function<void(string_view)> &fn) const {
+    if (!node || from >= to) return;
+
+    size_t leftBytes = bytesOf(node->left);
+    if (from < leftBytes) forEachChunk(node->left, from, min(to, leftBytes), fn);
+
+    size_t pieceEnd = leftBytes + node->piece.length;
+    if (from < pieceEnd && to > leftBytes) {
+      size_t chunkFrom = max(from, leftBytes) - leftBytes;
+      size_t chunkTo = min(to, pieceEnd) - leftBytes;
+      fn(string_view(sourceData(node->piece) + node->piece.start + chunkFrom, chunkTo - chunkFrom));
+    }
+
+    if (to > pieceEnd) forEachChunk(node->right, max(from, pieceEnd) - pieceEnd, to - pieceEnd, fn);
+  }
+
+  /**
+   * Calls fn with the parts of the pieces from `from` on that read the original past `from`, and their offset.
+   */
+  void forEachOriginalAfter(size_t from, const function<void(size_t, const Piece &)> &fn) const {
+    forEachPiece(root, 0, from, [&](size_t at, const Piece &piece) {
+      size_t skipped = at < from ? from - at : 0;
+      if (!piece.added && piece.start + piece.length > from) {
+        fn(at + skipped, Piece{false, piece.start + skipped, piece.length - skipped});
+      }
+      return true;
+    });
+  }
+
+  /**
+   * Calls fn with the pieces ending after `from` and their offset, in order, until it returns false.
+   */
+  bool forEachPiece(Node *node, size_t offset, size_t from, const function<bool(size_t, const Piece &)> &fn) const {
+    if (!node) return true;
+
+    size_t at = offset + bytesOf(node->left);
+    if (from < at && !forEachPiece(node->left, offset, from, fn)) return false;
+    if (from < at + node->piece.length && !fn(at, node->piece)) return false;
+    return forEachPiece(node->right, at + node->piece.length, from, fn);
+  }
+
+  bool integrityCheck(Node *node) const {
+    if (!node) return true;
+
+    if (node->piece.length == 0) return false;
+    if (node->lineBreakCount != countLineBreaks(node->piece)) return false;
+    if (node->left && node->left->priority > node->priority) return false;
+    if (node->right && node->right->priority > node->priority) return false;
+    if (node->bytes != bytesOf(node->left) + node->piece.length + bytesOf(node->right)) return false;
+    if (node->lineBreaks != lineBreaksOf(node->left) + node->lineBreakCount + lineBreaksOf(node->right)) return false;
+
+    return integrityCheck(node->left) && integrityCheck(node->right);
+  }
+};
@@ -13,6 +13,7 @@ enum class PromptCommand {
   OpenFile,
   MultiPurpose,
   FileHasBeenModified,
+  RecoverEdits,
 };
 
 struct Prompt {
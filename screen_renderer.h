@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "terminal_util.h"
+#include "utility.h"
+
+using namespace std;
+
+/**
+ * Double buffered screen. Rows of the next frame are compared to the last
+ * written frame and only the changed rows (and cursor moves) are emitted.
+ */
+struct ScreenRenderer {
+  vector<string> lastFrame{};
+  vector<string> nextFrame{};
+  Point lastCursor{};
+
+  void beginFrame(int rows) {
+    nextFrame.resize(rows);
+    for (auto& row : nextFrame) row.clear();
+  }
+
+  inline string& row(int idx) {
+    return nextFrame[idx];
+  }
+
+  /**
+   * Forces a full repaint on the next flush (eg after terminal resize).
+   */
+  void invalidate() {
+    lastFrame.clear();
+    lastCursor = Point{};
+  }
+
+  /**
+   * Appends the necessary output to `out` to turn the last frame into the next
+   * one with the cursor at `cursor`. Does not append anything when nothing has
+   * changed.
+   */
+  void flush(string& out, Point cursor) {
+    bool hasDamage{false};
+
+    for (int i = 0; i < (int)nextFrame.size(); i++) {
+      if (i < (int)lastFrame.size() && lastFrame[i] == nextFrame[i]) continue;
+
+      if (!hasDamage) hideCursor(out);
+      hasDamage = true;
+
+      setCursorLocation(out, i, 0);
+      out.append(nextFrame[i]);
+    }
+
+    if (hasDamage || cursor.x != lastCursor.x || cursor.y != lastCursor.y) {
+      setCursorLocation(out, cursor.y, cursor.x);
+    }
+    if (hasDamage) showCursor(out);
+
+    swap(lastFrame, nextFrame);
+    lastCursor = cursor;
+  }
+};
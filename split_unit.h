@@ -30,6 +30,8 @@ struct SplitUnit {
   }
 
   void closeTextView() {
+    activeTextView()->fileWatcher.unwatch();
+
     auto viewIt = textViews.begin();
     advance(viewIt, activeTextViewIdx);
     textViews.erase(viewIt);
@@ -56,6 +56,7 @@ vector<pair<string, EscapeChar>> escapeCharMap{
     {"=", EscapeChar::AltEqual},
     {"s", EscapeChar::AltS},
     {"k", EscapeChar::AltK},
+    {"[200~", EscapeChar::BracketedPaste},
 };
 
 void enableRawMode() {
@@ -87,6 +88,20 @@ void preserveTermiosOriginalState() {
   atexit(disableRawMode);
 }
 
+void disableBracketedPaste() {
+  ssize_t out = write(STDOUT_FILENO, "\x1b[?2004l", 8);
+  assert(out >= 0);
+}
+
+/**
+ * Pasted text arrives wrapped in ESC[200~ and ESC[201~ instead of as typed keys.
+ */
+void enableBracketedPaste() {
+  ssize_t out = write(STDOUT_FILENO, "\x1b[?2004h", 8);
+  assert(out >= 0);
+  atexit(disableBracketedPaste);
+}
+
 void resetCursorLocation() {
   ssize_t out = write(STDOUT_FILENO, "\x1b[H", 3);
   assert(out >= 0);
@@ -148,45 +163,6 @@ inline constexpr char ctrlKey(char c) {
   return c & 0x1f;
 }
 
-TypedChar readKey() {
-  char c;
-  int result;
-
-  while ((result = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (result == -1 && errno != EAGAIN && errno != EINTR) {
-      reportAndExit("Failed reading input");
-    }
-  }
-
-  if (c != '\x1b') return TypedChar{c};
-
-  string combo{};
-
-  for (int i = 0;; i++) {
-    if (read(STDIN_FILENO, &c, 1) != 1) {
-      DLOG("Cannot read follow up combo char");
-      return i == 0 ? TypedChar{'\x1b'} : TYPED_CHAR_FAILURE;
-    }
-
-    combo.push_back(c);
-    bool hasMatch{false};
-
-    for (auto &[escapeCombo, escapeEnum] : escapeCharMap) {
-      if (escapeCombo.starts_with(combo)) {
-        if (escapeCombo == combo) return TypedChar{escapeEnum};
-
-        hasMatch = true;
-        break;
-      }
-    }
-
-    if (!hasMatch) {
-      DLOG("Failed detecting key combo. Prefix %s", combo.c_str());
-      return TYPED_CHAR_FAILURE;
-    }
-  }
-}
-
 inline void hideCursor(string &out) {
   out.append("\x1b[?25l");
 }
@@ -1,9 +1,14 @@
+#include <sys/epoll.h>
+
 #include <fstream>
 #include <iostream>
 #include <regex>
 #include <unordered_set>
 #include <vector>
 
+#include "config.h"
+#include "input_decoder.h"
+#include "screen_renderer.h"
 #include "text_view.h"
 #include "utility.h"
 
@@ -22,8 +27,8 @@ void assert_eq(T v1, T v2, int lineNo) {
 }
 
 void test_find_number_beginning() {
-  vector<string> raw = {"123   "};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"123   "}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -34,8 +39,8 @@ void test_find_number_beginning() {
 }
 
 void test_find_number_middle() {
-  vector<string> raw = {"  123   "};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"  123   "}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -46,8 +51,8 @@ void test_find_number_middle() {
 }
 
 void test_find_number_end() {
-  vector<string> raw = {"   123"};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"   123"}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -58,8 +63,8 @@ void test_find_number_end() {
 }
 
 void test_single_find_number_beginning() {
-  vector<string> raw = {"1   "};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"1   "}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -70,8 +75,8 @@ void test_single_find_number_beginning() {
 }
 
 void test_single_find_number_middle() {
-  vector<string> raw = {"  1   "};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"  1   "}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -82,8 +87,8 @@ void test_single_find_number_middle() {
 }
 
 void test_single_find_number_end() {
-  vector<string> raw = {"   1"};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"   1"}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -94,8 +99,8 @@ void test_single_find_number_end() {
 }
 
 void test_find_string() {
-  vector<string> raw = {"\"abc\""};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"\"abc\""}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -106,8 +111,8 @@ void test_find_string() {
 }
 
 void test_find_string_middle() {
-  vector<string> raw = {" \"abc\" "};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{" \"abc\" "}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -118,8 +123,8 @@ void test_find_string_middle() {
 }
 
 void test_find_single_quoted_string() {
-  vector<string> raw = {"--'a'--"};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"--'a'--"}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -130,12 +135,12 @@ void test_find_single_quoted_string() {
 }
 
 void test_find_word() {
-  vector<string> raw = {"for"};
+  LinesBuffer raw{{"for"}};
 
   unordered_set<string> keywords{
       "for",
   };
-  SyntaxHighlightConfig conf{&keywords};
+  SyntaxHighlightConfig conf{std::move(keywords)};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -146,12 +151,12 @@ void test_find_word() {
 }
 
 void test_does_not_find_unknown_word() {
-  vector<string> raw = {"hello for ever"};
+  LinesBuffer raw{{"hello for ever"}};
 
   unordered_set<string> keywords{
       "for",
   };
-  SyntaxHighlightConfig conf{&keywords};
+  SyntaxHighlightConfig conf{std::move(keywords)};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -162,12 +167,12 @@ void test_does_not_find_unknown_word() {
 }
 
 void test_find_complex_examples() {
-  vector<string> raw = {"for 123for x3 \"12'ab\""};
+  LinesBuffer raw{{"for 123for x3 \"12'ab\""}};
 
   unordered_set<string> keywords{
       "for",
   };
-  SyntaxHighlightConfig conf{&keywords};
+  SyntaxHighlightConfig conf{std::move(keywords)};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -188,8 +193,8 @@ void test_find_complex_examples() {
 }
 
 void test_parens() {
-  vector<string> raw = {"abc("};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"abc("}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -200,8 +205,8 @@ void test_parens() {
 }
 
 void test_unmatched_quotes() {
-  vector<string> raw = {"\"a"};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"\"a"}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -212,8 +217,8 @@ void test_unmatched_quotes() {
 }
 
 void test_multiline_quotes() {
-  vector<string> raw = {"\"a", "b\"   def"};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"\"a", "b\"   def"}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -229,8 +234,8 @@ void test_multiline_quotes() {
 }
 
 void test_comments() {
-  vector<string> raw = {"  //ab"};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"  //ab"}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -242,8 +247,8 @@ void test_comments() {
 }
 
 void test_multiline_comments() {
-  vector<string> raw = {"  /*ab", "cd*/  "};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"  /*ab", "cd*/  "}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -258,8 +263,8 @@ void test_multiline_comments() {
 }
 
 void test_multiline_comments_only_start() {
-  vector<string> raw = {"/*"};
-  SyntaxHighlightConfig conf{nullptr};
+  LinesBuffer raw{{"/*"}};
+  SyntaxHighlightConfig conf{{}};
 
   TokenAnalyzer ta{conf};
   auto result = ta.colorizeTokens(raw);
@@ -270,6 +275,562 @@ void test_multiline_comments_only_start() {
   ASSERT_EQ(2, (int)result[0][1].pos);
 }
 
+void test_colorize_line_carries_state() {
+  SyntaxHighlightConfig conf{{}};
+  TokenAnalyzer ta{conf};
+  vector<SyntaxColorInfo> markers{};
+
+  LineLexState state = ta.colorizeLine("a /* b", LineLexState{}, markers);
+  ASSERT_EQ(true, state == LineLexState::inBoundedComment(0));
+  ASSERT_EQ(1, (int)markers.size());
+
+  state = ta.colorizeLine("c */ \"d", state, markers);
+  ASSERT_EQ(true, state == LineLexState::inQuotedString('"'));
+  ASSERT_EQ(3, (int)markers.size());
+  ASSERT_EQ(4, markers[1].pos);
+  ASSERT_EQ(5, markers[2].pos);
+
+  state = ta.colorizeLine("e\" 1", state, markers);
+  ASSERT_EQ(true, state == LineLexState{});
+  ASSERT_EQ(4, (int)markers.size());
+}
+
+bool isSameColoring(vector<vector<SyntaxColorInfo>> &lhs, vector<vector<SyntaxColorInfo>> &rhs) {
+  if (lhs.size() != rhs.size()) return false;
+
+  for (int i = 0; i < (int)lhs.size(); i++) {
+    if (lhs[i].size() != rhs[i].size()) return false;
+
+    for (int j = 0; j < (int)lhs[i].size(); j++) {
+      if (lhs[i][j].pos != rhs[i][j].pos || strcmp(lhs[i][j].code, rhs[i][j].code) != 0) return false;
+    }
+  }
+
+  return true;
+}
+
+void test_text_view_incremental_syntax_coloring() {
+  TextView tv{32, 24};
+
+  for (char c : string{"int a = 1;"}) tv.insertCharacter(c);
+  tv.insertEnter();
+  for (char c : string{"b = 2; // x"}) tv.insertCharacter(c);
+  tv.ensureSyntaxColoring(tv.buffer->lineCount() - 1);
+  tv.cursorTo(0, 0);
+  tv.insertCharacter('/');
+  tv.insertCharacter('*');
+
+  auto full = tv.tokenAnalyzer.colorizeTokens(*tv.buffer);
+  ASSERT_EQ(true, isSameColoring(full, tv.syntaxColoring));
+  ASSERT_EQ(true, tv.syntaxLineStates[1] == LineLexState::inBoundedComment(0));
+
+  tv.undo();
+  full = tv.tokenAnalyzer.colorizeTokens(*tv.buffer);
+  ASSERT_EQ(true, isSameColoring(full, tv.syntaxColoring));
+  ASSERT_EQ(true, tv.syntaxLineStates[1] == LineLexState{});
+
+  tv.cursorTo(1, 0);
+  tv.deleteLine();
+  full = tv.tokenAnalyzer.colorizeTokens(*tv.buffer);
+  ASSERT_EQ(true, isSameColoring(full, tv.syntaxColoring));
+  ASSERT_EQ((size_t)2, tv.syntaxLineStates.size());
+}
+
+void test_text_view_lazy_syntax_coloring() {
+  TextView tv{32, 24};
+  tv.loadFile("misc/sample");
+
+  ASSERT_EQ((size_t)0, tv.syntaxColoring.size());
+
+  tv.lineSyntaxColoring(0);
+  ASSERT_EQ(min((size_t)SYNTAX_COLORING_PREFETCH_LINES + 1, tv.buffer->lineCount()), tv.syntaxColoring.size());
+
+  while (tv.syntaxColoringCatchUp()) {
+  }
+
+  auto full = tv.tokenAnalyzer.colorizeTokens(*tv.buffer);
+  ASSERT_EQ(true, isSameColoring(full, tv.syntaxColoring));
+}
+
+void renderFrame(ScreenRenderer& renderer, const vector<string>& rows, Point cursor, string& out) {
+  renderer.beginFrame(rows.size());
+  for (int i = 0; i < (int)rows.size(); i++) renderer.row(i) = rows[i];
+
+  out.clear();
+  renderer.flush(out, cursor);
+}
+
+void test_screen_renderer_emits_changed_rows() {
+  ScreenRenderer renderer{};
+  string out{};
+  string expected{};
+
+  renderFrame(renderer, {"a", "b", "c"}, Point{1, 2}, out);
+  hideCursor(expected);
+  for (int i = 0; i < 3; i++) {
+    setCursorLocation(expected, i, 0);
+    expected.append(string(1, 'a' + i));
+  }
+  setCursorLocation(expected, 2, 1);
+  showCursor(expected);
+  ASSERT_EQ(expected, out);
+
+  // Only the changed row, then the cursor back.
+  renderFrame(renderer, {"a", "x", "c"}, Point{1, 2}, out);
+  expected.clear();
+  hideCursor(expected);
+  setCursorLocation(expected, 1, 0);
+  expected.append("x");
+  setCursorLocation(expected, 2, 1);
+  showCursor(expected);
+  ASSERT_EQ(expected, out);
+
+  // Nothing changed.
+  renderFrame(renderer, {"a", "x", "c"}, Point{1, 2}, out);
+  ASSERT_EQ(""s, out);
+
+  // Only the cursor moved.
+  renderFrame(renderer, {"a", "x", "c"}, Point{0, 0}, out);
+  expected.clear();
+  setCursorLocation(expected, 0, 0);
+  ASSERT_EQ(expected, out);
+}
+
+void test_screen_renderer_resize_and_full_redraw() {
+  ScreenRenderer renderer{};
+  string out{};
+  string expected{};
+  renderFrame(renderer, {"a", "b"}, Point{0, 0}, out);
+
+  // A new row at the bottom is emitted, the kept ones are not.
+  renderFrame(renderer, {"a", "b", "c"}, Point{0, 0}, out);
+  expected.clear();
+  hideCursor(expected);
+  setCursorLocation(expected, 2, 0);
+  expected.append("c");
+  setCursorLocation(expected, 0, 0);
+  showCursor(expected);
+  ASSERT_EQ(expected, out);
+
+  renderFrame(renderer, {"a", "b"}, Point{0, 0}, out);
+  ASSERT_EQ(""s, out);
+
+  // After a terminal resize everything is repainted.
+  renderer.invalidate();
+  renderFrame(renderer, {"a", "b"}, Point{0, 0}, out);
+  expected.clear();
+  hideCursor(expected);
+  setCursorLocation(expected, 0, 0);
+  expected.append("a");
+  setCursorLocation(expected, 1, 0);
+  expected.append("b");
+  setCursorLocation(expected, 0, 0);
+  showCursor(expected);
+  ASSERT_EQ(expected, out);
+}
+
+void test_input_decoder() {
+  InputDecoder decoder{};
+
+  decoder.feed("a\x1b[A\x1b[1;5", false);
+  ASSERT_EQ('a', decoder.nextTypedChar().simple());
+  ASSERT_EQ(true, decoder.nextTypedChar().escape() == EscapeChar::Up);
+  ASSERT_EQ(false, decoder.hasTypedChars());
+
+  decoder.feed("Cb\x1b[9\x1b");
+  ASSERT_EQ(true, decoder.nextTypedChar().escape() == EscapeChar::CtrlRight);
+  ASSERT_EQ('b', decoder.nextTypedChar().simple());
+  ASSERT_EQ('\x1b', decoder.nextTypedChar().simple());
+  ASSERT_EQ(false, decoder.hasTypedChars());
+}
+
+void test_input_decoder_bracketed_paste() {
+  InputDecoder decoder{};
+
+  decoder.feed("x\x1b[200~ab\r\ncd\r", false);
+  decoder.feed("\nef\x1b[20", false);
+  ASSERT_EQ('x', decoder.nextTypedChar().simple());
+  ASSERT_EQ(false, decoder.hasTypedChars());
+
+  decoder.feed("1~y");
+  ASSERT_EQ(true, decoder.nextTypedChar().escape() == EscapeChar::BracketedPaste);
+  ASSERT_EQ('y', decoder.nextTypedChar().simple());
+  ASSERT_EQ("ab\ncd\nef"s, decoder.nextPaste());
+
+  // Only a tail that might start the end marker waits for the next read.
+  decoder.feed("\x1b[200~0123456789", false);
+  ASSERT_EQ(true, decoder.pending.empty());
+  decoder.feed("ab\x1b", false);
+  ASSERT_EQ("\x1b"s, decoder.pending);
+  decoder.feed("[2", false);
+  ASSERT_EQ("\x1b[2"s, decoder.pending);
+  decoder.feed("x\x1b[201~");
+  ASSERT_EQ("0123456789ab\x1b[2x"s, decoder.nextPaste());
+}
+
+void test_text_view_insert_paste() {
+  TextView tv{32, 24};
+
+  for (char c : string{"[]"}) tv.insertCharacter(c);
+  tv.cursorLeft();
+  tv.insertPaste("ab\ncd\nef");
+
+  ASSERT_EQ((size_t)3, tv.buffer->lineCount());
+  ASSERT_EQ("[ab"s, string(tv.buffer->line(0)));
+  ASSERT_EQ("ef]"s, string(tv.buffer->line(2)));
+  ASSERT_EQ(2, tv.currentRow());
+  ASSERT_EQ(2, tv.currentCol());
+
+  tv.undo();
+  ASSERT_EQ((size_t)1, tv.buffer->lineCount());
+  ASSERT_EQ("[]"s, string(tv.buffer->line(0)));
+
+  tv.redo();
+  ASSERT_EQ((size_t)3, tv.buffer->lineCount());
+  ASSERT_EQ("cd"s, string(tv.buffer->line(1)));
+}
+
+void test_lz_round_trip() {
+  srand(11);
+  string random{};
+  for (int i = 0; i < 100000; i++) random.push_back((char)(rand() % 256));
+
+  string repetitive{};
+  for (int i = 0; i < 10000; i++) repetitive.append("  int line" + to_string(i % 50) + " = 0;\n");
+
+  for (auto& text : vector<string>{"", "abc", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", random, repetitive}) {
+    PackedString packed{text};
+    ASSERT_EQ(text, packed.unpack());
+  }
+
+  ASSERT_EQ(true, PackedString{repetitive}.data.size() < repetitive.size() / 10);
+}
+
+void test_lz_rejects_corrupt_data() {
+  string text(1000, 'a');
+  string packed = Lz::compress(text);
+  string out{};
+  ASSERT_EQ(true, Lz::decompress(packed, text.size(), out));
+  ASSERT_EQ(text, out);
+
+  // Wrong size, huge size, cut short.
+  ASSERT_EQ(false, Lz::decompress(packed, text.size() + 1, out));
+  ASSERT_EQ(false, Lz::decompress(packed, SIZE_MAX, out));
+  ASSERT_EQ(false, Lz::decompress(packed.substr(0, 3), text.size(), out));
+
+  // Literal "ab", then a match at offset 0 and at offset 3 (past the output).
+  ASSERT_EQ(false, Lz::decompress("\x20" "ab\x00\x00"s, 6, out));
+  ASSERT_EQ(false, Lz::decompress("\x20" "ab\x03\x00"s, 6, out));
+  ASSERT_EQ(true, Lz::decompress("\x20" "ab\x02\x00"s, 6, out));
+  ASSERT_EQ("ababab"s, out);
+}
+
+void test_history_moves_units() {
+  TextView tv{32, 24};
+  string text(1000, 'a');
+  tv.insertPaste(text);
+
+  const char* payload = tv.history.undos.back().commands.back().memoryStr.data();
+  tv.history.useUndo();
+  ASSERT_EQ(true, payload == tv.history.redos.back().commands.back().memoryStr.data());
+  tv.history.useRedo();
+  ASSERT_EQ(true, payload == tv.history.undos.back().commands.back().memoryStr.data());
+}
+
+void test_history_memory_limit() {
+  TextView tv{32, 24};
+  tv.history.memoryLimit = 20000;
+
+  for (int i = 0; i < 100; i++) tv.insertPaste(string(1000, 'a'));
+  ASSERT_EQ(true, tv.history.memoryBytes <= 20000);
+  ASSERT_EQ(true, tv.history.undos.size() > 1 && tv.history.undos.size() < 20);
+
+  // A unit alone over the limit stays.
+  tv.insertPaste(string(30000, '\n'));
+  ASSERT_EQ((size_t)1, tv.history.undos.size());
+}
+
+void test_history_coalesces_typing() {
+  TextView tv{32, 24};
+  for (char c : string{"hello world"}) tv.insertCharacter(c);
+
+  // One unit per word.
+  ASSERT_EQ((size_t)2, tv.history.undos.size());
+  ASSERT_EQ(true, tv.history.undos.back().commands.front().type == CommandType::InsertSlice);
+  ASSERT_EQ("world"s, tv.history.undos.back().commands.front().memoryStr);
+
+  tv.undo();
+  ASSERT_EQ("hello "s, string(tv.buffer->line(0)));
+  ASSERT_EQ(6, tv.currentCol());
+  tv.redo();
+  ASSERT_EQ("hello world"s, string(tv.buffer->line(0)));
+
+  // Backspace and delete runs.
+  for (int i = 0; i < 3; i++) tv.insertBackspace();
+  ASSERT_EQ("hello wo"s, string(tv.buffer->line(0)));
+  tv.cursorTo(0, 1);
+  tv.insertDelete();
+  tv.insertDelete();
+  ASSERT_EQ("hlo wo"s, string(tv.buffer->line(0)));
+  ASSERT_EQ((size_t)4, tv.history.undos.size());
+
+  tv.undo();
+  ASSERT_EQ("hello wo"s, string(tv.buffer->line(0)));
+  tv.undo();
+  ASSERT_EQ("hello world"s, string(tv.buffer->line(0)));
+  ASSERT_EQ(11, tv.currentCol());
+
+  // A cursor jump breaks the run.
+  tv.cursorTo(0, 0);
+  tv.insertCharacter('a');
+  tv.cursorTo(0, 5);
+  tv.insertCharacter('b');
+  ASSERT_EQ((size_t)4, tv.history.undos.size());
+
+  // So does a pause.
+  tv.history.coalesceIdle = chrono::milliseconds(0);
+  tv.insertCharacter('c');
+  ASSERT_EQ((size_t)5, tv.history.undos.size());
+}
+
+void test_history_branches() {
+  TextView tv{32, 24};
+  tv.insertPaste("a");
+  tv.insertPaste("b");
+  tv.undo();
+  tv.insertPaste("c");
+  ASSERT_EQ("ac"s, string(tv.buffer->line(0)));
+  ASSERT_EQ((size_t)1, tv.history.branches.size());
+
+  // Back to the fork, the old branch is one switch away.
+  tv.undo();
+  ASSERT_EQ(true, tv.switchHistoryBranch());
+  tv.redo();
+  ASSERT_EQ("ab"s, string(tv.buffer->line(0)));
+
+  tv.undo();
+  ASSERT_EQ(true, tv.switchHistoryBranch());
+  tv.redo();
+  ASSERT_EQ("ac"s, string(tv.buffer->line(0)));
+
+  // No branch from here.
+  ASSERT_EQ(false, tv.switchHistoryBranch());
+}
+
+void test_history_time_travel() {
+  TextView tv{32, 24};
+  tv.insertPaste("a");
+  tv.insertPaste("b");
+  tv.undo();
+  tv.insertPaste("c");
+  tv.insertPaste("d");
+
+  // Pretend the edits were minutes apart.
+  auto now = chrono::system_clock::now();
+  tv.history.undos[0].time = now - chrono::minutes(40);
+  tv.history.branches[0].units.back().time = now - chrono::minutes(30);
+  tv.history.undos[1].time = now - chrono::minutes(20);
+  tv.history.undos[2].time = now - chrono::minutes(10);
+
+  ASSERT_EQ(true, tv.travelTo(now - chrono::minutes(25)));
+  ASSERT_EQ("ab"s, string(tv.buffer->line(0)));
+  ASSERT_EQ(true, tv.travelTo(now - chrono::minutes(15)));
+  ASSERT_EQ("ac"s, string(tv.buffer->line(0)));
+  ASSERT_EQ(true, tv.travelTo(now - chrono::minutes(50)));
+  ASSERT_EQ(""s, string(tv.buffer->line(0)));
+  ASSERT_EQ(true, tv.travelTo(now));
+  ASSERT_EQ("acd"s, string(tv.buffer->line(0)));
+}
+
+void test_history_branches_memory_limit() {
+  TextView tv{1024, 24};
+  tv.history.memoryLimit = 20000;
+
+  for (int i = 0; i < 30; i++) {
+    tv.insertPaste(string(500, 'a'));
+    tv.undo();
+  }
+  tv.insertPaste("x");
+  ASSERT_EQ(true, tv.history.memoryBytes <= 20000);
+  ASSERT_EQ(true, tv.history.branches.size() < 30);
+}
+
+void test_history_journal_across_sessions() {
+  string dir{"/tmp/pedit_test_undo_journal"};
+  string filePath{"/tmp/pedit_test_journaled"};
+  filesystem::remove_all(dir);
+  ofstream f(filePath, ios::out | ios::trunc);
+  f << "abc\n";
+  f.close();
+
+  {
+    TextView tv{32, 24};
+    tv.undoJournalDir = dir;
+    tv.loadFile(filePath);
+    tv.insertPaste("x");
+    tv.insertEnter();
+    tv.insertPaste(string(10000, 'y'));
+    tv.saveFile();
+
+    // Not saved - dropped on the next load.
+    tv.insertPaste("z");
+  }
+
+  TextView tv{32, 24};
+  tv.undoJournalDir = dir;
+  tv.loadFile(filePath);
+  ASSERT_EQ(true, tv.history.undos.empty());
+  ASSERT_EQ(string(10000, 'y') + "abc", string(tv.buffer->line(1)));
+
+  tv.undo();
+  ASSERT_EQ("abc"s, string(tv.buffer->line(1)));
+  tv.undo();
+  tv.undo();
+  ASSERT_EQ((size_t)1, tv.buffer->lineCount());
+  ASSERT_EQ("abc"s, string(tv.buffer->line(0)));
+  ASSERT_EQ(false, tv.history.prepareUndo());
+
+  tv.redo();
+  ASSERT_EQ("xabc"s, string(tv.buffer->line(0)));
+
+  // A new edit cuts the undone units.
+  tv.insertPaste("w");
+  tv.saveFile();
+  // One view of a file keeps the journal.
+  tv.closeFile();
+  {
+    TextView other{32, 24};
+    other.undoJournalDir = dir;
+    other.loadFile(filePath);
+    other.undo();
+    ASSERT_EQ("xabc"s, string(other.buffer->line(0)));
+    other.undo();
+    ASSERT_EQ("abc"s, string(other.buffer->line(0)));
+    ASSERT_EQ(false, other.history.prepareUndo());
+  }
+
+  // Changed elsewhere - the journal doesn't apply.
+  ofstream changed(filePath, ios::out | ios::trunc);
+  changed << "other\n";
+  changed.close();
+  TextView reloaded{32, 24};
+  reloaded.undoJournalDir = dir;
+  reloaded.loadFile(filePath);
+  ASSERT_EQ(false, reloaded.history.prepareUndo());
+}
+
+void test_history_journal_save_between_undo_and_redo() {
+  string dir{"/tmp/pedit_test_undo_journal"};
+  string filePath{"/tmp/pedit_test_journaled_redo"};
+  filesystem::remove_all(dir);
+  ofstream f(filePath, ios::out | ios::trunc);
+  f.close();
+
+  {
+    TextView tv{32, 24};
+    tv.undoJournalDir = dir;
+    tv.loadFile(filePath);
+    tv.insertPaste("ab");
+    tv.insertPaste("cd");
+    tv.saveFile();
+
+    tv.undo();
+    tv.saveFile();
+    tv.redo();
+    tv.saveFile();
+  }
+
+  TextView tv{32, 24};
+  tv.undoJournalDir = dir;
+  tv.loadFile(filePath);
+  ASSERT_EQ("abcd"s, string(tv.buffer->line(0)));
+
+  tv.undo();
+  ASSERT_EQ("ab"s, string(tv.buffer->line(0)));
+  tv.undo();
+  ASSERT_EQ(""s, string(tv.buffer->line(0)));
+  ASSERT_EQ(false, tv.history.prepareUndo());
+}
+
+void test_history_journal_past_memory_limit() {
+  string dir{"/tmp/pedit_test_undo_journal"};
+  string filePath{"/tmp/pedit_test_journaled_limit"};
+  filesystem::remove_all(dir);
+  ofstream f(filePath, ios::out | ios::trunc);
+  f.close();
+
+  TextView tv{32, 24};
+  tv.undoJournalDir = dir;
+  tv.loadFile(filePath);
+  tv.history.memoryLimit = 2000;
+
+  for (int i = 0; i < 50; i++) tv.insertPaste(to_string(i) + ",");
+  ASSERT_EQ(true, tv.history.undos.size() < 50);
+
+  for (int i = 0; i < 50; i++) tv.undo();
+  ASSERT_EQ(""s, string(tv.buffer->line(0)));
+  ASSERT_EQ(false, tv.history.prepareUndo());
+
+  tv.redo();
+  tv.redo();
+  ASSERT_EQ("0,1,"s, string(tv.buffer->line(0)));
+}
+
+void test_edit_log_one_writer_per_file() {
+  string dir{"/tmp/pedit_test_edit_log"};
+  string filePath{"/tmp/pedit_test_edit_logged_twice"};
+  filesystem::remove_all(dir);
+  ofstream f(filePath, ios::out | ios::trunc);
+  f << "abc\n";
+  f.close();
+
+  TextView first{32, 24};
+  first.editLogDir = dir;
+  first.undoJournalDir = dir;
+  first.loadFile(filePath);
+  ASSERT_EQ(true, first.editLog != nullptr);
+  ASSERT_EQ(true, first.history.journal != nullptr);
+
+  // The second view of the file runs without them.
+  TextView second{32, 24};
+  second.editLogDir = dir;
+  second.undoJournalDir = dir;
+  second.loadFile(filePath);
+  ASSERT_EQ(true, second.editLog == nullptr);
+  ASSERT_EQ(true, second.history.journal == nullptr);
+
+  first.closeFile();
+  second.loadFile(filePath);
+  ASSERT_EQ(true, second.editLog != nullptr);
+  ASSERT_EQ(true, second.history.journal != nullptr);
+}
+
+void test_text_view_undo_large_payload() {
+  TextView tv{32, 24};
+  string text{};
+  for (int i = 0; i < 1000; i++) text.append("line " + to_string(i) + " of the text");
+  tv.insertPaste(text);
+  tv.cursorTo(0, 0);
+  tv.deleteLine();
+  ASSERT_EQ(""s, string(tv.buffer->line(0)));
+
+  Command& cmd = tv.history.undos.back().commands.back();
+  ASSERT_EQ(true, cmd.packedMemory != nullptr);
+  ASSERT_EQ(true, cmd.memoryStr.empty());
+
+  tv.undo();
+  ASSERT_EQ(text, string(tv.buffer->line(0)));
+  ASSERT_EQ(true, tv.history.redos.back().commands.back().memoryStr.empty());
+
+  tv.redo();
+  ASSERT_EQ(""s, string(tv.buffer->line(0)));
+  tv.undo();
+  tv.undo();
+  ASSERT_EQ(""s, string(tv.buffer->line(0)));
+  tv.redo();
+  ASSERT_EQ(text, string(tv.buffer->line(0)));
+}
+
 void test_next_word_jump_location() {
   string s;
 
@@ -397,11 +958,693 @@ void test_text_view_movements() {
   ASSERT_EQ(1, tv.cursor.y);
 }
 
+void test_read_file_lines() {
+  vector<pair<string, vector<string>>> cases{
+      {"", {}},
+      {"\n", {""}},
+      {"abc", {"abc"}},
+      {"abc\n", {"abc"}},
+      {"a\n\nb\r\nc", {"a", "", "b\r", "c"}},
+  };
+
+  for (auto &[content, expected] : cases) {
+    ofstream f("/tmp/pedit_test_read_file_lines", ios::out | ios::trunc);
+    f << content;
+    f.close();
+
+    vector<string> lines{"stale"};
+    ASSERT_EQ(true, readFileLines("/tmp/pedit_test_read_file_lines", lines));
+    ASSERT_EQ(expected.size(), lines.size());
+    ASSERT_EQ(true, expected == lines);
+  }
+
+  vector<string> lines{};
+  ASSERT_EQ(false, readFileLines("/tmp/pedit_test_missing_file", lines));
+}
+
+void test_text_view_load_file_builds_balanced_lines() {
+  ifstream f("misc/sample");
+  vector<string> expected{};
+  for (string line; getline(f, line);) expected.push_back(line);
+
+  TextView tv{32, 24};
+  tv.loadFile("misc/sample");
+
+  ASSERT_EQ(true, dynamic_cast<LinesBuffer*>(tv.buffer.get())->lines.integrity_check());
+  ASSERT_EQ(expected.size(), tv.buffer->lineCount());
+  for (size_t i = 0; i < expected.size(); i++) ASSERT_EQ(expected[i], string(tv.buffer->line(i)));
+}
+
+void test_text_buffers_edit_alike() {
+  vector<unique_ptr<ITextBuffer>> buffers{};
+  buffers.push_back(make_unique<LinesBuffer>());
+  buffers.push_back(make_unique<RopeBuffer>());
+  buffers.push_back(make_unique<PieceTableBuffer>());
+
+  for (auto& buffer : buffers) {
+    string text{"ab\ncd\n\nef"};
+    vector<size_t> lineEnds{2, 5, 6, 9};
+    buffer->assign(text.data(), lineEnds);
+
+    buffer->insert(0, 1, "x\ny");
+    buffer->erase(2, 0, 1);
+    buffer->backspace(3, 0);
+    buffer->insertLine(0, "first");
+    buffer->swapLines(1);
+    buffer->removeLine(4);
+
+    vector<string> lines{};
+    buffer->forEachLine(0, [&](string_view line) {
+      lines.emplace_back(line);
+      return true;
+    });
+
+    vector<string> expected{"first", "yb", "ax", "d"};
+    ASSERT_EQ(true, expected == lines);
+    ASSERT_EQ(expected.size(), buffer->lineCount());
+    ASSERT_EQ((size_t)14, buffer->totalBytes());
+    ASSERT_EQ((size_t)9, buffer->byteOffset(2, 0));
+
+    string expectedSaved{"first\nyb\nax\nd\n"};
+    for (size_t from = 0; from <= expectedSaved.size(); from++) {
+      string saved{};
+      buffer->forEachChunk(from, [&](string_view chunk) {
+        saved.append(chunk);
+        return true;
+      });
+      ASSERT_EQ(expectedSaved.substr(from), saved);
+    }
+  }
+}
+
+void test_piece_table_random_edits() {
+  PieceTable table{};
+  string original{"ab\ncd\n\nefgh\nij"};
+  vector<size_t> lineBreaks{2, 5, 6, 11};
+  table.reset(original.data(), original.size(), std::move(lineBreaks));
+
+  string expected{original};
+  srand(7);
+  for (int i = 0; i < 2000; i++) {
+    size_t at = rand() % (expected.size() + 1);
+    if (rand() % 3 == 0 && at < expected.size()) {
+      size_t len = min((size_t)rand() % 4 + 1, expected.size() - at);
+      table.remove(at, len);
+      expected.erase(at, len);
+    } else {
+      string text = rand() % 2 == 0 ? "x" : "y\nz";
+      table.insert(at, text);
+      expected.insert(at, text);
+    }
+  }
+
+  ASSERT_EQ(true, table.integrityCheck());
+  ASSERT_EQ(expected.size(), table.size());
+  ASSERT_EQ((size_t)count(expected.begin(), expected.end(), '\n') + 1, table.lineCount());
+
+  string out{};
+  ASSERT_EQ(expected, string(table.slice(0, table.size(), out)));
+
+  size_t lineStart{0};
+  for (size_t row = 0; row < table.lineCount(); row++) {
+    size_t lineEnd = min(expected.find('\n', lineStart), expected.size());
+    ASSERT_EQ(lineStart, table.lineStart(row));
+    ASSERT_EQ(lineEnd, table.lineEnd(row));
+    lineStart = lineEnd + 1;
+  }
+}
+
+void test_piece_table_buffer_keeps_file_mapped() {
+  ofstream f("/tmp/pedit_test_piece_table", ios::out | ios::trunc);
+  f << "first\nsecond\nthird\n";
+  f.close();
+
+  auto file = make_shared<MappedFile>();
+  vector<size_t> lineEnds{};
+  ASSERT_EQ(true, indexFileLines("/tmp/pedit_test_piece_table", *file, lineEnds));
+
+  PieceTableBuffer buffer{file, std::move(lineEnds)};
+  ASSERT_EQ((size_t)3, buffer.lineCount());
+
+  // Untouched lines are views into the mapping.
+  string_view line = buffer.line(1);
+  ASSERT_EQ("second"s, string(line));
+  ASSERT_EQ(true, line.data() == file->data + 6);
+
+  buffer.insert(1, 3, "\n");
+  ASSERT_EQ((size_t)4, buffer.lineCount());
+  ASSERT_EQ("sec"s, string(buffer.line(1)));
+  ASSERT_EQ("ond"s, string(buffer.line(2)));
+  ASSERT_EQ(true, buffer.line(3).data() == file->data + 13);
+  ASSERT_EQ((size_t)1, buffer.table.add.size());
+}
+
+void test_piece_table_buffer_lazy_index() {
+  ofstream f("/tmp/pedit_test_lazy_index", ios::out | ios::trunc);
+  for (int i = 0; i < 20000; i++) f << "line " << i << "\n";
+  f.close();
+
+  auto file = make_shared<MappedFile>();
+  ASSERT_EQ(true, file->map("/tmp/pedit_test_lazy_index"));
+
+  PieceTableBuffer buffer{make_unique<LazyLineIndex>(file, 4096)};
+  ASSERT_EQ("line 15000"s, string(buffer.line(15000)));
+  ASSERT_EQ(true, buffer.lineCount() > 15000);
+  ASSERT_EQ((size_t)72, buffer.byteOffset(10, 2));
+
+  buffer.ensureLines(19000);
+  ASSERT_EQ(true, buffer.lineCount() >= 19000);
+
+  size_t estimate = buffer.estimatedLineCount();
+  ASSERT_EQ(true, estimate > 18000 && estimate < 22000);
+
+  // Editing finishes the index.
+  buffer.insert(0, 0, "x");
+  ASSERT_EQ(true, buffer.isLineCountExact());
+  ASSERT_EQ((size_t)20000, buffer.lineCount());
+  ASSERT_EQ("xline 0"s, string(buffer.line(0)));
+  ASSERT_EQ("line 19999"s, string(buffer.line(19999)));
+}
+
+void test_text_view_no_idle_coloring_of_mapped_file() {
+  ofstream f("/tmp/pedit_test_idle_coloring", ios::out | ios::trunc);
+  for (int i = 0; i < 20000; i++) f << "line " << i << "\n";
+  f.close();
+
+  auto file = make_shared<MappedFile>();
+  ASSERT_EQ(true, file->map("/tmp/pedit_test_idle_coloring"));
+
+  TextView tv{32, 24};
+  tv.buffer = make_unique<PieceTableBuffer>(make_unique<LazyLineIndex>(file, 4096));
+  tv.reloadSyntaxColoring();
+
+  ASSERT_EQ(false, tv.syntaxColoringCatchUp());
+
+  // Shown lines are colored.
+  ASSERT_EQ(false, tv.lineSyntaxColoring(10).empty());
+  ASSERT_EQ(true, tv.syntaxColoring.size() < 1000);
+}
+
+void test_text_view_reloads_truncated_mapped_file() {
+  string filePath{"/tmp/pedit_test_truncated_mapped"};
+  ofstream f(filePath, ios::out | ios::trunc);
+  for (int i = 0; i < 2000; i++) f << "log line " << i << "\n";
+  f.close();
+
+  TextView tv{32, 24};
+  tv.loadFile(filePath);
+  tv.isFollowing = true;
+
+  auto file = make_shared<MappedFile>();
+  vector<size_t> lineEnds{};
+  ASSERT_EQ(true, indexFileLines(filePath, *file, lineEnds));
+  tv.buffer = make_unique<PieceTableBuffer>(file, std::move(lineEnds));
+  ASSERT_EQ(false, tv.reloadIfMappingTruncated());
+
+  // Rotated with copytruncate.
+  ASSERT_EQ(0, truncate(filePath.c_str(), 0));
+  ASSERT_EQ(true, tv.reloadIfMappingTruncated());
+  ASSERT_EQ((size_t)1, tv.buffer->lineCount());
+  ASSERT_EQ(""s, string(tv.buffer->line(0)));
+
+  ofstream appended(filePath, ios::out | ios::app);
+  appended << "new line\n";
+  appended.close();
+  ASSERT_EQ(true, tv.followFileAppend());
+  ASSERT_EQ("new line"s, string(tv.buffer->line(0)));
+}
+
+void test_text_view_follow_file_append() {
+  ofstream f("/tmp/pedit_test_follow", ios::out | ios::trunc);
+  f << "a\n/* b";
+  f.close();
+
+  TextView tv{32, 24};
+  tv.loadFile("/tmp/pedit_test_follow");
+  tv.isFollowing = true;
+  tv.ensureSyntaxColoring(tv.buffer->lineCount() - 1);
+  tv.cursorTo(1, 0);
+
+  f.open("/tmp/pedit_test_follow", ios::out | ios::app);
+  f << "c\nd */\n";
+  f.close();
+
+  ASSERT_EQ(true, tv.followFileAppend());
+  ASSERT_EQ((size_t)3, tv.buffer->lineCount());
+  ASSERT_EQ("/* bc"s, string(tv.buffer->line(1)));
+  ASSERT_EQ("d */"s, string(tv.buffer->line(2)));
+  ASSERT_EQ(2, tv.currentRow());
+  ASSERT_EQ(false, tv.isDirty);
+
+  // Only the new lines are colored, the same way as from scratch.
+  auto full = tv.tokenAnalyzer.colorizeTokens(*tv.buffer);
+  ASSERT_EQ(true, isSameColoring(full, tv.syntaxColoring));
+
+  f.open("/tmp/pedit_test_follow", ios::out | ios::app);
+  f << "e";
+  f.close();
+
+  ASSERT_EQ(true, tv.followFileAppend());
+  ASSERT_EQ((size_t)4, tv.buffer->lineCount());
+  ASSERT_EQ("e"s, string(tv.buffer->line(3)));
+  ASSERT_EQ(3, tv.currentRow());
+
+  // Truncated - needs a reload.
+  f.open("/tmp/pedit_test_follow", ios::out | ios::trunc);
+  f << "x";
+  f.close();
+  ASSERT_EQ(false, tv.followFileAppend());
+}
+
+string readWholeFile(const string& filePath) {
+  ifstream f(filePath);
+  return string(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+}
+
+void test_edit_log_recovers_edits() {
+  string dir{"/tmp/pedit_test_edit_log"};
+  string filePath{"/tmp/pedit_test_edit_logged"};
+  filesystem::remove_all(dir);
+  ofstream f(filePath, ios::out | ios::trunc);
+  f << "abc\n";
+  f.close();
+
+  string expected{};
+  {
+    TextView tv{32, 24};
+    tv.editLogDir = dir;
+    tv.loadFile(filePath);
+    tv.insertPaste("x");
+    tv.insertEnter();
+    tv.insertPaste("yz");
+    tv.undo();
+    tv.insertPaste(string(10000, 'w'));
+    ASSERT_EQ(true, tv.editLog->commit());
+
+    tv.buffer->forEachChunk(0, [&](string_view chunk) {
+      expected.append(chunk);
+      return true;
+    });
+  }
+
+  // A record cut short by the crash.
+  ofstream log(EditLog::pathFor(dir, filePath), ios::out | ios::app);
+  log << "\x20\x00";
+  log.close();
+
+  {
+    TextView tv{32, 24};
+    tv.editLogDir = dir;
+    tv.loadFile(filePath);
+    ASSERT_EQ(false, tv.recoverableEdits.empty());
+    ASSERT_EQ("abc"s, string(tv.buffer->line(0)));
+
+    tv.recoverEdits();
+    string recovered{};
+    tv.buffer->forEachChunk(0, [&](string_view chunk) {
+      recovered.append(chunk);
+      return true;
+    });
+    ASSERT_EQ(expected, recovered);
+
+    // Truncated on save.
+    tv.saveFile();
+  }
+
+  TextView tv{32, 24};
+  tv.editLogDir = dir;
+  tv.loadFile(filePath);
+  ASSERT_EQ(true, tv.recoverableEdits.empty());
+  ASSERT_EQ(expected, readWholeFile(filePath));
+}
+
+void test_edit_log_dropped_when_not_applicable() {
+  string dir{"/tmp/pedit_test_edit_log"};
+  string filePath{"/tmp/pedit_test_edit_logged_other"};
+  filesystem::remove_all(dir);
+  ofstream f(filePath, ios::out | ios::trunc);
+  f << "abc\n";
+  f.close();
+
+  {
+    TextView tv{32, 24};
+    tv.editLogDir = dir;
+    tv.loadFile(filePath);
+    tv.insertPaste("x");
+  }
+
+  {
+    // Edited without recovering: the logged edits are gone.
+    TextView tv{32, 24};
+    tv.editLogDir = dir;
+    tv.loadFile(filePath);
+    ASSERT_EQ(false, tv.recoverableEdits.empty());
+    tv.cursorTo(0, 3);
+    tv.insertPaste("y");
+  }
+
+  {
+    TextView tv{32, 24};
+    tv.editLogDir = dir;
+    tv.loadFile(filePath);
+    ASSERT_EQ(false, tv.recoverableEdits.empty());
+    tv.recoverEdits();
+    ASSERT_EQ("abcy"s, string(tv.buffer->line(0)));
+  }
+
+  // Changed elsewhere - the edits don't apply.
+  ofstream changed(filePath, ios::out | ios::trunc);
+  changed << "other file\n";
+  changed.close();
+  TextView tv{32, 24};
+  tv.editLogDir = dir;
+  tv.loadFile(filePath);
+  ASSERT_EQ(true, tv.recoverableEdits.empty());
+}
+
+void test_atomic_file_writer() {
+  string filePath{"/tmp/pedit_test_atomic_write"};
+  ofstream f(filePath, ios::out | ios::trunc);
+  f << "old";
+  f.close();
+  chmod(filePath.c_str(), 0640);
+
+  // Discarded - the original stays.
+  {
+    AtomicFileWriter writer{filePath};
+    ASSERT_EQ(true, writer.open());
+    writer.write("new");
+  }
+  ASSERT_EQ("old"s, readWholeFile(filePath));
+
+  // More chunks than a writev batch.
+  vector<string> lines{};
+  string expected{};
+  for (int i = 0; i < 3000; i++) {
+    lines.push_back("line " + to_string(i) + "\n");
+    expected.append(lines.back());
+  }
+
+  AtomicFileWriter writer{filePath};
+  ASSERT_EQ(true, writer.open());
+  for (auto& line : lines) writer.write(line);
+  ASSERT_EQ(true, writer.commit(FsyncPolicy::Full));
+  ASSERT_EQ(expected, readWholeFile(filePath));
+
+  struct stat st;
+  stat(filePath.c_str(), &st);
+  ASSERT_EQ(0640, (int)(st.st_mode & 07777));
+
+  size_t tempFileCount{0};
+  for (auto& entry : filesystem::directory_iterator("/tmp")) {
+    if (entry.path().string().rfind(filePath + ".", 0) == 0) tempFileCount++;
+  }
+  ASSERT_EQ((size_t)0, tempFileCount);
+
+  // New file.
+  unlink(filePath.c_str());
+  AtomicFileWriter newFileWriter{filePath};
+  ASSERT_EQ(true, newFileWriter.open());
+  newFileWriter.write("new");
+  ASSERT_EQ(true, newFileWriter.commit(FsyncPolicy::File));
+  ASSERT_EQ("new"s, readWholeFile(filePath));
+}
+
+void test_save_over_mapped_file() {
+  string filePath{"/tmp/pedit_test_save_mapped"};
+  ofstream f(filePath, ios::out | ios::trunc);
+  f << "abc\ndef\n";
+  f.close();
+
+  auto file = make_shared<MappedFile>();
+  vector<size_t> lineEnds{};
+  ASSERT_EQ(true, indexFileLines(filePath, *file, lineEnds));
+  PieceTableBuffer buffer{file, std::move(lineEnds)};
+  buffer.insert(1, 0, "x");
+
+  // The pieces point into the mapping of the file being replaced.
+  AtomicFileWriter writer{filePath};
+  ASSERT_EQ(true, writer.open());
+  buffer.forEachChunk(0, [&](string_view chunk) { return writer.write(chunk); });
+  ASSERT_EQ(true, writer.commit(FsyncPolicy::None));
+
+  ASSERT_EQ("abc\nxdef\n"s, readWholeFile(filePath));
+  ASSERT_EQ("abc"s, string(buffer.line(0)));
+}
+
+void test_file_watcher_rewatch_keeps_events() {
+  string filePath{"/tmp/pedit_test_rewatched"};
+  ofstream f(filePath, ios::out | ios::trunc);
+  f << "abc\n";
+  f.close();
+
+  FileWatcher watcher{};
+  watcher.watch(filePath);
+  int epollFd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev {};
+  ev.events = EPOLLIN;
+  ev.data.fd = watcher.getFd();
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, watcher.getFd(), &ev);
+
+  // As after a save - the registered fd has to keep reporting.
+  watcher.watch(filePath);
+  ASSERT_EQ(ev.data.fd, watcher.getFd());
+
+  ofstream appended(filePath, ios::out | ios::app);
+  appended << "def\n";
+  appended.close();
+
+  struct epoll_event events[1];
+  ASSERT_EQ(1, epoll_wait(epollFd, events, 1, 1000));
+  ASSERT_EQ(true, watcher.hasBeenModified());
+  ASSERT_EQ(false, watcher.hasBeenModified());
+
+  close(epollFd);
+  watcher.unwatch();
+}
+
+void test_file_tail_writer() {
+  string filePath{"/tmp/pedit_test_tail_write"};
+  ofstream f(filePath, ios::out | ios::trunc);
+  f << "abc\ndef\nghi\n";
+  f.close();
+
+  FileTailWriter writer{};
+  ASSERT_EQ(true, writer.open(filePath, 4));
+  writer.write("x\n");
+  ASSERT_EQ(true, writer.commit(FsyncPolicy::File));
+  ASSERT_EQ("abc\nx\n"s, readWholeFile(filePath));
+}
+
+void test_lines_buffer_saved_prefix() {
+  string text{};
+  vector<size_t> lineEnds{};
+  for (int i = 0; i < 20000; i++) {
+    text.append("line " + to_string(i) + "\n");
+    lineEnds.push_back(text.size() - 1);
+  }
+
+  LinesBuffer buffer{};
+  buffer.assign(text.data(), lineEnds);
+  ASSERT_EQ(text.size(), buffer.savedPrefixBytes());
+
+  // Only the leaves from the edited one on differ from the file.
+  buffer.insert(19990, 0, "x");
+  size_t prefix = buffer.savedPrefixBytes();
+  ASSERT_EQ(true, prefix > 0 && prefix <= buffer.byteOffset(19990, 0));
+  ASSERT_EQ(true, text.compare(0, prefix, text, 0, prefix) == 0);
+
+  buffer.markSaved(0);
+  ASSERT_EQ(buffer.totalBytes(), buffer.savedPrefixBytes());
+
+  buffer.removeLine(0);
+  ASSERT_EQ((size_t)0, buffer.savedPrefixBytes());
+}
+
+void test_text_view_saves_in_place() {
+  string filePath{"/tmp/pedit_test_save_in_place"};
+  ofstream f(filePath, ios::out | ios::trunc);
+  string expected{};
+  for (int i = 0; i < 20000; i++) expected.append("line " + to_string(i) + "\n");
+  f << expected;
+  f.close();
+
+  struct stat before;
+  stat(filePath.c_str(), &before);
+
+  TextView tv{32, 24};
+  tv.loadFile(filePath);
+  tv.inPlaceSaveMinSize = 0;
+  ASSERT_EQ(true, dynamic_cast<LinesBuffer*>(tv.buffer.get()) != nullptr);
+
+  tv.cursorTo(19999, 0);
+  tv.insertCharacter('x');
+  expected.insert(tv.buffer->byteOffset(19999, 0), "x");
+  ASSERT_EQ(true, tv.inPlaceSaveFrom(FsyncPolicy::InPlace) > 0);
+  ASSERT_EQ((size_t)0, tv.inPlaceSaveFrom(FsyncPolicy::Full));
+
+  ASSERT_EQ(true, tv.saveFile(FsyncPolicy::InPlace));
+  ASSERT_EQ(expected, readWholeFile(filePath));
+
+  // Rewritten in place, not replaced.
+  struct stat after;
+  stat(filePath.c_str(), &after);
+  ASSERT_EQ(before.st_ino, after.st_ino);
+
+  // Shrinking cuts the file.
+  tv.buffer->removeLine(19999);
+  expected.erase(tv.buffer->totalBytes());
+  ASSERT_EQ(true, tv.saveFile(FsyncPolicy::InPlace));
+  ASSERT_EQ(expected, readWholeFile(filePath));
+
+  // Changed on disk since - saved atomically.
+  ofstream other(filePath, ios::out | ios::app);
+  other << "more\n";
+  other.close();
+  tv.buffer->insert(19998, 0, "y");
+  ASSERT_EQ((size_t)0, tv.inPlaceSaveFrom(FsyncPolicy::InPlace));
+}
+
+void test_text_view_saves_mapped_file_in_place() {
+  string filePath{"/tmp/pedit_test_save_mapped_in_place"};
+  ofstream f(filePath, ios::out | ios::trunc);
+  string expected{};
+  for (int i = 0; i < 20000; i++) expected.append("line " + to_string(i) + "\n");
+  f << expected;
+  f.close();
+
+  struct stat before;
+  stat(filePath.c_str(), &before);
+
+  TextView tv{32, 24};
+  tv.loadFile(filePath);
+  tv.inPlaceSaveMinSize = 0;
+
+  auto file = make_shared<MappedFile>();
+  vector<size_t> lineEnds{};
+  ASSERT_EQ(true, indexFileLines(filePath, *file, lineEnds));
+  tv.buffer = make_unique<PieceTableBuffer>(file, std::move(lineEnds));
+  auto buffer = dynamic_cast<PieceTableBuffer*>(tv.buffer.get());
+
+  // The rest of the file moves forward, it's rewritten over the mapping the pieces read it from.
+  size_t editAt = tv.buffer->byteOffset(10000, 0);
+  tv.buffer->insert(10000, 0, "x");
+  expected.insert(editAt, "x");
+  ASSERT_EQ(editAt, tv.inPlaceSaveFrom(FsyncPolicy::InPlace));
+
+  ASSERT_EQ(true, tv.saveFile(FsyncPolicy::InPlace));
+  ASSERT_EQ(expected, readWholeFile(filePath));
+  ASSERT_EQ("xline 10000"s, string(tv.buffer->line(10000)));
+  ASSERT_EQ("line 19999"s, string(tv.buffer->line(19999)));
+  ASSERT_EQ(true, buffer->table.integrityCheck());
+
+  // The pieces read the rewritten file again.
+  ASSERT_EQ(tv.buffer->totalBytes() - 1, tv.buffer->savedPrefixBytes());
+
+  // Shrinking cuts the file under the mapping.
+  tv.buffer->removeLine(19999);
+  tv.buffer->removeLine(19998);
+  expected.erase(tv.buffer->totalBytes());
+  ASSERT_EQ(tv.buffer->byteOffset(19997, 10), tv.inPlaceSaveFrom(FsyncPolicy::InPlace));
+
+  ASSERT_EQ(true, tv.saveFile(FsyncPolicy::InPlace));
+  ASSERT_EQ(expected, readWholeFile(filePath));
+  ASSERT_EQ("line 19997"s, string(tv.buffer->line(19997)));
+  ASSERT_EQ(true, buffer->table.integrityCheck());
+
+  struct stat after;
+  stat(filePath.c_str(), &after);
+  ASSERT_EQ(before.st_ino, after.st_ino);
+
+  // An atomic save replaces the mapped file, the next ones can't be in place.
+  ASSERT_EQ(true, tv.saveFile(FsyncPolicy::File));
+  ASSERT_EQ((size_t)0, tv.inPlaceSaveFrom(FsyncPolicy::InPlace));
+  ASSERT_EQ("line 19997"s, string(tv.buffer->line(19997)));
+}
+
+void test_text_view_default_save_is_atomic() {
+  string filePath{"/tmp/pedit_test_default_save_atomic"};
+  ofstream f(filePath, ios::out | ios::trunc);
+  string expected{};
+  for (int i = 0; i < 20000; i++) expected.append("line " + to_string(i) + "\n");
+  f << expected;
+  f.close();
+
+  struct stat before;
+  stat(filePath.c_str(), &before);
+
+  TextView tv{32, 24};
+  tv.loadFile(filePath);
+  tv.inPlaceSaveMinSize = 0;
+
+  tv.cursorTo(19999, 0);
+  tv.insertCharacter('x');
+  expected.insert(tv.buffer->byteOffset(19999, 0), "x");
+  ASSERT_EQ(true, Config{}.fsyncPolicy == FsyncPolicy::File);
+  ASSERT_EQ((size_t)0, tv.inPlaceSaveFrom(Config{}.fsyncPolicy));
+
+  ASSERT_EQ(true, tv.saveFile());
+  ASSERT_EQ(expected, readWholeFile(filePath));
+
+  // Replaced by the renamed temp file, the old one is never written.
+  struct stat after;
+  stat(filePath.c_str(), &after);
+  ASSERT_EQ(true, before.st_ino != after.st_ino);
+}
+
+void test_text_view_long_line_file_uses_rope() {
+  string longLine(TEXT_BUFFER_ROPE_MIN_LINE_LENGTH, 'a');
+  ofstream f("/tmp/pedit_test_long_line", ios::out | ios::trunc);
+  f << "x\n" << longLine << "\ny\n";
+  f.close();
+
+  TextView tv{32, 24};
+  tv.loadFile("/tmp/pedit_test_long_line");
+  ASSERT_EQ(true, dynamic_cast<RopeBuffer*>(tv.buffer.get()) != nullptr);
+  ASSERT_EQ((size_t)3, tv.buffer->lineCount());
+
+  tv.cursorTo(1, 0);
+  tv.insertCharacter('b');
+  tv.saveFile();
+
+  ifstream in("/tmp/pedit_test_long_line");
+  vector<string> lines{};
+  for (string line; getline(in, line);) lines.push_back(line);
+  ASSERT_EQ(true, (vector<string>{"x", "b" + longLine, "y"}) == lines);
+}
+
+void test_text_view_search_jumps() {
+  TextView tv{32, 24};
+  tv.insertPaste("ab foo\nfoo\n\nx foo");
+  tv.cursorTo(0, 0);
+
+  string term{"foo"};
+  tv.jumpToNextSearchHit(term);
+  ASSERT_EQ(0, tv.currentRow());
+  ASSERT_EQ(3, tv.currentCol());
+  tv.jumpToNextSearchHit(term);
+  ASSERT_EQ(1, tv.currentRow());
+  ASSERT_EQ(0, tv.currentCol());
+  tv.jumpToNextSearchHit(term);
+  ASSERT_EQ(3, tv.currentRow());
+  ASSERT_EQ(2, tv.currentCol());
+
+  tv.jumpToPrevSearchHit(term);
+  ASSERT_EQ(1, tv.currentRow());
+  ASSERT_EQ(0, tv.currentCol());
+  tv.jumpToPrevSearchHit(term);
+  ASSERT_EQ(0, tv.currentRow());
+  ASSERT_EQ(3, tv.currentCol());
+  tv.jumpToPrevSearchHit(term);
+  ASSERT_EQ(0, tv.currentRow());
+  ASSERT_EQ(3, tv.currentCol());
+}
+
 void test_MultiLineCharIterator_basic() {
-  vector<string> lines{
+  LinesBuffer lines{{
       "ab",
       "cd",
-  };
+  }};
 
   MultiLineCharIterator it{lines};
 
@@ -432,9 +1675,9 @@ void test_MultiLineCharIterator_basic() {
 }
 
 void test_MultiLineCharIterator_empty_lines() {
-  vector<string> lines{
+  LinesBuffer lines{{
       "", "a", "", "", "b", "",
-  };
+  }};
 
   MultiLineCharIterator it{lines};
 
@@ -466,7 +1709,7 @@ void test_MultiLineCharIterator_empty_lines() {
 }
 
 void test_MultiLineCharIterator_peek_match() {
-  vector<string> lines{"abc"};
+  LinesBuffer lines{{"abc"}};
 
   MultiLineCharIterator it{lines};
 
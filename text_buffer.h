@@ -0,0 +1,556 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "experiment/lines.h"
+#include "experiment/rope.h"
+#include "file_reader.h"
+#include "piece_table.h"
+
+#define TEXT_BUFFER_LINES_UNIT_SIZE 4096
+#define TEXT_BUFFER_ROPE_UNIT_SIZE 4096
+// A file with a line longer than this goes into a rope - `Lines` copies the whole line on each edit in it.
+#define TEXT_BUFFER_ROPE_MIN_LINE_LENGTH (1 << 20)
+// A file this big stays mapped in a piece table, only its line index is built on load.
+#define TEXT_BUFFER_PIECE_TABLE_MIN_FILE_SIZE (1 << 28)
+// From this size on the file isn't indexed up front, see `LazyLineIndex`.
+#define TEXT_BUFFER_LAZY_INDEX_MIN_FILE_SIZE (1ul << 32)
+// Original bytes a piece table copies to memory at most for saving in place, see `PieceTableBuffer::savedPrefixBytes`.
+#define TEXT_BUFFER_IN_PLACE_SAVE_MAX_COPY (16 << 20)
+
+using namespace std;
+
+/**
+ * Line based text storage the editor runs on. Rows and columns are byte positions, lines don't contain the line break.
+ * A view returned by `line` is valid until the next edit or the next `line` call for another row.
+ */
+struct ITextBuffer {
+  virtual ~ITextBuffer() {
+  }
+
+  virtual size_t lineCount() = 0;
+  virtual string_view line(size_t row) = 0;
+  // Calls `fn` with the lines from `row` on, as long as it returns true.
+  virtual void forEachLine(size_t row, const function<bool(string_view)> &fn) = 0;
+  // Calls `fn` with consecutive pieces of the content as saved (with the line breaks) from the byte offset `from` on, as
+  // long as it returns true. The pieces stay valid until the next edit.
+  virtual void forEachChunk(size_t from, const function<bool(string_view)> &fn) = 0;
+
+  // The text might contain line breaks.
+  virtual void insert(size_t row, size_t col, const string &text) = 0;
+  // Only within the line.
+  virtual void erase(size_t row, size_t col, size_t len) = 0;
+  // At column 0 the line is merged into the previous one.
+  virtual void backspace(size_t row, size_t col) = 0;
+  virtual void insertLine(size_t row, const string &text) = 0;
+  virtual void removeLine(size_t row) = 0;
+  // Swaps `row` and `row + 1`.
+  virtual void swapLines(size_t row) = 0;
+
+  /**
+   * Replaces the content with the lines of a buffer, see `indexFileLines`. Leaves at least one (empty) line.
+   */
+  virtual void assign(const char *data, const vector<size_t> &lineEnds) = 0;
+
+  virtual size_t byteOffset(size_t row, size_t col) = 0;
+  // Size when saved (with a line break after each line).
+  virtual size_t totalBytes() = 0;
+
+  // False while the content is still being indexed - `lineCount` only covers the indexed lines then.
+  virtual bool isLineCountExact() {
+    return true;
+  }
+
+  virtual size_t estimatedLineCount() {
+    return lineCount();
+  }
+
+  // Makes the first `count` lines available, if they exist.
+  virtual void ensureLines(size_t count) {
+  }
+
+  // Bytes from the start known to be the same as in the file since the last load or `markSaved`.
+  virtual size_t savedPrefixBytes() {
+    return 0;
+  }
+
+  // Called before the file is rewritten in place from `from` (at most `savedPrefixBytes`) on.
+  virtual void willSaveInPlace(size_t from) {
+  }
+
+  // The file holds the content now: rewritten in place from `from` on, or replaced as a whole when it's 0.
+  virtual void markSaved(size_t from) {
+  }
+
+  // True when the content is read from a mapping of the file, paged in on access.
+  virtual bool isFileMapped() {
+    return false;
+  }
+};
+
+struct LinesBuffer : ITextBuffer {
+  Lines lines{make_shared<LinesConfig>((size_t)TEXT_BUFFER_LINES_UNIT_SIZE)};
+
+  LinesBuffer() {
+    lines.emplace_back("");
+  }
+
+  LinesBuffer(vector<string> &&newLines) {
+    lines.assign(std::forward<vector<string>>(newLines));
+    if (lines.empty()) lines.emplace_back("");
+  }
+
+  size_t lineCount() {
+    return lines.line_count;
+  }
+
+  string_view line(size_t row) {
+    return lines.view(row);
+  }
+
+  void forEachLine(size_t row, const function<bool(string_view)> &fn) {
+    if (row >= lines.line_count) return;
+
+    size_t from = row - lines.node_at(row)->line_start;
+    for (Lines *leaf = lines.node_at(row); leaf; leaf = leaf->leafNode.right, from = 0) {
+      for (size_t i = from; i < leaf->line_count; i++) {
+        if (!fn(leaf->leafNode.lines[i].view())) return;
+      }
+    }
+  }
+
+  void forEachChunk(size_t from, const function<bool(string_view)> &fn) {
+    if (from >= lines.total_bytes()) return;
+
+    auto [row, col] = lines.position_at_byte_offset(from);
+    forEachLine(row, [&](string_view line) {
+      string_view head = line.substr(min(col, line.size()));
+      col = 0;
+      return fn(head) && fn("\n"sv);
+    });
+  }
+
+  void insert(size_t row, size_t col, const string &text) {
+    lines.insert(row, col, text);
+  }
+
+  void erase(size_t row, size_t col, size_t len) {
+    lines[row].erase(col, len);
+  }
+
+  void backspace(size_t row, size_t col) {
+    lines.backspace(row, col);
+  }
+
+  void insertLine(size_t row, const string &text) {
+    lines.insert_line(row, text);
+  }
+
+  void removeLine(size_t row) {
+    lines.remove_line(row);
+  }
+
+  void swapLines(size_t row) {
+    lines[row].swap(lines[row + 1]);
+  }
+
+  void assign(const char *data, const vector<size_t> &lineEnds) {
+    lines.assign(data, lineEnds);
+    if (lines.empty()) lines.emplace_back("");
+  }
+
+  size_t byteOffset(size_t row, size_t col) {
+    return lines.byte_offset(row, col);
+  }
+
+  size_t totalBytes() {
+    return lines.total_bytes();
+  }
+
+  size_t savedPrefixBytes() {
+    return lines.file_clean_prefix_bytes();
+  }
+
+  void markSaved(size_t from) {
+    lines.mark_file_clean();
+  }
+};
+
+/**
+ * Lines spanning multiple rope leaves are copied out to be handed out as a view - the last one is kept.
+ */
+struct RopeBuffer : ITextBuffer {
+  RopeLines lines{make_shared<RopeConfig>((size_t)TEXT_BUFFER_ROPE_UNIT_SIZE), ""s};
+  string lineCache{};
+  size_t lineCacheRow{string::npos};
+
+  RopeBuffer() {
+  }
+
+  RopeBuffer(string &&text) : lines(make_shared<RopeConfig>((size_t)TEXT_BUFFER_ROPE_UNIT_SIZE), std::move(text)) {
+  }
+
+  size_t lineCount() {
+    return lines.line_count();
+  }
+
+  string_view line(size_t row) {
+    if (row != lineCacheRow) {
+      lineCache = lines.line(row);
+      lineCacheRow = row;
+    }
+
+    return lineCache;
+  }
+
+  void forEachLine(size_t row, const function<bool(string_view)> &fn) {
+    for (; row < lineCount(); row++) {
+      if (!fn(line(row))) return;
+    }
+  }
+
+  void forEachChunk(size_t from, const function<bool(string_view)> &fn) {
+    if (from < lines.rope.size) {
+      size_t leafStart;
+      Rope *leaf = lines.rope.node_at(from, leafStart);
+      size_t skip = from - leafStart;
+
+      for (; leaf; leaf = leaf->leafNode.right, skip = 0) {
+        if (!fn(string_view(leaf->leafNode.s).substr(skip))) return;
+      }
+    }
+
+    if (from <= lines.rope.size) fn("\n"sv);
+  }
+
+  void insert(size_t row, size_t col, const string &text) {
+    lineCacheRow = string::npos;
+    lines.insert(row, col, text);
+  }
+
+  void erase(size_t row, size_t col, size_t len) {
+    lineCacheRow = string::npos;
+
+    size_t from = lines.byte_offset(row, col);
+    if (len > 0) lines.rope.remove_range(from, from + len - 1);
+  }
+
+  void backspace(size_t row, size_t col) {
+    lineCacheRow = string::npos;
+    lines.backspace(row, col);
+  }
+
+  void insertLine(size_t row, const string &text) {
+    lineCacheRow = string::npos;
+    lines.insert_line(row, text);
+  }
+
+  void removeLine(size_t row) {
+    lineCacheRow = string::npos;
+    lines.remove_line(row);
+  }
+
+  void swapLines(size_t row) {
+    lineCacheRow = string::npos;
+
+    string first = lines.line(row);
+    string second = lines.line(row + 1);
+    size_t from = lines.byte_offset(row, 0);
+
+    lines.rope.remove_range(from, from + first.size() + second.size());
+    lines.rope.insert(from, second + "\n" + first);
+  }
+
+  void assign(const char *data, const vector<size_t> &lineEnds) {
+    lineCacheRow = string::npos;
+
+    // The line break closing the last line is implied, like in `Lines`.
+    size_t size = lineEnds.empty() ? 0 : lineEnds.back();
+    lines = RopeLines(make_shared<RopeConfig>((size_t)TEXT_BUFFER_ROPE_UNIT_SIZE), string(data, size));
+  }
+
+  size_t byteOffset(size_t row, size_t col) {
+    return lines.byte_offset(row, col);
+  }
+
+  size_t totalBytes() {
+    return lines.rope.size + 1;
+  }
+};
+
+/**
+ * Piece table over the mapped file - edits never copy the original content.
+ *
+ * With a lazy index the lines are read straight from the mapping as far as they are indexed. The piece table is built
+ * once the indexing is done - or right away on the first edit, waiting for the rest of the index.
+ */
+struct PieceTableBuffer : ITextBuffer {
+  // The pieces point into the mapping (or into `ownedText` when assigned from a buffer).
+  shared_ptr<MappedFile> file{};
+  string ownedText{};
+  PieceTable table{};
+  string lineCache{};
+  unique_ptr<LazyLineIndex> lazyIndex{};
+
+  PieceTableBuffer() {
+  }
+
+  PieceTableBuffer(shared_ptr<MappedFile> file, vector<size_t> &&lineEnds) : file(file) {
+    reset(file->data, std::forward<vector<size_t>>(lineEnds));
+  }
+
+  PieceTableBuffer(unique_ptr<LazyLineIndex> &&index) : file(index->file), lazyIndex(std::move(index)) {
+  }
+
+  size_t lineCount() {
+    if (isIndexing()) return max(lazyIndex->knownLineBreakCount(), (size_t)1);
+    return table.lineCount();
+  }
+
+  string_view line(size_t row) {
+    if (isIndexing()) {
+      lazyIndex->ensure(row + 1);
+      // The last line has no line break - it's only known for sure once the indexing is done.
+      if (isIndexing()) {
+        size_t from = lazyLineStart(row);
+        return string_view(file->data + from, lazyIndex->lineBreak(row) - from);
+      }
+    }
+
+    return table.slice(table.lineStart(row), table.lineEnd(row), lineCache);
+  }
+
+  void forEachLine(size_t row, const function<bool(string_view)> &fn) {
+    finishIndexing();
+
+    for (; row < lineCount(); row++) {
+      if (!fn(line(row))) return;
+    }
+  }
+
+  void forEachChunk(size_t from, const function<bool(string_view)> &fn) {
+    finishIndexing();
+
+    bool isDone{false};
+    table.forEachChunk(from, table.size(), [&](string_view chunk) {
+      if (!isDone) isDone = !fn(chunk);
+    });
+    if (!isDone && from <= table.size()) fn("\n"sv);
+  }
+
+  void insert(size_t row, size_t col, const string &text) {
+    finishIndexing();
+    table.insert(table.lineStart(row) + col, text);
+  }
+
+  void erase(size_t row, size_t col, size_t len) {
+    finishIndexing();
+    table.remove(table.lineStart(row) + col, len);
+  }
+
+  void backspace(size_t row, size_t col) {
+    finishIndexing();
+
+    if (row == 0 && col == 0) return;
+    table.remove(table.lineStart(row) + col - 1, 1);
+  }
+
+  void insertLine(size_t row, const string &text) {
+    finishIndexing();
+
+    if (row >= lineCount()) {
+      table.insert(table.size(), "\n" + text);
+    } else {
+      table.insert(table.lineStart(row), text + "\n");
+    }
+  }
+
+  void removeLine(size_t row) {
+    finishIndexing();
+
+    size_t from = table.lineStart(row);
+    size_t to = table.lineEnd(row);
+
+    if (row + 1 < lineCount()) {
+      // With its line break.
+      to++;
+    } else if (from > 0) {
+      // The last line takes the line break before it.
+      from--;
+    }
+
+    table.remove(from, to - from);
+  }
+
+  void swapLines(size_t row) {
+    finishIndexing();
+
+    string first{line(row)};
+    string second{line(row + 1)};
+    size_t from = table.lineStart(row);
+
+    table.remove(from, first.size() + 1 + second.size());
+    table.insert(from, second + "\n" + first);
+  }
+
+  void assign(const char *data, const vector<size_t> &lineEnds) {
+    lazyIndex.reset();
+    file.reset();
+
+    size_t size = lineEnds.empty() ? 0 : lineEnds.back();
+    ownedText.assign(data, size);
+    reset(ownedText.data(), vector<size_t>(lineEnds));
+  }
+
+  size_t byteOffset(size_t row, size_t col) {
+    if (isIndexing()) return lazyLineStart(row) + col;
+    return table.lineStart(row) + col;
+  }
+
+  size_t totalBytes() {
+    if (isIndexing()) return file->size + (file->data[file->size - 1] == '\n' ? 0 : 1);
+    return table.size() + 1;
+  }
+
+  bool isLineCountExact() {
+    return !isIndexing();
+  }
+
+  size_t estimatedLineCount() {
+    if (isIndexing()) return max(lazyIndex->lineBreakCount(), lineCount());
+    return lineCount();
+  }
+
+  void ensureLines(size_t count) {
+    if (isIndexing()) lazyIndex->ensure(count);
+  }
+
+  bool isFileMapped() {
+    return file != nullptr;
+  }
+
+  /**
+   * The pieces at the start that are the mapped file at its own offsets. Saving in place rewrites the mapped file under
+   * the pieces after them: what they read from there is copied to memory first (`willSaveInPlace`) - when that's too
+   * much the save is atomic.
+   */
+  size_t savedPrefixBytes() {
+    if (!file || isFileReplaced) return 0;
+    finishIndexing();
+
+    size_t prefix = table.originalPrefixBytes();
+    if (table.originalBytesAfter(prefix) > TEXT_BUFFER_IN_PLACE_SAVE_MAX_COPY) return 0;
+    return prefix;
+  }
+
+  void willSaveInPlace(size_t from) {
+    table.copyOriginalAfter(from);
+  }
+
+  /**
+   * After an in place save the mapping shows the rewritten file, the pieces from `from` on point at it again. After an
+   * atomic one the mapping is of the replaced file, all saves are atomic from then on.
+   */
+  void markSaved(size_t from) {
+    if (!file) return;
+
+    if (from > 0) {
+      table.rebaseOnOriginal(from, file->size);
+    } else {
+      isFileReplaced = true;
+    }
+  }
+
+ private:
+  bool isFileReplaced{false};
+
+  // Switches to the piece table when the background indexing is done. True while still indexing.
+  bool isIndexing() {
+    if (!lazyIndex) return false;
+    if (!lazyIndex->isComplete()) return true;
+
+    finishIndexing();
+    return false;
+  }
+
+  void finishIndexing() {
+    if (!lazyIndex) return;
+
+    vector<size_t> lineEnds = lazyIndex->take();
+    if (file->size > 0 && file->data[file->size - 1] != '\n') lineEnds.push_back(file->size);
+    lazyIndex.reset();
+
+    reset(file->data, std::move(lineEnds));
+  }
+
+  size_t lazyLineStart(size_t row) {
+    if (row == 0) return 0;
+
+    lazyIndex->ensure(row);
+    return lazyIndex->lineBreak(row - 1) + 1;
+  }
+
+  void reset(const char *data, vector<size_t> &&lineEnds) {
+    // The line break closing the last line is implied, the other line ends are the line breaks.
+    size_t size{0};
+    if (!lineEnds.empty()) {
+      size = lineEnds.back();
+      lineEnds.pop_back();
+    }
+
+    table.reset(data, size, std::forward<vector<size_t>>(lineEnds));
+  }
+};
+
+/**
+ * Picks the storage by the shape of the content: a piece table for huge files, a rope for very long lines, `Lines`
+ * otherwise.
+ */
+unique_ptr<ITextBuffer> makeTextBuffer(shared_ptr<MappedFile> file, vector<size_t> &&lineEnds) {
+  if (file->size >= TEXT_BUFFER_PIECE_TABLE_MIN_FILE_SIZE) {
+    return make_unique<PieceTableBuffer>(file, std::forward<vector<size_t>>(lineEnds));
+  }
+
+  size_t longestLine{0};
+  for (size_t i = 0; i < lineEnds.size(); i++) {
+    size_t lineStart = i == 0 ? 0 : lineEnds[i - 1] + 1;
+    longestLine = max(longestLine, lineEnds[i] - lineStart);
+  }
+
+  unique_ptr<ITextBuffer> out{};
+  if (longestLine >= TEXT_BUFFER_ROPE_MIN_LINE_LENGTH) {
+    out = make_unique<RopeBuffer>();
+  } else {
+    out = make_unique<LinesBuffer>();
+  }
+
+  out->assign(file->data, lineEnds);
+  return out;
+}
+
+/**
+ * Loads the file into the storage fitting it (see `makeTextBuffer`), huge files are indexed lazily. Returns nullptr when
+ * the file can't be opened. `fileSize` is set to the size of the loaded content - the file might grow meanwhile.
+ */
+unique_ptr<ITextBuffer> loadTextBuffer(const string &filePath, size_t &fileSize) {
+  auto file = make_shared<MappedFile>();
+  if (!file->map(filePath)) return nullptr;
+
+  fileSize = file->size;
+
+  if (file->size >= TEXT_BUFFER_LAZY_INDEX_MIN_FILE_SIZE) {
+    DLOG("Indexing %s (%lu bytes) lazily", filePath.c_str(), file->size);
+    return make_unique<PieceTableBuffer>(make_unique<LazyLineIndex>(file));
+  }
+
+  DLOG("Indexing %s (%lu bytes)", filePath.c_str(), file->size);
+  vector<size_t> lineEnds{};
+  indexLines(*file, lineEnds);
+
+  return makeTextBuffer(file, std::move(lineEnds));
+}
@@ -1,58 +1,111 @@
 #pragma once
 
+#include <algorithm>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "command.h"
-#include "experiment/lines.h"
+#include "text_buffer.h"
 #include "utility.h"
 
 using namespace std;
 
+/**
+ * Rows [row, row + removedLines) of the buffer before a command got replaced by
+ * rows [row, row + insertedLines) after it.
+ */
+struct LineEdit {
+  int row;
+  int removedLines;
+  int insertedLines;
+};
+
 namespace TextManipulator {
 
-void execute(Command *cmd, Lines &lines) {
+/**
+ * Removes `text` previously inserted at row:col - it might span multiple lines.
+ */
+void removeInserted(ITextBuffer &lines, int row, int col, const string &text) {
+  int newLineCount = count(text.begin(), text.end(), '\n');
+
+  if (newLineCount == 0) {
+    lines.erase(row, col, text.size());
+    return;
+  }
+
+  int lastSegmentLen = text.size() - text.rfind('\n') - 1;
+  string tail{lines.line(row + newLineCount).substr(lastSegmentLen)};
+
+  lines.erase(row, col, lines.line(row).size() - col);
+  lines.insert(row, col, tail);
+
+  for (int i = 0; i < newLineCount; i++) lines.removeLine(row + 1);
+}
+
+void execute(Command *cmd, ITextBuffer &lines) {
   if (cmd->type == CommandType::InsertChar) {
-    lines[cmd->row].insert(cmd->col, 1, cmd->memoryChr);
+    lines.insert(cmd->row, cmd->col, string(1, cmd->memoryChr));
   } else if (cmd->type == CommandType::DeleteChar) {
-    lines[cmd->row].erase(cmd->col, 1);
+    lines.erase(cmd->row, cmd->col, 1);
   } else if (cmd->type == CommandType::MergeLine) {
     lines.backspace(cmd->row + 1, 0);
   } else if (cmd->type == CommandType::DeleteLine) {
-    lines.remove_line(cmd->row);
+    lines.removeLine(cmd->row);
   } else if (cmd->type == CommandType::DeleteSlice) {
-    lines[cmd->row].erase(cmd->col, cmd->memoryStr.size());
+    lines.erase(cmd->row, cmd->col, cmd->memoryStr.size());
   } else if (cmd->type == CommandType::SplitLine) {
     lines.insert(cmd->row, cmd->col, "\n");
   } else if (cmd->type == CommandType::InsertSlice) {
     lines.insert(cmd->row, cmd->col, cmd->memoryStr);
   } else if (cmd->type == CommandType::SwapLine) {
-    lines[cmd->row].swap(lines[cmd->row + 1]);
+    lines.swapLines(cmd->row);
   } else {
     reportAndExit("Unknown command.");
   }
 }
 
-void reverse(Command *cmd, Lines &lines) {
+void reverse(Command *cmd, ITextBuffer &lines) {
   if (cmd->type == CommandType::InsertChar) {
-    lines[cmd->row].erase(cmd->col, 1);
+    lines.erase(cmd->row, cmd->col, 1);
   } else if (cmd->type == CommandType::DeleteChar) {
-    lines[cmd->row].insert(cmd->col, 1, cmd->memoryChr);
+    lines.insert(cmd->row, cmd->col, string(1, cmd->memoryChr));
   } else if (cmd->type == CommandType::MergeLine) {
     lines.insert(cmd->row, cmd->col, "\n");
   } else if (cmd->type == CommandType::DeleteLine) {
-    lines.insert_line(cmd->row, cmd->memoryStr);
+    lines.insertLine(cmd->row, cmd->memoryStr);
   } else if (cmd->type == CommandType::DeleteSlice) {
-    lines[cmd->row].insert(cmd->col, cmd->memoryStr);
+    lines.insert(cmd->row, cmd->col, cmd->memoryStr);
   } else if (cmd->type == CommandType::SplitLine) {
     lines.backspace(cmd->row + 1, 0);
   } else if (cmd->type == CommandType::InsertSlice) {
-    lines[cmd->row].erase(cmd->col, cmd->memoryStr.size());
+    removeInserted(lines, cmd->row, cmd->col, cmd->memoryStr);
   } else if (cmd->type == CommandType::SwapLine) {
-    lines[cmd->row].swap(lines[cmd->row + 1]);
+    lines.swapLines(cmd->row);
   } else {
     reportAndExit("Unknown revert command.");
   }
 }
 
+LineEdit editedLines(Command *cmd, bool reversed = false) {
+  LineEdit edit{cmd->row, 1, 1};
+
+  if (cmd->type == CommandType::MergeLine) {
+    edit.removedLines = 2;
+  } else if (cmd->type == CommandType::DeleteLine) {
+    edit.insertedLines = 0;
+  } else if (cmd->type == CommandType::SplitLine) {
+    edit.insertedLines = 2;
+  } else if (cmd->type == CommandType::InsertSlice) {
+    edit.insertedLines += count(cmd->memoryStr.begin(), cmd->memoryStr.end(), '\n');
+  } else if (cmd->type == CommandType::SwapLine) {
+    edit.removedLines = 2;
+    edit.insertedLines = 2;
+  }
+
+  if (reversed) swap(edit.removedLines, edit.insertedLines);
+
+  return edit;
+}
+
 }  // namespace TextManipulator
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstring>
 #include <deque>
 #include <filesystem>
 #include <fstream>
@@ -12,13 +14,21 @@
 
 #include "command.h"
 #include "debug.h"
-#include "experiment/lines.h"
+#include "edit_log.h"
+#include "file_reader.h"
 #include "file_watcher.h"
+#include "file_writer.h"
 #include "history.h"
 #include "terminal_util.h"
+#include "text_buffer.h"
 #include "text_manipulator.h"
 #include "utility.h"
 
+#define SYNTAX_COLORING_PREFETCH_LINES 256
+#define SYNTAX_COLORING_CATCH_UP_BATCH 4096
+// From this size on a save only rewrites the file from the first changed byte, see `inPlaceSaveFrom`.
+#define TEXT_VIEW_IN_PLACE_SAVE_MIN_SIZE (64 << 20)
+
 using namespace std;
 
 static unordered_map<const char*, const char*> fileTypeAssociationMap{
@@ -35,16 +45,33 @@ struct TextView : ITextViewState {
 
   optional<string> filePath{nullopt};
 
-  Lines lines{make_shared<LinesConfig>((size_t)4096)};
+  unique_ptr<ITextBuffer> buffer{make_unique<LinesBuffer>()};
 
   optional<SelectionEdge> selectionStart{nullopt};
   optional<SelectionEdge> selectionEnd{nullopt};
 
   History history{};
+  // Where the undo history is kept across sessions, empty: kept in memory only.
+  string undoJournalDir{};
+
+  // Where the unsaved edits are logged for crash recovery, empty: not logged.
+  string editLogDir{};
+  unique_ptr<EditLog> editLog{};
+  // Unsaved edits of a previous session found in the log on load, see `recoverEdits`.
+  vector<EditLogEntry> recoverableEdits{};
 
   FileWatcher fileWatcher{};
+  // Follow mode (tail -f): on a file change only the appended bytes are loaded.
+  bool isFollowing{false};
+  // Size of the file the content was loaded (or saved) from.
+  size_t loadedFileSize{0};
+  // The file as it was right after the load or the save - tells whether it's been changed by others since.
+  FileStamp loadedFileStamp{};
+  size_t inPlaceSaveMinSize{TEXT_VIEW_IN_PLACE_SAVE_MIN_SIZE};
 
   vector<vector<SyntaxColorInfo>> syntaxColoring{};
+  // Lexer state at the beginning of each line (and at the end of the buffer).
+  vector<LineLexState> syntaxLineStates{};
 
   int cols{0};
   int rows{0};
@@ -119,39 +146,74 @@ struct TextView : ITextViewState {
   }
 
   bool onLineRow() {
-    return currentRow() >= 0 && currentRow() < (int)lines.line_count;
+    return currentRow() >= 0 && currentRow() < (int)buffer->lineCount();
   }
 
   void undo() {
-    if (history.undos.empty()) return;
+    if (!history.prepareUndo()) return;
 
-    HistoryUnit historyUnit = history.useUndo();
+    HistoryUnit& historyUnit = history.useUndo();
 
     for (auto cmdIt = historyUnit.commands.rbegin(); cmdIt != historyUnit.commands.rend(); cmdIt++) {
-      TextManipulator::reverse(&*cmdIt, lines);
+      History::unpack(*cmdIt);
+      logEdit(*cmdIt, true);
+      TextManipulator::reverse(&*cmdIt, *buffer);
+      updateSyntaxColoring(TextManipulator::editedLines(&*cmdIt, true));
+      History::repack(*cmdIt);
     }
 
     selectionStart = historyUnit.beforeSelectionStart;
     selectionEnd = historyUnit.beforeSelectionEnd;
     cursor = historyUnit.beforeCursor;
-
-    reloadSyntaxColoring();
   }
 
   void redo() {
     if (history.redos.empty()) return;
 
-    HistoryUnit historyUnit = history.useRedo();
+    HistoryUnit& historyUnit = history.useRedo();
 
     for (auto& cmd : historyUnit.commands) {
-      TextManipulator::execute(&cmd, lines);
+      History::unpack(cmd);
+      logEdit(cmd, false);
+      TextManipulator::execute(&cmd, *buffer);
+      updateSyntaxColoring(TextManipulator::editedLines(&cmd));
+      History::repack(cmd);
     }
 
     selectionStart = historyUnit.afterSelectionStart;
     selectionEnd = historyUnit.afterSelectionEnd;
     cursor = historyUnit.afterCursor;
+  }
 
-    reloadSyntaxColoring();
+  /**
+   * Switches the redo to the next branch from the current state.
+   */
+  bool switchHistoryBranch() {
+    return history.switchBranch();
+  }
+
+  /**
+   * Undoes back to the state shared with the one at `time`, then redoes along its branch up to it.
+   */
+  bool travelTo(chrono::system_clock::time_point time) {
+    auto path = history.pathAt(time);
+    if (!path.has_value()) return false;
+
+    unordered_set<uint64_t> onPath(path->begin(), path->end());
+    onPath.insert(history.baseId);
+    while (!onPath.count(history.currentId())) undo();
+
+    size_t from{0};
+    if (history.currentId() != history.baseId) {
+      from = find(path->begin(), path->end(), history.currentId()) - path->begin() + 1;
+    }
+
+    for (size_t i = from; i < path->size(); i++) {
+      if (!history.selectRedo((*path)[i])) return false;
+      redo();
+    }
+
+    return true;
   }
 
   void cursorWordJumpLeft() {
@@ -275,8 +337,8 @@ struct TextView : ITextViewState {
     // Decide which line (row) we should be on.
     if (currentRow() < 0) {
       cursor.y -= currentRow();
-    } else if (currentRow() >= (int)lines.line_count) {
-      cursor.y -= currentRow() - (int)lines.line_count + 1;
+    } else if (currentRow() >= (int)buffer->lineCount()) {
+      cursor.y -= currentRow() - (int)buffer->lineCount() + 1;
     }
 
     // Decide which char (col).
@@ -338,14 +400,14 @@ struct TextView : ITextViewState {
     cursor.x = newCol - horizontalScroll;
   }
 
-  inline string& currentLine() {
-    return lines[currentRow()];
+  inline string_view currentLine() {
+    return buffer->line(currentRow());
   }
-  inline string& previousLine() {
-    return lines[previousRow()];
+  inline string_view previousLine() {
+    return buffer->line(previousRow());
   }
-  inline string& nextLine() {
-    return lines[nextRow()];
+  inline string_view nextLine() {
+    return buffer->line(nextRow());
   }
   inline int currentLineSize() {
     return currentLine().size();
@@ -366,17 +428,108 @@ struct TextView : ITextViewState {
   }
 
   void execCommand(Command&& cmd) {
-    TextManipulator::execute(&cmd, lines);
+    logEdit(cmd, false);
+    TextManipulator::execute(&cmd, *buffer);
+
+    updateSyntaxColoring(TextManipulator::editedLines(&cmd));
 
     history.record(move(cmd));
 
     isDirty = true;
-
-    reloadSyntaxColoring();
   }
 
+  /**
+   * Coloring is lazy: `syntaxColoring` only covers the first N lines (where N
+   * is its size) and grows on demand (drawing) or when the editor is idle.
+   */
   inline void reloadSyntaxColoring() {
-    syntaxColoring = tokenAnalyzer.colorizeTokens(lines);
+    syntaxColoring.clear();
+    syntaxLineStates.assign(1, LineLexState{});
+  }
+
+  void ensureSyntaxColoring(int untilRow) {
+    int lineCount = (int)buffer->lineCount();
+    untilRow = min(untilRow, lineCount - 1);
+
+    for (int row = syntaxColoring.size(); row <= untilRow; row++) {
+      syntaxColoring.emplace_back();
+      LineLexState endState = tokenAnalyzer.colorizeLine(buffer->line(row), syntaxLineStates[row], syntaxColoring.back());
+
+      if (row == lineCount - 1) tokenAnalyzer.closeOpenTokenAtEnd(buffer->line(row), endState, syntaxColoring.back());
+
+      syntaxLineStates.push_back(endState);
+    }
+  }
+
+  inline bool isSyntaxColoringComplete() const {
+    return syntaxColoring.size() >= buffer->lineCount();
+  }
+
+  /**
+   * Colors the next batch of not yet visited lines. Returns true while there is
+   * more left. Mapped files are only colored as far as they are shown - coloring
+   * them all would page in (and index) the whole file.
+   */
+  bool syntaxColoringCatchUp() {
+    if (buffer->isFileMapped() || isSyntaxColoringComplete()) return false;
+
+    ensureSyntaxColoring(syntaxColoring.size() + SYNTAX_COLORING_CATCH_UP_BATCH - 1);
+
+    return !isSyntaxColoringComplete();
+  }
+
+  vector<SyntaxColorInfo>& lineSyntaxColoring(int lineNo) {
+    if (lineNo >= (int)syntaxColoring.size()) ensureSyntaxColoring(lineNo + SYNTAX_COLORING_PREFETCH_LINES);
+
+    return syntaxColoring[lineNo];
+  }
+
+  /**
+   * Re-lexes the edited rows and keeps going only while the lexer state at the
+   * following line boundary differs from the cached one. Rows past the lazy
+   * coloring frontier are left for later.
+   */
+  void updateSyntaxColoring(LineEdit edit) {
+    int coloredCount = (int)syntaxColoring.size();
+    int lineDiff = edit.insertedLines - edit.removedLines;
+
+    if (syntaxLineStates.size() != syntaxColoring.size() + 1) {
+      reloadSyntaxColoring();
+      return;
+    }
+
+    if (edit.row >= coloredCount) return;
+
+    // Edit reaches over the frontier - it's cheaper to move the frontier back.
+    if (edit.row + edit.removedLines > coloredCount) {
+      syntaxColoring.resize(edit.row);
+      syntaxLineStates.resize(edit.row + 1);
+      return;
+    }
+
+    // Boundaries within the edited rows are stale, line start state of the first row is kept.
+    if (lineDiff > 0) {
+      syntaxColoring.insert(syntaxColoring.begin() + edit.row, lineDiff, {});
+      syntaxLineStates.insert(syntaxLineStates.begin() + edit.row + 1, lineDiff, LineLexState{});
+    } else if (lineDiff < 0) {
+      syntaxColoring.erase(syntaxColoring.begin() + edit.row, syntaxColoring.begin() + edit.row - lineDiff);
+      syntaxLineStates.erase(syntaxLineStates.begin() + edit.row + 1,
+                             syntaxLineStates.begin() + edit.row + 1 - lineDiff);
+    }
+
+    int lineCount = (int)buffer->lineCount();
+    int lastEditedRow = edit.row + edit.insertedLines - 1;
+    coloredCount += lineDiff;
+
+    for (int row = edit.row; row < coloredCount; row++) {
+      LineLexState endState = tokenAnalyzer.colorizeLine(buffer->line(row), syntaxLineStates[row], syntaxColoring[row]);
+
+      if (row == lineCount - 1) tokenAnalyzer.closeOpenTokenAtEnd(buffer->line(row), endState, syntaxColoring[row]);
+
+      if (row >= lastEditedRow && syntaxLineStates[row + 1] == endState) break;
+
+      syntaxLineStates[row + 1] = endState;
+    }
   }
 
   void clipboardCopy(vector<string>& sharedClipboard) {
@@ -389,11 +542,11 @@ struct TextView : ITextViewState {
 
     for (auto& lineSelection : lineSelections) {
       if (lineSelection.isFullLine()) {
-        sharedClipboard.push_back(lines[lineSelection.lineNo]);
+        sharedClipboard.push_back(string(buffer->line(lineSelection.lineNo)));
       } else {
         int start = lineSelection.isLeftBounded() ? lineSelection.startCol : 0;
-        int end = lineSelection.isRightBounded() ? lineSelection.endCol : lines[lineSelection.lineNo].size();
-        sharedClipboard.push_back(lines[lineSelection.lineNo].substr(start, end - start));
+        int end = lineSelection.isRightBounded() ? lineSelection.endCol : buffer->line(lineSelection.lineNo).size();
+        sharedClipboard.push_back(string(buffer->line(lineSelection.lineNo).substr(start, end - start)));
       }
     }
 
@@ -401,43 +554,31 @@ struct TextView : ITextViewState {
   }
 
   void jumpToNextSearchHit(string& searchTerm) {
-    auto lineIt = lines.begin();
-    advance(lineIt, currentRow());
-    size_t from = currentCol() + 1;
+    for (int row = currentRow(); row < (int)buffer->lineCount(); row++) {
+      size_t from = row == currentRow() ? currentCol() + 1 : 0;
+      size_t pos = buffer->line(row).find(searchTerm, from);
 
-    while (lineIt != lines.end()) {
-      size_t pos = lineIt->find(searchTerm, from);
-
-      if (pos == string::npos) {
-        lineIt++;
-        from = 0;
-      } else {
-        cursorTo(distance(lines.begin(), lineIt), pos);
+      if (pos != string::npos) {
+        cursorTo(row, pos);
         return;
       }
     }
   }
 
   void jumpToPrevSearchHit(string& searchTerm) {
-    auto lineIt = lines.rbegin();
-    advance(lineIt, lines.line_count - currentRow() - 1);
-    size_t from;
+    for (int row = currentRow(); row >= 0; row--) {
+      string_view line = buffer->line(row);
+      size_t from = line.size();
 
-    if (currentCol() == 0) {
-      lineIt++;
-      from = lineIt->size();
-    } else {
-      from = currentCol() - 1;
-    }
+      if (row == currentRow()) {
+        if (currentCol() == 0) continue;
+        from = currentCol() - 1;
+      }
 
-    while (lineIt != lines.rend()) {
-      size_t pos = lineIt->rfind(searchTerm, from);
+      size_t pos = line.rfind(searchTerm, from);
 
-      if (pos == string::npos) {
-        lineIt++;
-        from = lineIt->size();
-      } else {
-        cursorTo(lines.line_count - distance(lines.rbegin(), lineIt) - 1, pos);
+      if (pos != string::npos) {
+        cursorTo(row, pos);
         return;
       }
     }
@@ -466,10 +607,34 @@ struct TextView : ITextViewState {
    * INSERTIONS
    */
 
+  /**
+   * Inserts a whole (possibly multi line) text as one command and one history
+   * unit.
+   */
+  void insertPaste(const string& text) {
+    if (text.empty()) return;
+
+    if (hasActiveSelection()) insertBackspace();
+
+    history.newBlock(this);
+
+    int newLineCount = count(text.begin(), text.end(), '\n');
+    int endRow = currentRow() + newLineCount;
+    int endCol = newLineCount == 0 ? currentCol() + text.size() : text.size() - text.rfind('\n') - 1;
+
+    execCommand(Command::makeInsertSlice(currentRow(), currentCol(), text));
+
+    cursorTo(endRow, 0);
+    setCol(endCol);
+    saveXMemory();
+
+    history.closeBlock(this);
+  }
+
   void insertCharacter(char c) {
     if (hasActiveSelection()) insertBackspace();
 
-    if (currentRow() < (int)lines.line_count && currentCol() <= currentLineSize()) {
+    if (currentRow() < (int)buffer->lineCount() && currentCol() <= currentLineSize()) {
       history.newBlock(this);
 
       execCommand(Command::makeInsertChar(currentRow(), currentCol(), c));
@@ -494,19 +659,19 @@ struct TextView : ITextViewState {
       for (auto& lineSelection : lineSelections) {
         if (lineSelection.isFullLine()) {
           lineAdjustmentOffset++;
-          execCommand(Command::makeDeleteLine(selection.startRow + 1, lines[selection.startRow + 1]));
+          execCommand(Command::makeDeleteLine(selection.startRow + 1, string(buffer->line(selection.startRow + 1))));
         } else {
           int start = lineSelection.isLeftBounded() ? lineSelection.startCol : 0;
           int end = lineSelection.isRightBounded() ? lineSelection.endCol
-                                                   : lines[lineSelection.lineNo - lineAdjustmentOffset].size();
+                                                   : buffer->line(lineSelection.lineNo - lineAdjustmentOffset).size();
           execCommand(
               Command::makeDeleteSlice(lineSelection.lineNo - lineAdjustmentOffset, start,
-                                       lines[lineSelection.lineNo - lineAdjustmentOffset].substr(start, end - start)));
+                                       string(buffer->line(lineSelection.lineNo - lineAdjustmentOffset).substr(start, end - start))));
         }
       }
 
       if (selection.isMultiline()) {
-        execCommand(Command::makeMergeLine(selection.startRow, lines[selection.startRow].size()));
+        execCommand(Command::makeMergeLine(selection.startRow, buffer->line(selection.startRow).size()));
       }
 
       // Put cursor to beginning
@@ -522,7 +687,7 @@ struct TextView : ITextViewState {
     } else if (currentCol() == 0 && currentRow() > 0) {
       history.newBlock(this);
 
-      int oldLineLen = lines[currentRow() - 1].size();
+      int oldLineLen = buffer->line(currentRow() - 1).size();
       execCommand(Command::makeMergeLine(previousRow(), previousLine().size()));
       cursorTo(previousRow(), oldLineLen);
 
@@ -538,8 +703,8 @@ struct TextView : ITextViewState {
 
       int colStart = prevWordJumpLocation(currentLine(), currentCol()) + 1;
       if (currentCol() - colStart >= 0) {
-        execCommand(
-            Command::makeDeleteSlice(currentRow(), colStart, currentLine().substr(colStart, currentCol() - colStart)));
+        string deleted{currentLine().substr(colStart, currentCol() - colStart)};
+        execCommand(Command::makeDeleteSlice(currentRow(), colStart, deleted));
 
         setCol(colStart);
       }
@@ -559,7 +724,7 @@ struct TextView : ITextViewState {
       history.newBlock(this);
       execCommand(Command::makeDeleteChar(currentRow(), currentCol(), currentLine()[currentCol()]));
       history.closeBlock(this);
-    } else if (currentRow() < (int)lines.line_count - 1) {
+    } else if (currentRow() < (int)buffer->lineCount() - 1) {
       history.newBlock(this);
       execCommand(Command::makeMergeLine(currentRow(), currentCol()));
       history.closeBlock(this);
@@ -608,13 +773,13 @@ struct TextView : ITextViewState {
   void deleteLine() {
     history.newBlock(this);
 
-    if (lines.line_count == 1) {
-      execCommand(Command::makeDeleteSlice(0, 0, lines[0]));
+    if (buffer->lineCount() == 1) {
+      execCommand(Command::makeDeleteSlice(0, 0, string(buffer->line(0))));
     } else {
-      execCommand(Command::makeDeleteLine(currentRow(), currentLine()));
+      execCommand(Command::makeDeleteLine(currentRow(), string(currentLine())));
     }
 
-    if (currentRow() >= (int)lines.line_count) {
+    if (currentRow() >= (int)buffer->lineCount()) {
       cursorUp();
     } else {
       setCol(currentCol());
@@ -629,7 +794,7 @@ struct TextView : ITextViewState {
     if (hasActiveSelection()) {
       SelectionRange selection{selectionStart.value(), selectionEnd.value()};
 
-      if (selection.endRow >= (int)lines.line_count - 1) {
+      if (selection.endRow >= (int)buffer->lineCount() - 1) {
         history.closeBlock(this);
         return;
       }
@@ -641,7 +806,7 @@ struct TextView : ITextViewState {
       selectionStart = {selectionStart.value().row + 1, selectionStart.value().col};
       selectionEnd = {selectionEnd.value().row + 1, selectionEnd.value().col};
     } else {
-      if (currentRow() >= (int)lines.line_count - 1) {
+      if (currentRow() >= (int)buffer->lineCount() - 1) {
         history.closeBlock(this);
         return;
       }
@@ -754,7 +919,7 @@ struct TextView : ITextViewState {
   }
 
   int __lineIndentLeft(int lineNo, int tabSize) {
-    auto& line = lines[lineNo];
+    string_view line = buffer->line(lineNo);
     auto it = find_if(line.begin(), line.end(), [](auto& c) { return !isspace(c); });
     int leadingTabLen = distance(line.begin(), it);
     int tabsRemoved = min(leadingTabLen, tabSize);
@@ -774,54 +939,137 @@ struct TextView : ITextViewState {
    */
 
   void reloadContent() {
-    lines.clear();
+    // The unsaved edits are thrown away with the content.
+    if (editLog) editLog->truncate(loadedFileStamp);
+    editLog.reset();
+    recoverableEdits.clear();
+
+    buffer = make_unique<LinesBuffer>();
+    loadedFileSize = 0;
+    loadedFileStamp = FileStamp{};
 
     if (filePath.has_value()) {
       DLOG("Loading file: %s", filePath.value().c_str());
 
-      ifstream f(filePath.value());
-
-      if (!f.is_open()) {
+      unique_ptr<ITextBuffer> loadedBuffer = loadTextBuffer(filePath.value(), loadedFileSize);
+      if (!loadedBuffer) {
         DLOG("File %s does not exists. Creating one.", filePath.value().c_str());
-        f.open("a");
       } else {
-        for (string line; getline(f, line);) {
-          lines.emplace_back(line);
-        }
+        buffer = std::move(loadedBuffer);
+        readFileStamp(filePath.value(), loadedFileStamp);
       }
 
-      f.close();
-
       isDirty = false;
     } else {
       DLOG("Cannot load file - config does not have any.");
     }
 
+    // The old history doesn't apply to the new content. Mapped (huge) files keep it in memory only.
+    history = History{};
+    if (filePath.has_value() && !undoJournalDir.empty() && !buffer->isFileMapped()) {
+      history.openJournal(undoJournalDir, filePath.value(), loadedFileStamp);
+    }
+
+    if (filePath.has_value() && !editLogDir.empty()) {
+      editLog = make_unique<EditLog>();
+      if (!editLog->open(editLogDir, filePath.value(), loadedFileStamp, recoverableEdits)) {
+        DLOG("Cannot open edit log of %s: %s", filePath.value().c_str(), strerror(errno));
+        editLog.reset();
+        recoverableEdits.clear();
+      }
+    }
+
     reloadKeywordList();
     reloadSyntaxColoring();
 
-    if (lines.empty()) lines.emplace_back("");
-
     cursor.set(0, 0);
   }
 
-  void saveFile() {
-    DLOG("Save file: %s", filePath.value().c_str());
-    ofstream f(filePath.value(), ios::out | ios::trunc);
-
-    for (int i = 0; i < (int)lines.line_count; i++) {
-      f << lines[i];
+  bool saveFile(FsyncPolicy fsyncPolicy = FsyncPolicy::File) {
+    size_t from = inPlaceSaveFrom(fsyncPolicy);
+    DLOG("Save file: %s (from byte %lu)", filePath.value().c_str(), from);
 
-      if (i < (int)lines.line_count) {
-        f << endl;
+    bool isSaved{false};
+    if (from > 0) {
+      FileTailWriter writer{};
+      isSaved = writer.open(filePath.value(), from);
+      if (isSaved) {
+        buffer->willSaveInPlace(from);
+        buffer->forEachChunk(from, [&](string_view chunk) { return writer.write(chunk); });
+        isSaved = writer.commit(fsyncPolicy);
+      }
+    } else {
+      AtomicFileWriter writer{filePath.value()};
+      isSaved = writer.open();
+      if (isSaved) {
+        buffer->forEachChunk(0, [&](string_view chunk) { return writer.write(chunk); });
+        isSaved = writer.commit(fsyncPolicy);
       }
     }
 
-    f.close();
+    if (!isSaved) {
+      DLOG("Cannot save file %s: %s", filePath.value().c_str(), strerror(errno));
+      return false;
+    }
 
     isDirty = false;
+    buffer->markSaved(from);
+    loadedFileSize = buffer->totalBytes();
+    if (readFileStamp(filePath.value(), loadedFileStamp)) history.checkpoint(loadedFileStamp);
+    if (editLog) editLog->truncate(loadedFileStamp);
+
+    // After an atomic save the file is a new one (renamed over the old), the old watch is gone with the old file. After
+    // an in place save the watch would report our own writes.
+    fileWatcher.watch(filePath.value());
+
+    return true;
+  }
+
+  void logEdit(const Command& cmd, bool isReverse) {
+    if (!editLog) return;
+
+    // Editing without recovering them: the logged edits don't apply anymore.
+    if (!recoverableEdits.empty()) discardRecoverableEdits();
+    editLog->append(cmd, isReverse);
+  }
+
+  /**
+   * Replays the unsaved edits of the previous session on the content. They start a new history: the undo journal is
+   * of the saved file.
+   */
+  void recoverEdits() {
+    for (auto& edit : recoverableEdits) {
+      if (edit.isReverse) {
+        TextManipulator::reverse(&edit.cmd, *buffer);
+      } else {
+        TextManipulator::execute(&edit.cmd, *buffer);
+      }
+    }
+    recoverableEdits.clear();
+
+    history = History{};
+    reloadSyntaxColoring();
+    cursor.set(0, 0);
+    isDirty = true;
+  }
+
+  void discardRecoverableEdits() {
+    recoverableEdits.clear();
+    editLog->truncate(loadedFileStamp);
+  }
+
+  /**
+   * Where the save can start rewriting the file in place: the first byte that differs from it. 0 means the whole file
+   * is written atomically - any policy but InPlace (in place writes aren't crash safe), small files, backends not
+   * tracking their saved prefix and files changed on disk since the load.
+   */
+  size_t inPlaceSaveFrom(FsyncPolicy fsyncPolicy) {
+    if (fsyncPolicy != FsyncPolicy::InPlace || buffer->totalBytes() < inPlaceSaveMinSize) return 0;
+
+    FileStamp stamp{};
+    if (!readFileStamp(filePath.value(), stamp) || !(stamp == loadedFileStamp)) return 0;
 
-    fileWatcher.ignoreEventCycle();
+    return min(buffer->savedPrefixBytes(), loadedFileSize);
   }
 
   void loadFile(string newFilePath) {
@@ -833,7 +1081,57 @@ struct TextView : ITextViewState {
 
   void closeFile() {
     filePath = nullopt;
+    isFollowing = false;
+    fileWatcher.unwatch();
+    reloadContent();
+  }
+
+  /**
+   * Appends what has been written to the end of the file since it was loaded - only the new bytes are read and only the
+   * new lines are colored. Returns false when the file needs a full reload instead: it was edited here or it's not just
+   * appended to (got shorter).
+   */
+  bool followFileAppend() {
+    if (!filePath.has_value() || isDirty) return false;
+
+    string appended{};
+    if (!readFileFrom(filePath.value(), loadedFileSize, appended)) return false;
+    if (appended.empty()) return true;
+
+    int lastRow = (int)buffer->lineCount() - 1;
+    bool wasCursorAtEnd = currentRow() == lastRow;
+    // The buffer implies a line break after the last line - when the file has none, the new bytes continue that line.
+    bool isLastLineOpen = loadedFileSize < buffer->totalBytes();
+
+    loadedFileSize += appended.size();
+    if (appended.back() == '\n') appended.pop_back();
+    if (!isLastLineOpen) appended.insert(0, 1, '\n');
+
+    int newLineCount = count(appended.begin(), appended.end(), '\n');
+    buffer->insert(lastRow, buffer->line(lastRow).size(), appended);
+    updateSyntaxColoring(LineEdit{lastRow, 1, newLineCount + 1});
+
+    if (wasCursorAtEnd) cursorTo(lastRow + newLineCount, 0);
+
+    return true;
+  }
+
+  /**
+   * A mapped file cut short in place (logrotate copytruncate) can't be read past its new end - touching those pages
+   * kills the editor with SIGBUS. The content is reloaded then, before anything reads it. Returns true when it did.
+   */
+  bool reloadIfMappingTruncated() {
+    if (!filePath.has_value() || !buffer->isFileMapped()) return false;
+
+    FileStamp stamp{};
+    if (!readFileStamp(filePath.value(), stamp)) return false;
+    // Replaced by another file: the mapping holds on to the old one.
+    if (stamp.device != loadedFileStamp.device || stamp.inode != loadedFileStamp.inode) return false;
+    if (stamp.size >= loadedFileSize) return false;
+
+    DLOG("File %s got truncated (%lu -> %lu bytes), reloading", filePath.value().c_str(), loadedFileSize, stamp.size);
     reloadContent();
+    return true;
   }
 
   optional<string> fileName() const {
@@ -893,7 +1191,7 @@ struct TextView : ITextViewState {
     if (row == selection.endRow) {
       end = selection.endCol;
     } else {
-      end = lines[row].size();
+      end = buffer->line(row).size();
     }
 
     return pair<int, int>({start, end});
@@ -910,8 +1208,10 @@ struct TextView : ITextViewState {
 
     int lineNo = lineIdx + verticalScroll;
 
-    if (size_t(lineNo) < lines.line_count) {
-      string& line = lines[lineNo];
+    if (size_t(lineNo) < buffer->lineCount()) {
+      // Coloring might read further lines, which would invalidate the line view.
+      lineSyntaxColoring(lineNo);
+      string_view line = buffer->line(lineNo);
       string decoratedLine = decorateLine(line, lineNo, searchTerm);
 
       char formatBuf[32];
@@ -945,16 +1245,13 @@ struct TextView : ITextViewState {
     out.append(lineStr);
   }
 
-  string decorateLine(string& line, int lineNo, optional<string>& searchTerm) {
+  string decorateLine(string_view line, int lineNo, optional<string>& searchTerm) {
     string out{};
 
     int offset{0};
     auto lineIt = line.begin();
 
-    vector<SyntaxColorInfo> markers{};
-    if (lineNo <= (int)syntaxColoring.size() - 1) {
-      markers = syntaxColoring[lineNo];
-    }
+    vector<SyntaxColorInfo> markers{lineSyntaxColoring(lineNo)};
 
     auto selection = lineSelectionRange(lineNo);
     if (selection.has_value()) {
@@ -990,6 +1287,6 @@ struct TextView : ITextViewState {
     cols = newCols;
     rows = newRows;
 
-    leftMargin = max(1, (int)ceil(log10(lines.line_count))) + 1;
+    leftMargin = max(1, (int)ceil(log10(buffer->lineCount()))) + 1;
   }
 };
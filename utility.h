@@ -9,12 +9,13 @@
 #include <iterator>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include "debug.h"
-#include "experiment/lines.h"
+#include "text_buffer.h"
 
 #define TYPED_CHAR_SIMPLE 0
 #define TYPED_CHAR_ESCAPE 1
@@ -238,6 +239,7 @@ enum class TextEditorAction {
   ChangeActiveView9,
   NewSplitUnit,
   CloseTextView,
+  BracketedPaste,
 };
 
 enum class InputStroke {
@@ -294,6 +296,7 @@ enum class InputStroke {
   Alt9,
   AltS,
   AltK,
+  BracketedPaste,
 };
 
 enum class EscapeChar {
@@ -329,6 +332,7 @@ enum class EscapeChar {
   AltEqual,
   AltS,
   AltK,
+  BracketedPaste,
 };
 
 struct TypedChar {
@@ -388,14 +392,14 @@ enum class MultiLineCharIteratorState {
 };
 
 struct MultiLineCharIterator {
-  Lines &lines;
+  ITextBuffer &lines;
   const char end{'\0'};
   const char newline{'\n'};
   Point idx{-1, -1};
 
   MultiLineCharIteratorState state{MultiLineCharIteratorState::OnNewLine};
 
-  MultiLineCharIterator(Lines &lines) : lines(lines) {
+  MultiLineCharIterator(ITextBuffer &lines) : lines(lines) {
     next();
   }
 
@@ -411,12 +415,12 @@ struct MultiLineCharIterator {
       reportAndExit("Unhandled MultiLineCharIteratorState");
     }
 
-    if (idx.y >= (int)lines.line_count) {
+    if (idx.y >= (int)lines.lineCount()) {
       state = MultiLineCharIteratorState::OnEnd;
       return true;
     }
 
-    if (idx.x >= (int)lines[idx.y].size()) {
+    if (idx.x >= (int)lines.line(idx.y).size()) {
       state = MultiLineCharIteratorState::OnNewLine;
       return true;
     }
@@ -433,22 +437,23 @@ struct MultiLineCharIterator {
       case MultiLineCharIteratorState::OnEnd:
         return end;
       case MultiLineCharIteratorState::OnCharacter:
-        return lines[idx.y][idx.x];
+        return lines.line(idx.y)[idx.x];
     }
 
     return end;
   }
 
   inline string peek(int n) const {
-    return lines[idx.y].substr(idx.x, n);
+    return string(lines.line(idx.y).substr(idx.x, n));
   }
 
   bool isPeekMatch(string &s) const {
     if (!isRealChar()) return false;
-    if (idx.x + s.size() > lines[idx.y].size()) return false;
+    string_view line = lines.line(idx.y);
+    if (idx.x + s.size() > line.size()) return false;
 
-    for (int i = 0; i < (int)s.size() && (i + idx.x) < (int)lines[idx.y].size(); i++) {
-      if (s[i] != lines[idx.y][idx.x + i]) return false;
+    for (int i = 0; i < (int)s.size() && (i + idx.x) < (int)line.size(); i++) {
+      if (s[i] != line[idx.x + i]) return false;
     }
 
     return true;
@@ -493,120 +498,179 @@ enum class TokenState {
   Comment,
 };
 
+/**
+ * Lexer state at a line boundary. Only quoted strings and bounded comments can
+ * span multiple lines - everything else starts from `Unknown`.
+ */
+struct LineLexState {
+  TokenState state{TokenState::Unknown};
+  char quote{'\0'};
+  int boundedCommentIdx{-1};
+
+  static LineLexState inQuotedString(char quote) {
+    return LineLexState{TokenState::QuotedString, quote, -1};
+  }
+  static LineLexState inBoundedComment(int idx) {
+    return LineLexState{TokenState::Comment, '\0', idx};
+  }
+
+  inline bool isOpen() const {
+    return state != TokenState::Unknown;
+  }
+
+  bool operator==(const LineLexState &other) const = default;
+};
+
 struct TokenAnalyzer {
   SyntaxHighlightConfig config;
 
   TokenAnalyzer(SyntaxHighlightConfig config) : config(config) {
   }
 
-  vector<vector<SyntaxColorInfo>> colorizeTokens(Lines &inputLines) {
-    string current{};
+  vector<vector<SyntaxColorInfo>> colorizeTokens(ITextBuffer &inputLines) {
     vector<vector<SyntaxColorInfo>> out{};
+    vector<LineLexState> states{};
 
-    for (int i = 0; i < (int)inputLines.line_count; i++) out.emplace_back();
-
-    for (MultiLineCharIterator it{inputLines}; !it.isEnded();) {
-      current.clear();
-      Point start = it.idx;
-      Point end = it.idx;
-
-      if (isWordStart(it.current())) {
-        while (!it.isEnded() && isWord(it.current())) consume(current, it, end);
-        registerColorMarks(current, start, it.idx.dx(-1), TokenState::Word, out);
-      } else if (isNumber(it.current())) {
-        while (!it.isEnded() && isNumber(it.current())) consume(current, it, end);
-        registerColorMarks(current, start, it.idx.dx(-1), TokenState::Number, out);
-      } else if (isQuote(it.current())) {
-        char quoteType{it.current()};
-
-        // First quote.
-        consume(current, it, end);
-
-        // Collect until closing quote or end.
-        while (!it.isEnded() && it.current() != quoteType) {
-          if (it.current() == '\\') {
-            it.next();
-            it.next();
-          } else {
-            consume(current, it, end);
-          }
-        }
-
-        // Add closing quote (in case it wasn't overrunning the line).
-        consume(current, it, end);
+    colorizeLines(inputLines, out, states);
 
-        registerColorMarks(current, start, end, TokenState::QuotedString, out);
-      } else if (isParen(it.current())) {
-        while (!it.isEnded() && isParen(it.current())) consume(current, it, end);
-        registerColorMarks(current, start, it.idx.dx(-1), TokenState::Paren, out);
-      } else {
-        bool hasMatch{false};
+    return out;
+  }
 
-        for (auto &oneLinerComment : config.comments.oneLiners) {
-          if (it.isPeekMatch(oneLinerComment)) {
-            hasMatch = true;
+  /**
+   * Full pass. `states` receives the lexer state at the beginning of every
+   * line plus the state at the end of the buffer (line_count + 1 items).
+   */
+  void colorizeLines(ITextBuffer &inputLines, vector<vector<SyntaxColorInfo>> &out, vector<LineLexState> &states) {
+    int lineCount = (int)inputLines.lineCount();
 
-            while (!it.isEnded() && !it.isNewLine()) consume(it, end);
+    out.assign(lineCount, {});
+    states.assign(lineCount + 1, LineLexState{});
 
-            registerColorMarks(current, start, end, TokenState::Comment, out);
-            break;
-          }
-        }
-        if (hasMatch) continue;
+    int i{0};
+    inputLines.forEachLine(0, [&](string_view line) {
+      states[i + 1] = colorizeLine(line, states[i], out[i]);
+      if (i == lineCount - 1) closeOpenTokenAtEnd(line, states[lineCount], out[i]);
 
-        for (auto &bounded : config.comments.bounded) {
-          if (it.isPeekMatch(bounded.first)) {
-            hasMatch = true;
+      i++;
+      return true;
+    });
+  }
 
-            // Consume first half of comment boundary.
-            for (int i = 0; i < (int)bounded.first.size(); i++) consume(it, end);
+  /**
+   * Colorizes a single line starting from the lexer state `state` (the state at
+   * the end of the previous line). Returns the state at the end of this line.
+   */
+  LineLexState colorizeLine(string_view line, LineLexState state, vector<SyntaxColorInfo> &out) {
+    out.clear();
 
-            while (!it.isEnded() && !it.isPeekMatch(bounded.second)) consume(it, end);
+    size_t i{0};
 
-            if (it.isPeekMatch(bounded.second)) {
-              // Consume first half of comment boundary.
-              for (int i = 0; i < (int)bounded.second.size(); i++) consume(it, end);
-            }
+    if (state.state == TokenState::QuotedString) {
+      out.emplace_back(0, config.stringColor);
+      i = continueQuotedString(line, 0, state, out);
+    } else if (state.state == TokenState::Comment) {
+      out.emplace_back(0, config.commentColor);
+      i = continueBoundedComment(line, 0, state, out);
+    }
 
-            registerColorMarks(current, start, end, TokenState::Comment, out);
-            break;
-          }
+    while (i < line.size()) {
+      size_t start = i;
+      char c = line[i];
+
+      if (isWordStart(c)) {
+        while (i < line.size() && isWord(line[i])) i++;
+        registerColorMarks(line, start, i, TokenState::Word, out);
+      } else if (isNumber(c)) {
+        while (i < line.size() && isNumber(line[i])) i++;
+        registerColorMarks(line, start, i, TokenState::Number, out);
+      } else if (isQuote(c)) {
+        state = LineLexState::inQuotedString(c);
+        out.emplace_back(start, config.stringColor);
+        i = continueQuotedString(line, i + 1, state, out);
+      } else if (isParen(c)) {
+        while (i < line.size() && isParen(line[i])) i++;
+        registerColorMarks(line, start, i, TokenState::Paren, out);
+      } else if (isOneLinerCommentAt(line, i)) {
+        registerColorMarks(line, start, line.size(), TokenState::Comment, out);
+        i = line.size();
+      } else {
+        int boundedIdx = boundedCommentAt(line, i);
+
+        if (boundedIdx >= 0) {
+          state = LineLexState::inBoundedComment(boundedIdx);
+          out.emplace_back(start, config.commentColor);
+          i = continueBoundedComment(line, i + config.comments.bounded[boundedIdx].first.size(), state, out);
+        } else {
+          i++;
         }
-        if (hasMatch) continue;
-
-        it.next();
       }
     }
 
-    return out;
+    return state;
+  }
+
+  /**
+   * A string or comment left open at the end of the buffer is closed after the
+   * last character.
+   */
+  void closeOpenTokenAtEnd(string_view lastLine, LineLexState state, vector<SyntaxColorInfo> &out) {
+    if (state.isOpen()) out.emplace_back(lastLine.size(), DEFAULT_FOREGROUND);
   }
 
  private:
-  void consume(string &current, MultiLineCharIterator &it, Point &end) {
-    if (it.isEnded()) return;
+  size_t continueQuotedString(string_view line, size_t i, LineLexState &state, vector<SyntaxColorInfo> &out) {
+    while (i < line.size()) {
+      if (line[i] == '\\') {
+        // Escaped char - might be the line break itself.
+        i += 2;
+      } else if (line[i] == state.quote) {
+        out.emplace_back(i + 1, DEFAULT_FOREGROUND);
+        state = LineLexState{};
+        return i + 1;
+      } else {
+        i++;
+      }
+    }
+
+    return line.size();
+  }
+
+  size_t continueBoundedComment(string_view line, size_t i, LineLexState &state, vector<SyntaxColorInfo> &out) {
+    string &closing = config.comments.bounded[state.boundedCommentIdx].second;
+    size_t closingPos = i < line.size() ? line.find(closing, i) : string::npos;
 
-    if (it.isRealChar()) {
-      current.push_back(it.current());
-      end.set(it.idx);
+    if (closingPos == string::npos) return line.size();
+
+    out.emplace_back(closingPos + closing.size(), DEFAULT_FOREGROUND);
+    state = LineLexState{};
+    return closingPos + closing.size();
+  }
+
+  bool isOneLinerCommentAt(string_view line, size_t i) const {
+    for (auto &oneLinerComment : config.comments.oneLiners) {
+      if (line.compare(i, oneLinerComment.size(), oneLinerComment) == 0) return true;
     }
 
-    it.next();
+    return false;
   }
 
-  void consume(MultiLineCharIterator &it, Point &end) {
-    if (it.isEnded()) return;
-    if (it.isRealChar()) end.set(it.idx);
-    it.next();
+  int boundedCommentAt(string_view line, size_t i) const {
+    for (int idx = 0; idx < (int)config.comments.bounded.size(); idx++) {
+      auto &opening = config.comments.bounded[idx].first;
+      if (line.compare(i, opening.size(), opening) == 0) return idx;
+    }
+
+    return -1;
   }
 
-  const char *analyzeToken(TokenState state, string &token) {
+  const char *analyzeToken(TokenState state, string_view token) {
     unordered_set<string>::iterator wordIt;
 
     switch (state) {
       case TokenState::Number:
         return config.numberColor;
       case TokenState::Word:
-        wordIt = find(config.keywords.begin(), config.keywords.end(), token);
+        wordIt = config.keywords.find(string(token));
         if (wordIt != config.keywords.end()) return config.keywordColor;
 
         return nullptr;
@@ -621,17 +685,16 @@ struct TokenAnalyzer {
     }
   }
 
-  void registerColorMarks(string &word, Point start, Point end, TokenState state,
-                          vector<vector<SyntaxColorInfo>> &out) {
-    const char *colorResult = analyzeToken(state, word);
-    if (colorResult) {
-      out[start.y].emplace_back(start.x, colorResult);
-
-      for (int i = start.y + 1; i <= end.y; i++) {
-        out[i].emplace_back(0, colorResult);
-      }
+  /**
+   * End position is not included.
+   */
+  void registerColorMarks(string_view line, size_t start, size_t end, TokenState state,
+                          vector<SyntaxColorInfo> &out) {
+    const char *colorResult = analyzeToken(state, line.substr(start, end - start));
 
-      out[end.y].emplace_back(end.x + 1, DEFAULT_FOREGROUND);
+    if (colorResult) {
+      out.emplace_back(start, colorResult);
+      out.emplace_back(end, DEFAULT_FOREGROUND);
     }
   }
 };
@@ -647,7 +710,7 @@ shows
  * @param currentPos
  * @return int
  */
-int nextWordJumpLocation(string &line, int currentPos) {
+int nextWordJumpLocation(string_view line, int currentPos) {
   if (currentPos >= (int)line.size()) return line.size();
   if (currentPos < 0) return 0;
 
@@ -675,7 +738,7 @@ int nextWordJumpLocation(string &line, int currentPos) {
  * @param currentPos
  * @return int
  */
-int prevWordJumpLocation(string &line, int currentPos) {
+int prevWordJumpLocation(string_view line, int currentPos) {
   if (currentPos > (int)line.size()) return line.size();
   if (currentPos < 0) return -1;
 
@@ -693,7 +756,7 @@ int prevWordJumpLocation(string &line, int currentPos) {
   return -1;
 }
 
-int prefixTabOrSpaceLength(string &line) {
+int prefixTabOrSpaceLength(string_view line) {
   auto lineIt = find_if(line.begin(), line.end(), [](auto &c) { return !isspace(c); });
   return distance(line.begin(), lineIt);
 }
@@ -820,7 +883,7 @@ string visibleSubstr(string &s, int pos, int len) {
   return out;
 }
 
-vector<SyntaxColorInfo> searchTermMarkers(string &line, string &searchTerm) {
+vector<SyntaxColorInfo> searchTermMarkers(string_view line, string &searchTerm) {
   vector<SyntaxColorInfo> out{};
 
   size_t from{0};